@@ -0,0 +1,345 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/resource.h>
+
+#include "csv.h"
+
+/* throughput benchmark of parser and writer.
+ *
+ * build:
+ * gcc -O2 -o bench_csv bench_csv.c csv.c
+ *
+ * usage:
+ * bench_csv [SIZE_MB] [REPEAT]
+ *
+ * corpora of about SIZE_MB (defaults to 64) megabytes are generated in temporary files, each one is
+ * parsed and written REPEAT (defaults to 3) times and the best run is reported.
+ * one line of json is printed for each benchmark, so results can be collected and compared across
+ * versions, e.g. `bench_csv | tee bench_output.txt`.
+ *
+ * allocs_per_row counts calls to the allocator of this library. peak_rss_kb is the peak resident
+ * set size of the whole process so far, it only grows over benchmarks.
+ */
+
+
+/* corpus */
+typedef struct {
+    const char *name;
+    char field_delimiter;
+    int line_break;
+    int columns;
+    /* generate a field to fp */
+    void (*gen_field)(FILE *fp, int column, char field_delimiter);
+} corpus_t;
+
+
+static unsigned long long rand_state = 88172645463325252ULL;
+
+/* xorshift, so corpora are the same on all platforms */
+static unsigned long rand_next(void)
+{
+    rand_state ^= rand_state << 13;
+    rand_state ^= rand_state >> 7;
+    rand_state ^= rand_state << 17;
+    return (unsigned long)(rand_state >> 16);
+}
+
+static void gen_numeric(FILE *fp, int column, char field_delimiter)
+{
+    (void)field_delimiter;
+    if (column % 2 == 0)
+        fprintf(fp, "%lu", rand_next() % 1000000);
+    else
+        fprintf(fp, "%lu.%02lu", rand_next() % 10000, rand_next() % 100);
+}
+
+static void gen_text(FILE *fp, int column, char field_delimiter)
+{
+    static const char letters[] = "abcdefghijklmnopqrstuvwxyz0123456789 ";
+    (void)column;
+    (void)field_delimiter;
+    int len = (int)(rand_next() % 12);
+    int i;
+    for (i = 0; i < len; i++)
+        fputc(letters[rand_next() % (sizeof(letters) - 1)], fp);
+}
+
+static void gen_quoted(FILE *fp, int column, char field_delimiter)
+{
+    static const char *const pieces[] = {"lorem", "ipsum", " ", "\"", "\n", "\r\n", "dolor sit amet"};
+    if (column == 0) {
+        fprintf(fp, "%lu", rand_next());
+        return;
+    }
+    fputc('"', fp);
+    int n = 2 + (int)(rand_next() % 8);
+    int i;
+    for (i = 0; i < n; i++) {
+        const char *piece = pieces[rand_next() % (sizeof(pieces) / sizeof(pieces[0]))];
+        if (piece[0] == '"')
+            fputs("\"\"", fp);
+        else if (piece[0] == ' ' && rand_next() % 2)
+            fputc(field_delimiter, fp);
+        else
+            fputs(piece, fp);
+    }
+    fputc('"', fp);
+}
+
+static const corpus_t CORPORA[] = {
+    {"narrow_numeric", ',', LINEBREAK_LF, 8, gen_numeric},
+    {"narrow_numeric_crlf", ',', LINEBREAK_CRLF, 8, gen_numeric},
+    {"narrow_numeric_tab", '\t', LINEBREAK_LF, 8, gen_numeric},
+    {"wide_500", ',', LINEBREAK_LF, 500, gen_text},
+    {"quoted_multiline", ',', LINEBREAK_LF, 6, gen_quoted},
+};
+
+/* generate about `size` bytes of corpus into a temporary file.
+ * returns the file, rewound */
+static FILE *gen_corpus(const corpus_t *corpus, size_t size)
+{
+    FILE *fp = tmpfile();
+    if (fp == NULL) {
+        perror("tmpfile");
+        exit(EXIT_FAILURE);
+    }
+    while ((size_t)ftell(fp) < size) {
+        int i;
+        for (i = 0; i < corpus->columns; i++) {
+            if (i > 0)
+                fputc(corpus->field_delimiter, fp);
+            corpus->gen_field(fp, i, corpus->field_delimiter);
+        }
+        fputs(corpus->line_break == LINEBREAK_CRLF ? "\r\n" : "\n", fp);
+    }
+    rewind(fp);
+    return fp;
+}
+
+
+/* allocator counting allocations */
+static size_t alloc_count = 0;
+
+static void *counting_malloc(size_t size, void *ctx)
+{
+    (void)ctx;
+    alloc_count++;
+    return malloc(size);
+}
+
+static void counting_free(void *ptr, void *ctx)
+{
+    (void)ctx;
+    free(ptr);
+}
+
+static void *counting_realloc(void *ptr, size_t size, void *ctx)
+{
+    (void)ctx;
+    alloc_count++;
+    return realloc(ptr, size);
+}
+
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static long peak_rss_kb(void)
+{
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return -1;
+#ifdef __APPLE__
+    return usage.ru_maxrss / 1024; /* in bytes on macos */
+#else
+    return usage.ru_maxrss;
+#endif
+}
+
+/* result of one run */
+typedef struct {
+    double seconds;
+    size_t bytes;
+    size_t rows;
+    size_t allocs;
+} result_t;
+
+static void report(const char *bench, const corpus_t *corpus, const result_t *result)
+{
+    printf("{\"bench\":\"%s\",\"corpus\":\"%s\",\"bytes\":%zu,\"rows\":%zu,\"seconds\":%.6f,"
+           "\"mb_per_s\":%.2f,\"rows_per_s\":%.0f,\"allocs_per_row\":%.4f,\"peak_rss_kb\":%ld}\n",
+           bench, corpus->name, result->bytes, result->rows, result->seconds,
+           result->bytes / result->seconds / (1024 * 1024), result->rows / result->seconds,
+           result->rows > 0 ? (double)result->allocs / result->rows : 0.0, peak_rss_kb());
+    fflush(stdout);
+}
+
+static void fail(const char *what, csv_error_t *err)
+{
+    fprintf(stderr, "%s failed: code=%d, message=%s\n", what, err->error_code, err->message);
+    csv_error_free(err);
+    exit(EXIT_FAILURE);
+}
+
+
+enum {
+    PARSE_NEXT_ROW,
+    PARSE_NEXT_ROW_INTO,
+    PARSE_NEXT_ROW_VIEW,
+};
+
+static const char *const PARSE_BENCH_NAMES[] = {"parse_next_row", "parse_next_row_into", "parse_next_row_view"};
+
+static void bench_parse(FILE *fp, const corpus_t *corpus, int mode, result_t *result)
+{
+    csv_error_t *err = NULL;
+    rewind(fp);
+    alloc_count = 0;
+    double start = now();
+
+    csv_parser_t *parser = csv_parser_new_with_field_delimiter(fp, corpus->field_delimiter, &err);
+    if (parser == NULL)
+        fail("create csv parser", err);
+
+    size_t rows = 0;
+    if (mode == PARSE_NEXT_ROW) {
+        csv_row_t *row;
+        while ((row = csv_parse_next_row(parser, &err)) != NULL) {
+            rows++;
+            csv_row_free(row);
+        }
+    } else if (mode == PARSE_NEXT_ROW_INTO) {
+        csv_row_t *row = csv_row_new(&err);
+        if (row == NULL)
+            fail("create csv row", err);
+        while (csv_parse_next_row_into(parser, row, &err) == 1)
+            rows++;
+        csv_row_free(row);
+    } else { /* PARSE_NEXT_ROW_VIEW */
+        while (csv_parse_next_row_view(parser, &err) != NULL)
+            rows++;
+    }
+    if (err != NULL)
+        fail("parse csv", err);
+    csv_parser_free(parser);
+
+    result->seconds = now() - start;
+    result->bytes = (size_t)ftell(fp);
+    result->rows = rows;
+    result->allocs = alloc_count;
+}
+
+/* number of distinct rows written by writer benchmark */
+#define WRITE_SAMPLE_ROWS 1024
+
+/* write n rows `times` times to out, which is closed then.
+ * returns bytes written */
+static size_t write_rows(FILE *out, const corpus_t *corpus, csv_row_t **rows, int n, size_t times)
+{
+    csv_error_t *err = NULL;
+    if (out == NULL) {
+        perror("open output");
+        exit(EXIT_FAILURE);
+    }
+    csv_writer_t *writer = csv_writer_new(out, corpus->field_delimiter, QUOTE_MINIMAL, corpus->line_break, &err);
+    if (writer == NULL)
+        fail("create csv writer", err);
+    size_t t;
+    for (t = 0; t < times; t++) {
+        int i;
+        for (i = 0; i < n; i++) {
+            if (csv_write_row(writer, rows[i], &err) == -1)
+                fail("write csv", err);
+        }
+    }
+    if (csv_writer_flush(writer, &err) == -1)
+        fail("flush csv", err);
+    csv_writer_free(writer);
+    long bytes = ftell(out);
+    fclose(out);
+    return bytes > 0 ? (size_t)bytes : 0;
+}
+
+static void bench_write(FILE *fp, const corpus_t *corpus, size_t size, result_t *result)
+{
+    csv_error_t *err = NULL;
+    csv_row_t *rows[WRITE_SAMPLE_ROWS];
+    int n = 0;
+
+    /* rows to write are taken from the corpus */
+    rewind(fp);
+    csv_parser_t *parser = csv_parser_new_with_field_delimiter(fp, corpus->field_delimiter, &err);
+    if (parser == NULL)
+        fail("create csv parser", err);
+    while (n < WRITE_SAMPLE_ROWS && (rows[n] = csv_parse_next_row(parser, &err)) != NULL)
+        n++;
+    if (err != NULL)
+        fail("parse csv", err);
+    csv_parser_free(parser);
+
+    /* size of the rows when written, to know how many times to write them */
+    size_t sample_bytes = write_rows(tmpfile(), corpus, rows, n, 1);
+
+    size_t times = sample_bytes > 0 ? size / sample_bytes + 1 : 1;
+    alloc_count = 0;
+    double start = now();
+    write_rows(fopen("/dev/null", "w"), corpus, rows, n, times);
+    result->seconds = now() - start;
+    result->bytes = sample_bytes * times;
+    result->rows = (size_t)n * times;
+    result->allocs = alloc_count;
+
+    int i;
+    for (i = 0; i < n; i++)
+        csv_row_free(rows[i]);
+}
+
+
+int main(int argc, char *argv[])
+{
+    size_t size = (argc > 1 ? (size_t)atol(argv[1]) : 64) * 1024 * 1024;
+    int repeat = argc > 2 ? atoi(argv[2]) : 3;
+    if (size == 0 || repeat <= 0) {
+        printf("usage: bench_csv [SIZE_MB] [REPEAT]\n");
+        exit(EXIT_FAILURE);
+    }
+
+    csv_allocator_t allocator = {counting_malloc, counting_free, NULL, counting_realloc};
+    csv_set_allocator(&allocator);
+
+    size_t c;
+    for (c = 0; c < sizeof(CORPORA) / sizeof(CORPORA[0]); c++) {
+        const corpus_t *corpus = &CORPORA[c];
+        FILE *fp = gen_corpus(corpus, size);
+        result_t best, result;
+        int mode, i;
+
+        for (mode = PARSE_NEXT_ROW; mode <= PARSE_NEXT_ROW_VIEW; mode++) {
+            for (i = 0; i < repeat; i++) {
+                bench_parse(fp, corpus, mode, &result);
+                if (i == 0 || result.seconds < best.seconds)
+                    best = result;
+            }
+            report(PARSE_BENCH_NAMES[mode], corpus, &best);
+        }
+
+        for (i = 0; i < repeat; i++) {
+            bench_write(fp, corpus, size, &result);
+            if (i == 0 || result.seconds < best.seconds)
+                best = result;
+        }
+        report("write_row", corpus, &best);
+
+        fclose(fp);
+    }
+    return 0;
+}
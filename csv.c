@@ -1,14 +1,70 @@
+#if defined(CSV_WITH_DIRECT_IO) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE /* O_DIRECT */
+#endif
+#if !defined(_POSIX_C_SOURCE) && !defined(_GNU_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
+
 #include <assert.h>
 #include <errno.h>
+#include <math.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include "csv.h"
 
+#ifdef CSV_HAVE_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef CSV_WITH_THREADS
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#ifdef CSV_WITH_ZLIB
+#include <limits.h>
+#include <zlib.h>
+#endif
+
+#ifdef CSV_WITH_ZSTD
+#include <zstd.h>
+#endif
+
+#ifdef CSV_WITH_DIRECT_IO
+#include <aio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#if !defined(CSV_NO_SIMD) && (defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__)))
+#define CSV_SCAN_SSE2
+#include <emmintrin.h>
+#if defined(__GNUC__)
+#define CSV_SCAN_AVX2
+#include <immintrin.h>
+#endif
+#elif !defined(CSV_NO_SIMD) && defined(__aarch64__)
+#define CSV_SCAN_NEON
+#include <arm_neon.h>
+#endif
+
+/* flags of error */
+enum {
+    ERROR_STATIC = 1, /* not allocated, csv_error_free does nothing to it */
+};
+
+/* an error not allocated, with a static message and no context */
+#define STATIC_ERROR(error_code, message) {error_code, (char *)message, 0, -1, 0, 0, ERROR_STATIC}
+
 /* the global oom error.
  * suppose got OOM when generate an error with user specified error code,
  * we need to return an error under this situation.
  */
-static csv_error_t GLOBAL_OOM = {CSV_ENOMEMORY, "out of memory"};
+static csv_error_t GLOBAL_OOM = STATIC_ERROR(CSV_ENOMEMORY, "out of memory");
 
 /* return the global oom error */
 static csv_error_t *csv_error_oom()
@@ -16,44 +72,129 @@ static csv_error_t *csv_error_oom()
     return &GLOBAL_OOM;
 }
 
+static void *default_malloc(size_t size, void *ctx)
+{
+    (void)ctx;
+    return malloc(size);
+}
+
+static void default_free(void *p, void *ctx)
+{
+    (void)ctx;
+    free(p);
+}
+
+static void *default_realloc(void *p, size_t size, void *ctx)
+{
+    (void)ctx;
+    return realloc(p, size);
+}
+
+/* the allocator used for all dynamically allocated memory, see `csv_set_allocator` */
+static csv_allocator_t ALLOCATOR = {default_malloc, default_free, NULL, default_realloc};
+
+void csv_set_allocator(const csv_allocator_t *allocator)
+{
+    if (allocator == NULL) {
+        ALLOCATOR.malloc_fn = default_malloc;
+        ALLOCATOR.free_fn = default_free;
+        ALLOCATOR.ctx = NULL;
+        ALLOCATOR.realloc_fn = default_realloc;
+    } else {
+        ALLOCATOR = *allocator;
+    }
+}
+
+/* allocations made by this thread, so that those of a traced parser or writer can be counted */
+#ifdef CSV_WITH_THREADS
+static __thread uint64_t thread_allocations = 0;
+#else
+static uint64_t thread_allocations = 0;
+#endif
+
+/* free wrapper, release memory with the allocator. p can be NULL */
+static void xfree(void *p)
+{
+    if (p != NULL)
+        ALLOCATOR.free_fn(p, ALLOCATOR.ctx);
+}
+
 /* malloc wrapper. when oom, return the global oom error */
 static void *xmalloc(size_t len, csv_error_t **err)
 {
-    void *p = malloc(len);
+    void *p = ALLOCATOR.malloc_fn(len, ALLOCATOR.ctx);
     if (p == NULL) {
         *err = csv_error_oom();
         return NULL;
     }
+    thread_allocations++;
     return p;
 }
 
+/* realloc wrapper, resize memory at p (which can be NULL) to len bytes, keeping at least its first
+ * `keep` bytes. when oom, return the global oom error, and p is still valid */
+static void *xrealloc(void *p, size_t keep, size_t len, csv_error_t **err)
+{
+    void *new_p;
+    if (ALLOCATOR.realloc_fn != NULL) {
+        new_p = ALLOCATOR.realloc_fn(p, len, ALLOCATOR.ctx);
+        if (new_p == NULL) {
+            *err = csv_error_oom();
+            return NULL;
+        }
+        thread_allocations++;
+        return new_p;
+    }
+
+    new_p = xmalloc(len, err);
+    if (new_p == NULL)
+        return NULL;
+    if (keep > 0)
+        memcpy(new_p, p, keep);
+    xfree(p);
+    return new_p;
+}
+
 csv_error_t *csv_error_new(int error_code, const char *message)
 {
     if (error_code == CSV_ENOMEMORY)
         return csv_error_oom();
 
-    csv_error_t *err = (csv_error_t *)malloc(sizeof(csv_error_t));
+    /* message is stored right after the error, in one allocation */
+    size_t len = strlen(message);
+    csv_error_t *err = (csv_error_t *)ALLOCATOR.malloc_fn(sizeof(csv_error_t) + len + 1, ALLOCATOR.ctx);
     if (err == NULL)
         return csv_error_oom();
 
     err->error_code = error_code;
-    err->message = (char *)malloc(strlen(message) + 1);
-    if (err->message == NULL) {
-        free(err);
-        return csv_error_oom();
-    }
-    strcpy(err->message, message);
-
+    err->message = (char *)(err + 1);
+    memcpy(err->message, message, len + 1);
+    err->row = 0;
+    err->column = -1;
+    err->row_offset = 0;
+    err->offset = 0;
+    err->flags = 0;
     return err;
 }
 
-/* free the error. if the error is the global oom err, do nothing */
+csv_error_t *csv_error_copy(const csv_error_t *err)
+{
+    csv_error_t *copy = csv_error_new(err->error_code, err->message);
+    if (copy != csv_error_oom()) {
+        copy->row = err->row;
+        copy->column = err->column;
+        copy->row_offset = err->row_offset;
+        copy->offset = err->offset;
+    }
+    return copy;
+}
+
+/* free the error. if the error is not allocated, i.e. the global oom err, do nothing */
 void csv_error_free(csv_error_t *err)
 {
-    if (err->error_code == CSV_ENOMEMORY)
+    if (err->flags & ERROR_STATIC)
         return;
-    free(err->message);
-    free(err);
+    xfree(err);
 }
 
 enum {
@@ -65,6 +206,7 @@ static const char QUOTE_CHAR = '"';
 static const char COMMA_CHAR = ',';
 static const char CR_CHAR = '\r';
 static const char LF_CHAR = '\n';
+static const char TAB_CHAR = '\t';
 
 static const char *CR_STR = "\r";
 static const char *LF_STR = "\n";
@@ -83,145 +225,74 @@ static int is_valid_field_delimiter(char c)
     return 1;
 }
 
-/* parser */
-struct csv_parser_t {
-    FILE *file;
-    char field_delimiter;
-};
-
-csv_parser_t *csv_parser_new(FILE *file, csv_error_t **err)
-{
-    csv_parser_t *parser = xmalloc(sizeof(csv_parser_t), err);
-    if (parser == NULL)
-        return NULL;
-
-    parser->file = file;
-    parser->field_delimiter = COMMA_CHAR;
-    return parser;
-}
-
-csv_parser_t *csv_parser_new_with_field_delimiter(FILE *file, char field_delimiter, csv_error_t **err)
-{
-    if (!is_valid_field_delimiter(field_delimiter)) {
-        *err = csv_error_new(CSV_EINVALID_FIELD_DELIMITER, "invalid field delimiter");
-        return NULL;
-    }
+/* tracing of parser or writer, see `csv_parser_trace` */
+typedef struct {
+    int enabled;
+    size_t interval;
+    csv_stats_callback_t callback;
+    void *ctx;
+    uint64_t reported_rows; /* rows when callback was called last time */
+    int finished;           /* callback has been called when parsing finishes */
+} trace_t;
 
-    csv_parser_t *parser = csv_parser_new(file, err);
-    if (parser != NULL)
-        parser->field_delimiter = field_delimiter;
-    return parser;
-}
+/* where a traced call begins */
+typedef struct {
+    uint64_t ns;
+    uint64_t io_ns;
+    uint64_t allocations;
+} trace_mark_t;
 
-void csv_parser_free(csv_parser_t *parser)
+static uint64_t now_ns(void)
 {
-    free(parser);
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
 }
 
-/* csv row */
-struct csv_row_t {
-    int len;
-    int capacity;
-	char **fields;
-};
-
-csv_row_t *csv_row_new(csv_error_t **err)
+static void trace_init(trace_t *trace)
 {
-    csv_row_t *row = xmalloc(sizeof(csv_row_t), err);
-    if (row == NULL)
-        return NULL;
-
-    row->len = 0;
-    row->capacity = 32; /* keey it small for dev */
-    row->fields = xmalloc(row->capacity * sizeof(char *), err);
-    if (row->fields == NULL) {
-        free(row);
-        return NULL;
-    }
-
-    int i;
-    for (i = 0; i < row->capacity; i++)
-        row->fields[i] = NULL;
-    return row;
+    trace->enabled = 0;
+    trace->interval = 0;
+    trace->callback = NULL;
+    trace->ctx = NULL;
+    trace->reported_rows = 0;
+    trace->finished = 0;
 }
 
-void csv_row_free(csv_row_t *row)
+static void trace_begin(const csv_stats_t *stats, trace_mark_t *mark)
 {
-    int i;
-    for (i = 0; i < row->capacity; i++)
-        free(row->fields[i]);
-    free(row->fields);
-    free(row);
+    mark->ns = now_ns();
+    mark->io_ns = stats->io_ns;
+    mark->allocations = thread_allocations;
 }
 
-/* TODO: more aggressive reuse of dynamically allocated memory */
-void csv_row_reset(csv_row_t *row)
+/* account the call begun at mark, its time besides io is spent on scanning */
+static void trace_end(csv_stats_t *stats, const trace_mark_t *mark)
 {
-    int i;
-    for (i = 0; i < row->len; i++) {
-        free(row->fields[i]);
-        row->fields[i] = NULL;
-    }
-    row->len = 0;
+    stats->scan_ns += now_ns() - mark->ns - (stats->io_ns - mark->io_ns);
+    stats->allocations += thread_allocations - mark->allocations;
 }
 
-/* expand the fields of the row.
- * returns 0 when succeeds, -1 when fails */
-static int csv_row_expand_fields(csv_row_t *row, csv_error_t **err)
+/* whether callback should be called, after `rows` rows, or when finished */
+static int trace_due(trace_t *trace, uint64_t rows, int finished)
 {
-    int new_cap = row->capacity * 2;
-    char **new_fields = xmalloc(new_cap * sizeof(char *), err);
-    if (new_fields == NULL) {
-        return FAIL;
+    if (trace->callback == NULL || trace->finished)
+        return 0;
+    if (finished) {
+        trace->finished = 1;
+    } else if (trace->interval == 0 || rows - trace->reported_rows < trace->interval) {
+        return 0;
     }
-
-    int i;
-    for (i = 0; i < row->len; i++)
-        new_fields[i] = row->fields[i];
-    for (i = row->len; i < new_cap; i++)
-        new_fields[i] = NULL;
-
-    free(row->fields);
-    row->capacity = new_cap;
-    row->fields = new_fields;
-    return SUCCEED;
-}
-
-int csv_row_field_count(const csv_row_t *row)
-{
-    return row->len;
-}
-
-char *csv_row_field_get(const csv_row_t *row, int idx)
-{
-    return row->fields[idx];
-}
-
-int csv_row_append_field(csv_row_t *row, const char *field, size_t len, csv_error_t **err)
-{
-    if (row->len >= row->capacity && csv_row_expand_fields(row, err) == FAIL)
-        return FAIL;
-
-    char *s = xmalloc(len + 1, err);
-    if (s == NULL)
-        return FAIL;
-
-    size_t i;
-    for (i = 0; i < len; i++)
-        s[i] = field[i];
-    s[i] = '\0';
-
-    row->fields[row->len++] = s;
-    return SUCCEED;
+    trace->reported_rows = rows;
+    return 1;
 }
 
-/* the buffer used when parse
- * TODO: maybe make parser own the buffer to simplify the code
- */
+/* the buffer used when parse, to collect content of escaped fields */
 typedef struct {
-    int len;
-    int capacity;
+    size_t len;
+    size_t capacity;
 	char *p;
+    uint64_t growths; /* times it is expanded */
 } buffer_t;
 
 /* create a buffer
@@ -234,9 +305,10 @@ static buffer_t *buffer_new(csv_error_t **err)
 
     buffer->len = 0;
     buffer->capacity = 256;
+    buffer->growths = 0;
     buffer->p = xmalloc(buffer->capacity, err);
     if (buffer->p == NULL) {
-        free(buffer);
+        xfree(buffer);
         return NULL;
     }
 
@@ -246,8 +318,8 @@ static buffer_t *buffer_new(csv_error_t **err)
 /* destroy the buffer */
 static void buffer_free(buffer_t *buffer)
 {
-    free(buffer->p);
-    free(buffer);
+    xfree(buffer->p);
+    xfree(buffer);
 }
 
 /* reset the buffer, so it can be used like an fresh new one */
@@ -256,284 +328,4950 @@ static void buffer_reset(buffer_t *buffer)
     buffer->len = 0;
 }
 
-/* put a char to the end of the buffer.
- * will automatically expand to accommodate it.
+/* make room for len more bytes at the end of the buffer.
  * returns 0 when succeeds, -1 when fails */
-static int buffer_putc(buffer_t *buffer, char c, csv_error_t **err)
+static int buffer_reserve(buffer_t *buffer, size_t len, csv_error_t **err)
 {
-    if (buffer->len >= buffer->capacity) {
+    if (len > buffer->capacity - buffer->len) {
         /* expand */
-        int new_cap = buffer->capacity * 2;
-        char *new_p = xmalloc(new_cap, err);
+        size_t new_cap = buffer->capacity;
+        do {
+            if (new_cap > SIZE_MAX / 2) {
+                *err = csv_error_oom();
+                return FAIL;
+            }
+            new_cap *= 2;
+        } while (len > new_cap - buffer->len);
+        char *new_p = xrealloc(buffer->p, buffer->len, new_cap, err);
         if (new_p == NULL)
             return FAIL;
 
-
-        int i;
-        for (i = 0; i < buffer->capacity; i++)
-            new_p[i] = buffer->p[i];
         buffer->capacity = new_cap;
-        free(buffer->p);
         buffer->p = new_p;
+        buffer->growths++;
     }
-
-    buffer->p[buffer->len++] = c;
     return SUCCEED;
 }
 
-/* add a new field to the end of the row with buffer's content
+/* put len bytes to the end of the buffer.
+ * will automatically expand to accommodate them.
  * returns 0 when succeeds, -1 when fails */
-static int csv_row_append_field_with_buffer(csv_row_t *row, const buffer_t *buffer, csv_error_t **err)
+static int buffer_append(buffer_t *buffer, const char *s, size_t len, csv_error_t **err)
 {
-    return csv_row_append_field(row, buffer->p, buffer->len, err);
+    if (buffer_reserve(buffer, len, err) == FAIL)
+        return FAIL;
+
+    memcpy(buffer->p + buffer->len, s, len);
+    buffer->len += len;
+    return SUCCEED;
 }
 
+/* chunk size bounds of parallel parsing */
+#ifndef CSV_PARALLEL_MIN_CHUNK
+#define CSV_PARALLEL_MIN_CHUNK (1024 * 1024)
+#endif
+#ifndef CSV_PARALLEL_MAX_CHUNK
+#define CSV_PARALLEL_MAX_CHUNK (16 * 1024 * 1024)
+#endif
 
-enum PARSE_STATE {
-    ST_START,   /* before parse a field */
-    ST_INFIELD, /* parsing an field */
-};
+/* initial size of the read buffer of parser.
+ * it will be doubled when a single row does not fit in. */
+#ifndef CSV_READ_BUFFER_SIZE
+#define CSV_READ_BUFFER_SIZE (64 * 1024)
+#endif
 
+/* scanner and copier for unquoted fields, see `select_scan_unquoted` */
+typedef const char *(*scan_func)(const char *p, const char *end, char field_delimiter);
+typedef const char *(*copy_func)(char *dst, const char *p, const char *end, char field_delimiter);
+static scan_func select_scan_unquoted(void);
+static copy_func select_copy_unquoted(void);
 
-/* lines are separated by `\r` or `\n` or `\r\n`.
- * when `\r` encountered, consume possible `\n` */
-static void consume_end_of_line(int c, FILE *file)
-{
-    if (c == CR_CHAR) {
-        int lookahead = fgetc(file);
-        if (lookahead != LF_CHAR && lookahead != EOF)
-            ungetc(lookahead, file);
-    }
-}
+/* parse kernel, which parses fields of the next row, see `select_parse_fields` */
+typedef int (*parse_func)(csv_parser_t *parser, csv_row_t *row, int *columns, csv_error_t **err);
+static void parser_set_field_delimiter(csv_parser_t *parser, char field_delimiter);
+static void parser_check_cr(csv_parser_t *parser, const char *p, size_t len);
 
-csv_row_t *csv_parse_next_row(csv_parser_t *parser, csv_error_t **err)
-{
-    buffer_t *buffer = buffer_new(err);
-    if (buffer == NULL)
-        return NULL;
+/* owner of read buffer of parser */
+enum {
+    BUF_OWNED,    /* allocated and refilled by parser */
+    BUF_MAPPED,   /* the whole input mapped into memory by parser, see `csv_parser_new_mmap` */
+    BUF_BORROWED, /* the whole input given by caller, see `csv_parser_new_mem` */
+};
 
-    csv_row_t *row = csv_row_new(err);
-    if (row == NULL)
-        return NULL;
+/* state of scanning for complete rows of push parser, see `push_row_complete` */
+enum {
+    SCAN_UNQUOTED,
+    SCAN_QUOTED,
+    SCAN_CLOSED, /* right after a closing quote */
+};
 
-    int state = ST_START;
-    int quoted = 0;
+/* parser */
+struct csv_parser_t {
+    FILE *file;
+    csv_source_t source; /* read instead of file if read_fn is set, see `csv_parser_new_source` */
+    char field_delimiter;
+    scan_func scan_unquoted;
+    parse_func parse_fields;
+    int cr_free; /* no `\r` has been read, so parse_fields can be one for `\n` only */
+    /* on memory, only bytes in [cr_from, cr_checked) have been checked for `\r`. while a kernel for `\n`
+     * only parses, end is clipped to cr_checked and cr_end is the end of input, see `parser_parse_fields` */
+    size_t cr_from;
+    size_t cr_checked;
+    size_t cr_end;
 
-    int c;
-    int lookahead;
-    while (1) {
-        c = fgetc(parser->file);
-        switch (state) {
-            case ST_START:
-                if (c == QUOTE_CHAR) {
-                    /* this means, when state is ST_START, quoted is always 0 */
-                    quoted = 1;
-                    state = ST_INFIELD;
-                } else if (c == EOF) {
-                    if (ferror(parser->file)) { /* io error happend*/
-                        *err = csv_error_new(CSV_EIO, strerror(errno));
-                        goto FAILURE_RETURN;
-                    }
+    /* read buffer. bytes in [pos, end) have been read from file but not parsed yet.
+     * bytes of the row being parsed (those after row_start) are kept when the buffer is refilled,
+     * so that a field can be taken out of the buffer in one go when its end is found. */
+    char *buf;
+    size_t capacity;
+    size_t row_start;   /* where the current row starts */
+    size_t field_start; /* where the (not yet copied) content of the current field starts */
+    size_t pos;
+    size_t end;
+    int eof;            /* end of file reached, no need to read any more */
+    int buf_kind;       /* who owns buf, see BUF_* */
+    uint64_t buf_offset; /* offset in input of buf[0], see `csv_parser_offset` */
 
-                    /* if this row has previous field(s), append an empty string field,
-                     * since field_delimiter has been encountered previously.
-                     * otherwise, this line is empty, return NULL to indicate parsing finished.
-                     */
-                    if (row->len > 0) {
-                        if (csv_row_append_field_with_buffer(row, buffer, err) == FAIL) {
-                            goto FAILURE_RETURN;
-                        }
-                        buffer_free(buffer);
-                        return row;
-                    } else {
-                        csv_row_free(row);
-                        buffer_free(buffer);
-                        return NULL;
-                    }
-                } else if (c == CR_CHAR || c == LF_CHAR) {
-                    consume_end_of_line(c, parser->file);
+    /* push parser, input is fed by caller instead of read from file, see `csv_parser_feed`.
+     * a row is only parsed when it is complete, which is found by scanning from scan_pos, with
+     * scan_quoted telling whether scan_pos is in a quoted field, see SCAN_* */
+    int push;
+    size_t scan_pos;
+    int scan_quoted;
 
-                    /* if this row has previous field(s), append an empty string field,
-                     * since field_delimiter has been encountered previously.
-                     * otherwise, this line is empty, we have a row with zero fields
-                     */
-                    if (row->len > 0) {
-                        if (csv_row_append_field_with_buffer(row, buffer, err) == FAIL) {
-                            goto FAILURE_RETURN;
-                        }
-                    }
-                    buffer_free(buffer);
-                    return row;
-                } else if (c == parser->field_delimiter) {
-                    /* empty string field */
-                    if (csv_row_append_field_with_buffer(row, buffer, err) == FAIL) {
-                        goto FAILURE_RETURN;
-                    }
-                    /* get ready for next row */
-                    buffer_reset(buffer);
-                    state = ST_START;
-                    quoted = 0;
-                } else { /* normal char */
-                    if (buffer_putc(buffer, c, err) == FAIL) {
-                        goto FAILURE_RETURN;
-                    }
-                    state = ST_INFIELD;
-                }
-                break;
+    /* content of escaped fields in the current row, begins at escape_start for the current field */
+    buffer_t *scratch;
+    size_t escape_start;
 
-            case ST_INFIELD:
-                if (c == QUOTE_CHAR) {
-                    if (!quoted) {
-                        *err = csv_error_new(CSV_EINVALID_FORMAT, "quote(\") should be quoted");
-                        goto FAILURE_RETURN;
-                    }
+    csv_row_t *view_row; /* the row returned by csv_parse_next_row_view */
 
-                    /* when quoted, look ahead to check if c indicates escape or field end or row end or illegal format */
-                    lookahead = fgetc(parser->file);
-                    if (lookahead == QUOTE_CHAR) { /* escape */
-                        if (buffer_putc(buffer, QUOTE_CHAR, err) == FAIL)
-                            goto FAILURE_RETURN;
-                    } else if (lookahead == parser->field_delimiter) { /* end of field */
-                        if (csv_row_append_field_with_buffer(row, buffer, err) == FAIL) {
-                            goto FAILURE_RETURN;
-                        }
-                        buffer_reset(buffer);
-                        state = ST_START;
-                        quoted = 0;
-                    } else if (lookahead == CR_CHAR || lookahead == LF_CHAR) { /* end of row */
-                        consume_end_of_line(c, parser->file);
-                        if (csv_row_append_field_with_buffer(row, buffer, err) == FAIL) {
-                            goto FAILURE_RETURN;
-                        }
-                        buffer_free(buffer);
-                        return row;
-                    } else { /* otherwise, illegal format */
-                        *err = csv_error_new(CSV_EINVALID_FORMAT, "closing quote can only followed by `\r\n` or field_delimiter");
-                        goto FAILURE_RETURN;
-                    }
-                } else if (c == EOF) {
-                    if (ferror(parser->file)) { /* io error happend*/
-                        *err = csv_error_new(CSV_EIO, strerror(errno));
-                        goto FAILURE_RETURN;
-                    }
-                    if (quoted) {
-                        *err = csv_error_new(CSV_EINVALID_FORMAT, "unclosed quote");
-                        goto FAILURE_RETURN;
-                    } else {
-                        /* treat like end of row.
-                         * next invoke of csv_parse_next_row will return NULL to indicate parsing finished */
-                        if (csv_row_append_field_with_buffer(row, buffer, err) == FAIL) {
-                            goto FAILURE_RETURN;
-                        }
-                        buffer_free(buffer);
-                        return row;
-                    }
-                } else if (c == CR_CHAR || c == LF_CHAR) {
-                    /* when quoted, \r and \n are just like normal characters
-                     * otherwise, end of row */
-                    if (quoted) {
-                        if (buffer_putc(buffer, c, err) == FAIL)
-                            goto FAILURE_RETURN;
-                    } else {
-                        consume_end_of_line(c, parser->file);
-                        if (csv_row_append_field_with_buffer(row, buffer, err) == FAIL) {
-                            goto FAILURE_RETURN;
-                        }
-                        buffer_free(buffer);
-                        return row;
-                    }
-                } else if (c == parser->field_delimiter) {
-                    /* when quoted, field_delimiter is just like normal characters
-                     * otherwise, end of field */
-                    if (quoted) {
-                        if (buffer_putc(buffer, c, err) == FAIL)
-                            goto FAILURE_RETURN;
-                    } else {
-                        if (csv_row_append_field_with_buffer(row, buffer, err) == FAIL) {
-                            goto FAILURE_RETURN;
-                        }
-                        buffer_reset(buffer);
-                        state = ST_START;
-                        quoted = 0;
-                    }
-                }
-                else { /* normal char */
-                    if (buffer_putc(buffer, c, err) == FAIL)
-                        goto FAILURE_RETURN;
-                }
-                break;
+    /* column projection, see `csv_parser_set_columns`. selected is NULL when all columns are kept */
+    unsigned char *selected; /* whether each of the first selected_width columns is kept */
+    int selected_width;
+    int selected_count;      /* number of distinct columns kept */
+    int *projection;         /* the i-th field of row is the projection[i]-th kept column in column order */
+    int projection_len;
+    int projection_identity; /* projection[i] == i for all i, so fields are already in place */
+    int *field_of;           /* index in row of each of the first selected_width columns, or -1 */
 
-        }
-    }
+    /* header, see `csv_parser_read_header`. header_index is a hash table of indices of columns
+     * with open addressing, -1 for empty slots */
+    csv_row_t *header;
+    int *header_index;
+    size_t header_index_cap; /* power of 2 */
 
-FAILURE_RETURN:
-    csv_row_free(row);
-    buffer_free(buffer);
-    return NULL;
-}
+    /* types of fields, see `csv_parser_set_schema` */
+    int *types;
+    int types_len;
 
+    /* how malformed rows are handled, see `csv_parser_set_error_policy` */
+    int error_policy;
+    csv_bad_row_callback_t bad_row_callback;
+    void *bad_row_ctx;
+    size_t bad_rows;
+    int row_bad; /* the current row has been counted as bad */
 
-/* writer */
-struct csv_writer_t {
-    FILE *file;
-    char field_delimiter;
-    int quote_style;
-    int line_break;
-};
+    /* size of rows to allocate, of the previous one or hinted, see `csv_parser_set_row_hint` */
+    int row_fields;
+    size_t row_bytes;
+    int row_collected; /* fields collected for the last row, before projection */
 
+    /* statistics, see `csv_parser_stats`. rows include the header */
+    csv_stats_t stats;
+    trace_t trace;
 
-csv_writer_t *csv_writer_new(FILE *file, char field_delimiter, int quote_style, int line_break, csv_error_t **err)
+    /* error of parsing, filled and returned instead of allocated, see `parser_error` */
+    csv_error_t error;
+    char error_text[128]; /* message of error */
+};
+
+/* create a parser without read buffer.
+ * return the parser if succeeds. otherwise return NULL and err will be set */
+static csv_parser_t *parser_new(FILE *file, csv_error_t **err)
 {
-    if (!is_valid_field_delimiter(field_delimiter)) {
-        *err = csv_error_new(CSV_EINVALID_FIELD_DELIMITER, "invalid field delimiter");
-        return NULL;
-    }
-    if (quote_style != QUOTE_ALL && quote_style != QUOTE_MINIMAL) {
-        *err = csv_error_new(CSV_EINVALID_QUOTE_STYLE, "invalid quote style");
-        return NULL;
-    }
-    if (line_break != LINEBREAK_LF && line_break != LINEBREAK_CRLF && line_break != LINEBREAK_CR) {
-        *err = csv_error_new(CSV_EINVALID_LINEBREAK, "invalid line break");
+    csv_parser_t *parser = xmalloc(sizeof(csv_parser_t), err);
+    if (parser == NULL)
         return NULL;
-    }
 
-    csv_writer_t *writer = xmalloc(sizeof(csv_writer_t), err);
-    if (writer == NULL)
+    parser->scratch = buffer_new(err);
+    if (parser->scratch == NULL) {
+        xfree(parser);
         return NULL;
+    }
 
-    writer->file = file;
-    writer->field_delimiter = field_delimiter;
-    writer->quote_style = quote_style;
-    writer->line_break = line_break;
-    return writer;
+    parser->file = file;
+    parser->source.read_fn = NULL;
+    parser->source.close_fn = NULL;
+    parser->source.ctx = NULL;
+    parser_set_field_delimiter(parser, COMMA_CHAR);
+    parser->scan_unquoted = select_scan_unquoted();
+    parser->buf = NULL;
+    parser->capacity = 0;
+    parser->buf_kind = BUF_OWNED;
+    parser->buf_offset = 0;
+    parser->row_start = 0;
+    parser->field_start = 0;
+    parser->pos = 0;
+    parser->end = 0;
+    parser->eof = 0;
+    parser->push = 0;
+    parser->scan_pos = 0;
+    parser->scan_quoted = SCAN_UNQUOTED;
+    parser->escape_start = 0;
+    parser->view_row = NULL;
+    parser->selected = NULL;
+    parser->selected_width = 0;
+    parser->selected_count = 0;
+    parser->projection = NULL;
+    parser->projection_len = 0;
+    parser->projection_identity = 1;
+    parser->field_of = NULL;
+    parser->header = NULL;
+    parser->header_index = NULL;
+    parser->header_index_cap = 0;
+    parser->types = NULL;
+    parser->types_len = 0;
+    parser->error_policy = CSV_ERRORS_STRICT;
+    parser->bad_row_callback = NULL;
+    parser->bad_row_ctx = NULL;
+    parser->bad_rows = 0;
+    parser->row_bad = 0;
+    parser->row_fields = 0;
+    parser->row_bytes = 0;
+    parser->row_collected = 0;
+    memset(&parser->stats, 0, sizeof(csv_stats_t));
+    trace_init(&parser->trace);
+    parser->error.flags = ERROR_STATIC;
+    parser->error.message = parser->error_text;
+    return parser;
 }
 
-csv_writer_t *csv_writer_default(FILE *file, csv_error_t **err)
+csv_parser_t *csv_parser_new(FILE *file, csv_error_t **err)
 {
-    return csv_writer_new(file, COMMA_CHAR, QUOTE_MINIMAL, LINEBREAK_LF, err);
-}
+    csv_parser_t *parser = parser_new(file, err);
+    if (parser == NULL)
+        return NULL;
+
+    parser->capacity = CSV_READ_BUFFER_SIZE;
+    parser->buf = xmalloc(parser->capacity, err);
+    if (parser->buf == NULL) {
+        csv_parser_free(parser);
+        return NULL;
+    }
+    return parser;
+}
+
+csv_parser_t *csv_parser_new_with_field_delimiter(FILE *file, char field_delimiter, csv_error_t **err)
+{
+    if (!is_valid_field_delimiter(field_delimiter)) {
+        *err = csv_error_new(CSV_EINVALID_FIELD_DELIMITER, "invalid field delimiter");
+        return NULL;
+    }
+
+    csv_parser_t *parser = csv_parser_new(file, err);
+    if (parser != NULL)
+        parser_set_field_delimiter(parser, field_delimiter);
+    return parser;
+}
+
+void csv_parser_free(csv_parser_t *parser)
+{
+    if (parser->source.close_fn != NULL)
+        parser->source.close_fn(parser->source.ctx);
+    if (parser->view_row != NULL)
+        csv_row_free(parser->view_row);
+    if (parser->header != NULL)
+        csv_row_free(parser->header);
+    xfree(parser->header_index);
+    xfree(parser->selected);
+    xfree(parser->projection);
+    xfree(parser->field_of);
+    xfree(parser->types);
+    buffer_free(parser->scratch);
+    if (parser->buf_kind == BUF_OWNED)
+        xfree(parser->buf);
+#ifdef CSV_HAVE_MMAP
+    else if (parser->buf_kind == BUF_MAPPED && parser->buf != NULL)
+        munmap(parser->buf, parser->capacity);
+#endif
+    xfree(parser);
+}
+
+int csv_parser_set_error_policy(csv_parser_t *parser, int policy, csv_bad_row_callback_t callback, void *ctx,
+                                csv_error_t **err)
+{
+    if (policy != CSV_ERRORS_STRICT && policy != CSV_ERRORS_SKIP_ROW && policy != CSV_ERRORS_TOLERANT) {
+        *err = csv_error_new(CSV_EINVALID_VALUE, "invalid error policy");
+        return FAIL;
+    }
+    parser->error_policy = policy;
+    parser->bad_row_callback = callback;
+    parser->bad_row_ctx = ctx;
+    return SUCCEED;
+}
+
+size_t csv_parser_bad_rows(const csv_parser_t *parser)
+{
+    return parser->bad_rows;
+}
+
+int csv_parser_set_row_hint(csv_parser_t *parser, int fields, size_t bytes, csv_error_t **err)
+{
+    if (fields < 0) {
+        *err = csv_error_new(CSV_EINVALID_VALUE, "count of fields should not be negative");
+        return FAIL;
+    }
+    parser->row_fields = fields;
+    parser->row_bytes = bytes;
+    /* escaped fields of a row are collected in scratch */
+    return buffer_reserve(parser->scratch, bytes, err);
+}
+
+void csv_parser_stats(const csv_parser_t *parser, csv_stats_t *stats)
+{
+    *stats = parser->stats;
+    stats->bytes = parser->buf_offset + parser->pos;
+    stats->buffer_growths += parser->scratch->growths;
+}
+
+void csv_parser_trace(csv_parser_t *parser, size_t interval, csv_stats_callback_t callback, void *ctx)
+{
+    parser->trace.enabled = 1;
+    parser->trace.interval = interval;
+    parser->trace.callback = callback;
+    parser->trace.ctx = ctx;
+    parser->trace.reported_rows = parser->stats.rows;
+}
+
+/* call callback of a traced parser if it is due */
+static void parser_report(csv_parser_t *parser, int finished)
+{
+    if (trace_due(&parser->trace, parser->stats.rows, finished)) {
+        csv_stats_t stats;
+        csv_parser_stats(parser, &stats);
+        parser->trace.callback(&stats, parser->trace.ctx);
+    }
+}
+
+int csv_parser_set_columns(csv_parser_t *parser, const int *columns, int n, csv_error_t **err)
+{
+    int i;
+    int width = 0;
+    for (i = 0; i < n; i++) {
+        if (columns[i] < 0) {
+            *err = csv_error_new(CSV_EINVALID_COLUMN, "invalid column index");
+            return FAIL;
+        }
+        if (columns[i] >= width)
+            width = columns[i] + 1;
+    }
+
+    if (n == 0) { /* keep all columns */
+        xfree(parser->selected);
+        xfree(parser->projection);
+        xfree(parser->field_of);
+        parser->selected = NULL;
+        parser->projection = NULL;
+        parser->field_of = NULL;
+        parser->selected_width = 0;
+        parser->selected_count = 0;
+        parser->projection_len = 0;
+        parser->projection_identity = 1;
+        return SUCCEED;
+    }
+
+    unsigned char *selected = xmalloc(width, err);
+    int *projection = xmalloc(n * sizeof(int), err);
+    int *rank = xmalloc(width * sizeof(int), err); /* reused as field_of later */
+    if (selected == NULL || projection == NULL || rank == NULL) {
+        xfree(selected);
+        xfree(projection);
+        xfree(rank);
+        return FAIL;
+    }
+
+    /* fields of a row are collected in column order, the rank of a column in them is the number
+     * of kept columns before it */
+    memset(selected, 0, width);
+    for (i = 0; i < n; i++)
+        selected[columns[i]] = 1;
+    int count = 0;
+    for (i = 0; i < width; i++) {
+        rank[i] = count;
+        count += selected[i];
+    }
+    int identity = n == count;
+    for (i = 0; i < n; i++) {
+        projection[i] = rank[columns[i]];
+        identity = identity && projection[i] == i;
+    }
+    int *field_of = rank;
+    for (i = 0; i < width; i++)
+        field_of[i] = -1;
+    for (i = n - 1; i >= 0; i--)
+        field_of[columns[i]] = i;
+
+    xfree(parser->selected);
+    xfree(parser->projection);
+    xfree(parser->field_of);
+    parser->selected = selected;
+    parser->field_of = field_of;
+    parser->selected_width = width;
+    parser->selected_count = count;
+    parser->projection = projection;
+    parser->projection_len = n;
+    parser->projection_identity = identity;
+    return SUCCEED;
+}
+
+int csv_parser_set_schema(csv_parser_t *parser, const int *types, int n, csv_error_t **err)
+{
+    int i;
+    for (i = 0; i < n; i++) {
+        if (types[i] < CSV_TYPE_STRING || types[i] > CSV_TYPE_TIMESTAMP) {
+            *err = csv_error_new(CSV_EINVALID_VALUE, "invalid column type");
+            return FAIL;
+        }
+    }
+
+    int *copy = NULL;
+    if (n > 0) {
+        copy = xmalloc(n * sizeof(int), err);
+        if (copy == NULL)
+            return FAIL;
+        memcpy(copy, types, n * sizeof(int));
+    }
+    xfree(parser->types);
+    parser->types = copy;
+    parser->types_len = n;
+    return SUCCEED;
+}
+
+/* create a parser on the whole input, which is already in memory.
+ * return the parser if succeeds. otherwise return NULL and err will be set */
+static csv_parser_t *parser_new_on_memory(const char *buf, size_t len, char field_delimiter, csv_error_t **err)
+{
+    csv_parser_t *parser = parser_new(NULL, err);
+    if (parser == NULL)
+        return NULL;
+
+    /* parser never writes to read buffer, it is safe to drop const */
+    parser_set_field_delimiter(parser, field_delimiter);
+    parser->buf = (char *)buf;
+    parser->capacity = len;
+    parser->end = len;
+    parser->eof = 1;
+    parser->buf_kind = BUF_BORROWED;
+    return parser;
+}
+
+csv_parser_t *csv_parser_new_mem(const char *buf, size_t len, char field_delimiter, csv_error_t **err)
+{
+    if (!is_valid_field_delimiter(field_delimiter)) {
+        *err = csv_error_new(CSV_EINVALID_FIELD_DELIMITER, "invalid field delimiter");
+        return NULL;
+    }
+    return parser_new_on_memory(buf, len, field_delimiter, err);
+}
+
+#ifdef CSV_HAVE_MMAP
+/* map the whole file at path into memory, read only.
+ * an empty file can not be mapped, buf will be NULL for it.
+ * returns 0 when succeeds, -1 when fails */
+static int map_file(const char *path, char **buf, size_t *len, csv_error_t **err)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        *err = csv_error_new(CSV_EIO, strerror(errno));
+        return FAIL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        *err = csv_error_new(CSV_EIO, strerror(errno));
+        close(fd);
+        return FAIL;
+    }
+
+    *buf = NULL;
+    *len = (size_t)st.st_size;
+    if (*len > 0) {
+        void *p = mmap(NULL, *len, PROT_READ, MAP_SHARED, fd, 0);
+        if (p == MAP_FAILED) {
+            *err = csv_error_new(CSV_EIO, strerror(errno));
+            close(fd);
+            return FAIL;
+        }
+        posix_madvise(p, *len, POSIX_MADV_SEQUENTIAL);
+        *buf = p;
+    }
+    close(fd); /* the mapping is still valid after fd closed */
+    return SUCCEED;
+}
+
+csv_parser_t *csv_parser_new_mmap(const char *path, char field_delimiter, csv_error_t **err)
+{
+    if (!is_valid_field_delimiter(field_delimiter)) {
+        *err = csv_error_new(CSV_EINVALID_FIELD_DELIMITER, "invalid field delimiter");
+        return NULL;
+    }
+
+    char *buf;
+    size_t len;
+    if (map_file(path, &buf, &len, err) == FAIL)
+        return NULL;
+
+    csv_parser_t *parser = parser_new_on_memory(buf, len, field_delimiter, err);
+    if (parser == NULL) {
+        if (buf != NULL)
+            munmap(buf, len);
+        return NULL;
+    }
+    parser->buf_kind = BUF_MAPPED;
+    return parser;
+}
+#endif
+
+csv_parser_t *csv_parser_new_source(const csv_source_t *source, char field_delimiter, csv_error_t **err)
+{
+    csv_parser_t *parser = csv_parser_new_with_field_delimiter(NULL, field_delimiter, err);
+    if (parser == NULL) {
+        if (source->close_fn != NULL)
+            source->close_fn(source->ctx);
+        return NULL;
+    }
+    parser->source = *source;
+    return parser;
+}
+
+#ifdef CSV_WITH_ZLIB
+/* gzip source, by zlib, which also reads files not compressed as is */
+static long gzip_read(void *ctx, char *buf, size_t len, csv_error_t **err)
+{
+    gzFile gz = ctx;
+    int n = gzread(gz, buf, len > INT_MAX ? INT_MAX : (unsigned)len);
+    if (n < 0) {
+        int errnum;
+        const char *msg = gzerror(gz, &errnum);
+        *err = csv_error_new(CSV_EIO, errnum == Z_ERRNO ? strerror(errno) : msg);
+        return FAIL;
+    }
+    return n;
+}
+
+static void gzip_close(void *ctx)
+{
+    gzclose(ctx);
+}
+
+int csv_source_gzip(csv_source_t *source, const char *path, csv_error_t **err)
+{
+    gzFile gz = gzopen(path, "rb");
+    if (gz == NULL) {
+        *err = csv_error_new(CSV_EIO, errno != 0 ? strerror(errno) : "gzopen failed");
+        return FAIL;
+    }
+    gzbuffer(gz, CSV_READ_BUFFER_SIZE);
+    source->read_fn = gzip_read;
+    source->close_fn = gzip_close;
+    source->ctx = gz;
+    return SUCCEED;
+}
+#endif
+
+#ifdef CSV_WITH_ZSTD
+/* zstd source */
+typedef struct {
+    FILE *file;
+    ZSTD_DCtx *dctx;
+    ZSTD_inBuffer in;
+    char *in_buf;
+    size_t in_cap;
+    size_t last;   /* result of the last ZSTD_decompressStream, 0 when a frame is complete */
+} zstd_source_t;
+
+static long zstd_read(void *ctx, char *buf, size_t len, csv_error_t **err)
+{
+    zstd_source_t *zs = ctx;
+    ZSTD_outBuffer out = {buf, len, 0};
+    while (out.pos == 0) {
+        if (zs->in.pos == zs->in.size) {
+            size_t n = fread(zs->in_buf, 1, zs->in_cap, zs->file);
+            if (n == 0) {
+                if (ferror(zs->file)) {
+                    *err = csv_error_new(CSV_EIO, strerror(errno));
+                    return FAIL;
+                }
+                if (zs->last != 0) {
+                    *err = csv_error_new(CSV_EIO, "truncated zstd input");
+                    return FAIL;
+                }
+                return 0;
+            }
+            zs->in.size = n;
+            zs->in.pos = 0;
+        }
+        zs->last = ZSTD_decompressStream(zs->dctx, &out, &zs->in);
+        if (ZSTD_isError(zs->last)) {
+            *err = csv_error_new(CSV_EIO, ZSTD_getErrorName(zs->last));
+            return FAIL;
+        }
+    }
+    return (long)out.pos;
+}
+
+static void zstd_close(void *ctx)
+{
+    zstd_source_t *zs = ctx;
+    fclose(zs->file);
+    ZSTD_freeDCtx(zs->dctx);
+    xfree(zs->in_buf);
+    xfree(zs);
+}
+
+int csv_source_zstd(csv_source_t *source, const char *path, csv_error_t **err)
+{
+    zstd_source_t *zs = xmalloc(sizeof(zstd_source_t), err);
+    if (zs == NULL)
+        return FAIL;
+
+    zs->in_cap = ZSTD_DStreamInSize();
+    zs->in_buf = xmalloc(zs->in_cap, err);
+    if (zs->in_buf == NULL) {
+        xfree(zs);
+        return FAIL;
+    }
+    zs->dctx = ZSTD_createDCtx();
+    if (zs->dctx == NULL) {
+        xfree(zs->in_buf);
+        xfree(zs);
+        *err = csv_error_oom();
+        return FAIL;
+    }
+    zs->file = fopen(path, "rb");
+    if (zs->file == NULL) {
+        *err = csv_error_new(CSV_EIO, strerror(errno));
+        ZSTD_freeDCtx(zs->dctx);
+        xfree(zs->in_buf);
+        xfree(zs);
+        return FAIL;
+    }
+    zs->in.src = zs->in_buf;
+    zs->in.size = 0;
+    zs->in.pos = 0;
+    zs->last = 0;
+
+    source->read_fn = zstd_read;
+    source->close_fn = zstd_close;
+    source->ctx = zs;
+    return SUCCEED;
+}
+#endif
+
+#ifdef CSV_WITH_DIRECT_IO
+/* size and count of blocks kept in flight by direct source and sink */
+#ifndef CSV_DIRECT_IO_BLOCK_SIZE
+#define CSV_DIRECT_IO_BLOCK_SIZE (1024 * 1024)
+#endif
+#ifndef CSV_DIRECT_IO_DEPTH
+#define CSV_DIRECT_IO_DEPTH 4
+#endif
+
+/* alignment of buffers, offsets and sizes of O_DIRECT, the logical block size of most devices is at
+ * most one page */
+#define DIRECT_IO_ALIGN 4096
+
+#if CSV_DIRECT_IO_BLOCK_SIZE % DIRECT_IO_ALIGN != 0
+#error "CSV_DIRECT_IO_BLOCK_SIZE should be a multiple of 4096"
+#endif
+
+/* open the file at `path` with O_DIRECT, or as usual if its file system does not support O_DIRECT,
+ * in which case *direct is set to 0.
+ * returns the fd if succeeds. otherwise return -1 and err will be set */
+static int direct_open(const char *path, int flags, int *direct, csv_error_t **err)
+{
+    *direct = 1;
+    int fd = open(path, flags | O_DIRECT, 0666);
+    if (fd == -1 && errno == EINVAL) {
+        *direct = 0;
+        fd = open(path, flags, 0666);
+    }
+    if (fd == -1)
+        *err = csv_error_new(CSV_EIO, strerror(errno));
+    return fd;
+}
+
+/* allocate CSV_DIRECT_IO_DEPTH aligned blocks into blocks, all in the allocation *mem.
+ * returns 0 when succeeds, -1 when fails */
+static int direct_alloc_blocks(char **mem, char **blocks, csv_error_t **err)
+{
+    *mem = xmalloc((size_t)CSV_DIRECT_IO_DEPTH * CSV_DIRECT_IO_BLOCK_SIZE + DIRECT_IO_ALIGN, err);
+    if (*mem == NULL)
+        return FAIL;
+    char *p = (char *)(((uintptr_t)*mem + DIRECT_IO_ALIGN - 1) & ~(uintptr_t)(DIRECT_IO_ALIGN - 1));
+    int i;
+    for (i = 0; i < CSV_DIRECT_IO_DEPTH; i++)
+        blocks[i] = p + (size_t)i * CSV_DIRECT_IO_BLOCK_SIZE;
+    return SUCCEED;
+}
+
+/* wait for the request of cb to complete.
+ * returns its result like read/write, with errno set when it is -1 */
+static ssize_t direct_wait(struct aiocb *cb)
+{
+    const struct aiocb *list[1];
+    list[0] = cb;
+    int e;
+    while ((e = aio_error(cb)) == EINPROGRESS)
+        aio_suspend(list, 1, NULL);
+    ssize_t n = aio_return(cb);
+    if (n == -1)
+        errno = e;
+    return n;
+}
+
+/* direct source.
+ * reads of the following blocks are in flight, while the parser consumes the oldest one. */
+typedef struct {
+    int fd;
+    int direct;     /* opened with O_DIRECT, otherwise pages are dropped from page cache once read */
+    char *mem;      /* allocation of blocks */
+    char *blocks[CSV_DIRECT_IO_DEPTH];
+    struct aiocb cbs[CSV_DIRECT_IO_DEPTH];
+    int pending[CSV_DIRECT_IO_DEPTH]; /* read into the block is in flight */
+    off_t offset;   /* offset of the next read to submit */
+    int eof;        /* a short read completed, no more reads are submitted */
+    int head;       /* index of the block being consumed, or to complete next */
+    int ready;      /* read into head completed */
+    size_t pos;     /* bytes of head consumed */
+    size_t len;     /* bytes of head read */
+} direct_source_t;
+
+/* submit the read of the next block into block i.
+ * returns 0 when succeeds, -1 when fails */
+static int direct_submit_read(direct_source_t *ds, int i, csv_error_t **err)
+{
+    if (ds->eof)
+        return SUCCEED;
+    struct aiocb *cb = &ds->cbs[i];
+    memset(cb, 0, sizeof(struct aiocb));
+    cb->aio_fildes = ds->fd;
+    cb->aio_buf = ds->blocks[i];
+    cb->aio_nbytes = CSV_DIRECT_IO_BLOCK_SIZE;
+    cb->aio_offset = ds->offset;
+    cb->aio_sigevent.sigev_notify = SIGEV_NONE;
+    if (aio_read(cb) == -1) {
+        *err = csv_error_new(CSV_EIO, strerror(errno));
+        return FAIL;
+    }
+    ds->pending[i] = 1;
+    ds->offset += CSV_DIRECT_IO_BLOCK_SIZE;
+    return SUCCEED;
+}
+
+static long direct_read(void *ctx, char *buf, size_t len, csv_error_t **err)
+{
+    direct_source_t *ds = ctx;
+    while (ds->pos == ds->len) {
+        if (ds->ready) {
+            /* head is consumed, reuse it for the read after the last submitted one */
+            ds->ready = 0;
+            if (direct_submit_read(ds, ds->head, err) == FAIL)
+                return FAIL;
+            ds->head = (ds->head + 1) % CSV_DIRECT_IO_DEPTH;
+        }
+        if (!ds->pending[ds->head])
+            return 0;
+
+        struct aiocb *cb = &ds->cbs[ds->head];
+        ssize_t n = direct_wait(cb);
+        ds->pending[ds->head] = 0;
+        if (n == -1) {
+            *err = csv_error_new(CSV_EIO, strerror(errno));
+            return FAIL;
+        }
+        if ((size_t)n < CSV_DIRECT_IO_BLOCK_SIZE)
+            ds->eof = 1;
+        if (!ds->direct && n > 0)
+            posix_fadvise(ds->fd, cb->aio_offset, n, POSIX_FADV_DONTNEED);
+        ds->ready = 1;
+        ds->pos = 0;
+        ds->len = (size_t)n;
+    }
+
+    size_t n = ds->len - ds->pos;
+    if (n > len)
+        n = len;
+    memcpy(buf, ds->blocks[ds->head] + ds->pos, n);
+    ds->pos += n;
+    return (long)n;
+}
+
+static void direct_close(void *ctx)
+{
+    direct_source_t *ds = ctx;
+    int i;
+    for (i = 0; i < CSV_DIRECT_IO_DEPTH; i++) {
+        if (ds->pending[i]) {
+            aio_cancel(ds->fd, &ds->cbs[i]);
+            direct_wait(&ds->cbs[i]);
+        }
+    }
+    close(ds->fd);
+    xfree(ds->mem);
+    xfree(ds);
+}
+
+int csv_source_direct(csv_source_t *source, const char *path, csv_error_t **err)
+{
+    direct_source_t *ds = xmalloc(sizeof(direct_source_t), err);
+    if (ds == NULL)
+        return FAIL;
+    memset(ds, 0, sizeof(direct_source_t));
+    if (direct_alloc_blocks(&ds->mem, ds->blocks, err) == FAIL) {
+        xfree(ds);
+        return FAIL;
+    }
+    ds->fd = direct_open(path, O_RDONLY, &ds->direct, err);
+    if (ds->fd == -1) {
+        xfree(ds->mem);
+        xfree(ds);
+        return FAIL;
+    }
+    if (!ds->direct)
+        posix_fadvise(ds->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    int i;
+    for (i = 0; i < CSV_DIRECT_IO_DEPTH; i++) {
+        if (direct_submit_read(ds, i, err) == FAIL) {
+            direct_close(ds);
+            return FAIL;
+        }
+    }
+
+    source->read_fn = direct_read;
+    source->close_fn = direct_close;
+    source->ctx = ds;
+    return SUCCEED;
+}
+#endif
+
+#ifdef CSV_WITH_THREADS
+/* read-ahead source.
+ * a helper thread reads (and so decompresses) the next block from the wrapped source into one of two
+ * buffers, while the parser consumes the other one. */
+typedef struct {
+    csv_source_t inner;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    char *bufs[2];
+    long lens[2];      /* bytes in each buffer, 0 at end of input, -1 when fails */
+    int filled[2];     /* buffer is filled by helper thread, not consumed yet */
+    int read_idx;      /* the buffer being consumed */
+    size_t read_off;
+    int stop;          /* helper thread should exit */
+    csv_error_t *error; /* error of inner source */
+} read_ahead_t;
+
+static void *read_ahead_worker(void *arg)
+{
+    read_ahead_t *ra = arg;
+    int idx = 0;
+    while (1) {
+        pthread_mutex_lock(&ra->lock);
+        while (ra->filled[idx] && !ra->stop)
+            pthread_cond_wait(&ra->cond, &ra->lock);
+        int stop = ra->stop;
+        pthread_mutex_unlock(&ra->lock);
+        if (stop)
+            break;
+
+        csv_error_t *err = NULL;
+        long n = ra->inner.read_fn(ra->inner.ctx, ra->bufs[idx], CSV_READ_BUFFER_SIZE, &err);
+
+        pthread_mutex_lock(&ra->lock);
+        ra->lens[idx] = n;
+        ra->filled[idx] = 1;
+        if (n == FAIL)
+            ra->error = err;
+        pthread_cond_broadcast(&ra->cond);
+        pthread_mutex_unlock(&ra->lock);
+        if (n <= 0)
+            break;
+        idx ^= 1;
+    }
+    return NULL;
+}
+
+static long read_ahead_read(void *ctx, char *buf, size_t len, csv_error_t **err)
+{
+    read_ahead_t *ra = ctx;
+    int idx = ra->read_idx;
+
+    pthread_mutex_lock(&ra->lock);
+    while (!ra->filled[idx])
+        pthread_cond_wait(&ra->cond, &ra->lock);
+    pthread_mutex_unlock(&ra->lock);
+
+    long n = ra->lens[idx];
+    if (n == FAIL) {
+        *err = ra->error;
+        ra->error = NULL;
+        if (*err == NULL) /* already reported */
+            *err = csv_error_new(CSV_EIO, "read failed");
+        return FAIL;
+    }
+    if (n == 0) /* end of input, the buffer is never consumed */
+        return 0;
+
+    size_t count = (size_t)n - ra->read_off;
+    if (count > len)
+        count = len;
+    memcpy(buf, ra->bufs[idx] + ra->read_off, count);
+    ra->read_off += count;
+    if (ra->read_off == (size_t)n) { /* give the buffer back to helper thread */
+        pthread_mutex_lock(&ra->lock);
+        ra->filled[idx] = 0;
+        pthread_cond_broadcast(&ra->cond);
+        pthread_mutex_unlock(&ra->lock);
+        ra->read_idx ^= 1;
+        ra->read_off = 0;
+    }
+    return (long)count;
+}
+
+static void read_ahead_close(void *ctx)
+{
+    read_ahead_t *ra = ctx;
+    pthread_mutex_lock(&ra->lock);
+    ra->stop = 1;
+    pthread_cond_broadcast(&ra->cond);
+    pthread_mutex_unlock(&ra->lock);
+    pthread_join(ra->thread, NULL);
+
+    if (ra->inner.close_fn != NULL)
+        ra->inner.close_fn(ra->inner.ctx);
+    if (ra->error != NULL)
+        csv_error_free(ra->error);
+    pthread_mutex_destroy(&ra->lock);
+    pthread_cond_destroy(&ra->cond);
+    xfree(ra->bufs[0]);
+    xfree(ra);
+}
+
+int csv_source_read_ahead(csv_source_t *source, csv_error_t **err)
+{
+    read_ahead_t *ra = xmalloc(sizeof(read_ahead_t), err);
+    if (ra == NULL)
+        return FAIL;
+    ra->bufs[0] = xmalloc(2 * CSV_READ_BUFFER_SIZE, err);
+    if (ra->bufs[0] == NULL) {
+        xfree(ra);
+        return FAIL;
+    }
+    ra->bufs[1] = ra->bufs[0] + CSV_READ_BUFFER_SIZE;
+    ra->inner = *source;
+    ra->lens[0] = ra->lens[1] = 0;
+    ra->filled[0] = ra->filled[1] = 0;
+    ra->read_idx = 0;
+    ra->read_off = 0;
+    ra->stop = 0;
+    ra->error = NULL;
+    pthread_mutex_init(&ra->lock, NULL);
+    pthread_cond_init(&ra->cond, NULL);
+    if (pthread_create(&ra->thread, NULL, read_ahead_worker, ra) != 0) {
+        pthread_mutex_destroy(&ra->lock);
+        pthread_cond_destroy(&ra->cond);
+        xfree(ra->bufs[0]);
+        xfree(ra);
+        *err = csv_error_new(CSV_ETHREAD, "failed to create thread");
+        return FAIL;
+    }
+
+    source->read_fn = read_ahead_read;
+    source->close_fn = read_ahead_close;
+    source->ctx = ra;
+    return SUCCEED;
+}
+#endif
+
+/* fill the error of parser, with where it is found in the current row, at pos.
+ * column is index of the field, or -1 if unknown.
+ * returns the error, which is owned by parser */
+static csv_error_t *parser_error(csv_parser_t *parser, int error_code, const char *message, int column)
+{
+    csv_error_t *err = &parser->error;
+    err->error_code = error_code;
+    size_t len = strlen(message);
+    if (len >= sizeof(parser->error_text))
+        len = sizeof(parser->error_text) - 1;
+    memcpy(parser->error_text, message, len);
+    parser->error_text[len] = '\0';
+    err->row = parser->stats.rows;
+    err->column = column;
+    err->row_offset = parser->buf_offset + parser->row_start;
+    err->offset = parser->buf_offset + parser->pos;
+    return err;
+}
+
+/* read at most len bytes of input into buf, from source or file.
+ * returns count of bytes read, 0 when eof reached, -1 when fails */
+static long parser_read(csv_parser_t *parser, char *buf, size_t len, csv_error_t **err)
+{
+    uint64_t start = parser->trace.enabled ? now_ns() : 0;
+    long n;
+    if (parser->source.read_fn != NULL) {
+        n = parser->source.read_fn(parser->source.ctx, buf, len, err);
+    } else {
+        n = (long)fread(buf, 1, len, parser->file);
+        if (n == 0 && ferror(parser->file)) { /* io error happend*/
+            *err = parser_error(parser, CSV_EIO, strerror(errno), -1);
+            n = FAIL;
+        }
+    }
+    if (parser->trace.enabled)
+        parser->stats.io_ns += now_ns() - start;
+    return n;
+}
+
+/* read more bytes from file into the read buffer.
+ * bytes before row_start are discarded to make room, and the buffer is doubled if the current row
+ * alone fills it up.
+ * returns count of bytes read, 0 when eof reached, -1 when fails */
+static long parser_fill(csv_parser_t *parser, csv_error_t **err)
+{
+    if (parser->cr_end > parser->end) { /* on memory, the next window is checked instead */
+        size_t n = parser->cr_end - parser->end > CSV_READ_BUFFER_SIZE ? CSV_READ_BUFFER_SIZE
+                                                                       : parser->cr_end - parser->end;
+        parser_check_cr(parser, parser->buf + parser->end, n);
+        parser->end += n;
+        parser->cr_checked = parser->end;
+        return (long)n;
+    }
+    if (parser->eof)
+        return 0;
+    if (parser->push) { /* rows are parsed only when they are complete, this should not happen */
+        *err = parser_error(parser, CSV_EINVALID_FORMAT, "incomplete row", -1);
+        return FAIL;
+    }
+
+    if (parser->row_start > 0) {
+        size_t shift = parser->row_start;
+        memmove(parser->buf, parser->buf + shift, parser->end - shift);
+        parser->row_start = 0;
+        parser->field_start -= shift;
+        parser->pos -= shift;
+        parser->end -= shift;
+        parser->buf_offset += shift;
+    }
+
+    if (parser->end == parser->capacity) {
+        /* expand */
+        size_t new_cap = parser->capacity * 2;
+        char *new_buf = xrealloc(parser->buf, parser->end, new_cap, err);
+        if (new_buf == NULL)
+            return FAIL;
+
+        parser->buf = new_buf;
+        parser->capacity = new_cap;
+        parser->stats.buffer_growths++;
+    }
+
+    long n = parser_read(parser, parser->buf + parser->end, parser->capacity - parser->end, err);
+    if (n == FAIL)
+        return FAIL;
+    if (n == 0) {
+        parser->eof = 1;
+        return 0;
+    }
+    parser_check_cr(parser, parser->buf + parser->end, (size_t)n);
+    parser->end += n;
+    return n;
+}
+
+/* make sure there are bytes not parsed yet in the read buffer.
+ * returns 1 if there are, 0 when eof reached, -1 when fails */
+static int parser_ensure(csv_parser_t *parser, csv_error_t **err)
+{
+    if (parser->pos < parser->end)
+        return 1;
+
+    long n = parser_fill(parser, err);
+    if (n == FAIL)
+        return FAIL;
+    return n > 0;
+}
+
+/* csv row */
+
+/* initial size of the arena of row */
+static const size_t ROW_ARENA_SIZE = 1024;
+
+/* a field of row.
+ * for rows owning their fields, content of all fields is stored one after another (each terminated by
+ * NUL) in the arena of row, and the field is located by `off` into the arena, which may be moved as
+ * it grows.
+ * for rows parsed by `csv_parse_next_row_view`, p points into parser's buffers. while such a row is
+ * being parsed, those buffers may be moved too, so the field is located by `off` instead, and p is
+ * fixed up when the row is done. */
+typedef struct {
+    char *p;
+    size_t len;
+    size_t off;     /* offset into arena, or to the row start in read buffer / to scratch buffer if escaped */
+    int escaped;
+} field_t;
+
+struct csv_row_t {
+    int len;
+    int capacity;
+    field_t *fields;
+    int view;       /* fields are views into parser's buffers, not owned by the row */
+
+    /* arena for content of fields, [0, arena_len) are in use. allocated on first use */
+    char *arena;
+    size_t arena_len;
+    size_t arena_cap;
+};
+
+/* initial count of fields of row */
+static const int ROW_FIELDS = 32;
+
+/* create an empty row with room for capacity (at least ROW_FIELDS) fields.
+ * return the new row if succeeds. otherwise return NULL and err will be set */
+static csv_row_t *row_new(int capacity, csv_error_t **err)
+{
+    csv_row_t *row = xmalloc(sizeof(csv_row_t), err);
+    if (row == NULL)
+        return NULL;
+
+    row->len = 0;
+    row->capacity = capacity > ROW_FIELDS ? capacity : ROW_FIELDS;
+    row->view = 0;
+    row->arena = NULL;
+    row->arena_len = 0;
+    row->arena_cap = 0;
+    row->fields = xmalloc(row->capacity * sizeof(field_t), err);
+    if (row->fields == NULL) {
+        xfree(row);
+        return NULL;
+    }
+    return row;
+}
+
+csv_row_t *csv_row_new(csv_error_t **err)
+{
+    return row_new(ROW_FIELDS, err);
+}
+
+void csv_row_free(csv_row_t *row)
+{
+    xfree(row->arena);
+    xfree(row->fields);
+    xfree(row);
+}
+
+/* rewind the arena, memory of fields is kept and will be reused by later appended fields */
+void csv_row_reset(csv_row_t *row)
+{
+    row->len = 0;
+    row->arena_len = 0;
+}
+
+/* expand the fields of the row.
+ * returns 0 when succeeds, -1 when fails */
+static int csv_row_expand_fields(csv_row_t *row, csv_error_t **err)
+{
+    int new_cap = row->capacity * 2;
+    field_t *new_fields = xrealloc(row->fields, row->len * sizeof(field_t), new_cap * sizeof(field_t), err);
+    if (new_fields == NULL) {
+        return FAIL;
+    }
+
+    row->capacity = new_cap;
+    row->fields = new_fields;
+    return SUCCEED;
+}
+
+/* expand the arena of the row to accommodate at least len more bytes.
+ * returns 0 when succeeds, -1 when fails */
+static int csv_row_expand_arena(csv_row_t *row, size_t len, csv_error_t **err)
+{
+    size_t new_cap = row->arena_cap > 0 ? row->arena_cap * 2 : ROW_ARENA_SIZE;
+    while (row->arena_len + len > new_cap)
+        new_cap *= 2;
+    char *new_arena = xrealloc(row->arena, row->arena_len, new_cap, err);
+    if (new_arena == NULL)
+        return FAIL;
+
+    row->arena = new_arena;
+    row->arena_cap = new_cap;
+    return SUCCEED;
+}
+
+int csv_row_reserve(csv_row_t *row, int fields, size_t bytes, csv_error_t **err)
+{
+    if (fields > row->capacity) {
+        field_t *new_fields = xrealloc(row->fields, row->len * sizeof(field_t), fields * sizeof(field_t), err);
+        if (new_fields == NULL)
+            return FAIL;
+        row->fields = new_fields;
+        row->capacity = fields;
+    }
+
+    /* content of each field is terminated by NUL */
+    size_t need = bytes + (fields > 0 ? (size_t)fields : 0);
+    if (need > row->arena_cap) {
+        char *new_arena = xrealloc(row->arena, row->arena_len, need, err);
+        if (new_arena == NULL)
+            return FAIL;
+        row->arena = new_arena;
+        row->arena_cap = need;
+    }
+    return SUCCEED;
+}
+
+int csv_row_field_count(const csv_row_t *row)
+{
+    return row->len;
+}
+
+char *csv_row_field_get(const csv_row_t *row, int idx)
+{
+    const field_t *field = &row->fields[idx];
+    if (row->view)
+        return field->p;
+    return row->arena + field->off;
+}
+
+size_t csv_row_field_len(const csv_row_t *row, int idx)
+{
+    return row->fields[idx].len;
+}
+
+int csv_row_append_field(csv_row_t *row, const char *field, size_t len, csv_error_t **err)
+{
+    if (row->len >= row->capacity && csv_row_expand_fields(row, err) == FAIL)
+        return FAIL;
+    if (row->arena_len + len + 1 > row->arena_cap && csv_row_expand_arena(row, len + 1, err) == FAIL)
+        return FAIL;
+
+    field_t *f = &row->fields[row->len++];
+    f->off = row->arena_len;
+    f->len = len;
+    memcpy(row->arena + row->arena_len, field, len);
+    row->arena[row->arena_len + len] = '\0';
+    row->arena_len += len + 1;
+    return SUCCEED;
+}
+
+/* append a field which is a view into parser's buffers to a view row.
+ * returns 0 when succeeds, -1 when fails */
+static int csv_row_append_view(csv_row_t *row, size_t off, size_t len, int escaped, csv_error_t **err)
+{
+    if (row->len >= row->capacity && csv_row_expand_fields(row, err) == FAIL)
+        return FAIL;
+
+    field_t *field = &row->fields[row->len++];
+    field->p = NULL;
+    field->len = len;
+    field->off = off;
+    field->escaped = escaped;
+    return SUCCEED;
+}
+
+
+/* typed conversion.
+ * fields are converted from their bytes directly, they need not be NUL-terminated.
+ * each converter returns NULL when succeeds, otherwise one of the static errors below, so that bad
+ * fields cost no allocation.
+ */
+static csv_error_t INVALID_INTEGER = STATIC_ERROR(CSV_EINVALID_VALUE, "invalid integer");
+static csv_error_t INTEGER_OUT_OF_RANGE = STATIC_ERROR(CSV_EINVALID_VALUE, "integer out of range");
+static csv_error_t INVALID_NUMBER = STATIC_ERROR(CSV_EINVALID_VALUE, "invalid number");
+static csv_error_t NUMBER_OUT_OF_RANGE = STATIC_ERROR(CSV_EINVALID_VALUE, "number out of range");
+static csv_error_t INVALID_TIMESTAMP = STATIC_ERROR(CSV_EINVALID_VALUE, "invalid timestamp");
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define CSV_SWAR_DIGITS
+#endif
+
+#ifdef CSV_SWAR_DIGITS
+/* convert 8 digits at p at once, treating them as an integer of 64 bits.
+ * returns 1 and sets *value if they are all digits, otherwise returns 0 */
+static int parse_8_digits(const char *p, uint64_t *value)
+{
+    uint64_t v;
+    memcpy(&v, p, 8);
+    /* each byte is in '0'..'9', i.e. 0x30..0x39, iff its high half is 3 and adding 6 keeps it so */
+    if (((v & 0xF0F0F0F0F0F0F0F0ULL) | (((v + 0x0606060606060606ULL) & 0xF0F0F0F0F0F0F0F0ULL) >> 4)) !=
+        0x3333333333333333ULL)
+        return 0;
+    v -= 0x3030303030303030ULL;
+    v = v * 10 + (v >> 8); /* pairs of digits */
+    v = (((v & 0x000000FF000000FFULL) * (100 + (1000000ULL << 32))) +
+         (((v >> 16) & 0x000000FF000000FFULL) * (1 + (10000ULL << 32)))) >> 32;
+    *value = v;
+    return 1;
+}
+#endif
+
+static int is_digit(char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+static csv_error_t *parse_int64(const char *p, size_t len, int64_t *value)
+{
+    const char *end = p + len;
+    int negative = 0;
+    if (p < end && (*p == '-' || *p == '+')) {
+        negative = *p == '-';
+        p++;
+    }
+    if (p == end)
+        return &INVALID_INTEGER;
+
+    while (p < end - 1 && *p == '0')
+        p++;
+    /* unsigned arithmetic wraps harmlessly, too many digits are rejected below */
+    size_t digits = end - p;
+    uint64_t n = 0;
+#ifdef CSV_SWAR_DIGITS
+    uint64_t eight;
+    while (end - p >= 8 && parse_8_digits(p, &eight)) {
+        n = n * 100000000 + eight;
+        p += 8;
+    }
+#endif
+    for (; p < end; p++) {
+        if (!is_digit(*p))
+            return &INVALID_INTEGER;
+        n = n * 10 + (*p - '0');
+    }
+
+    if (digits > 19 || n > (uint64_t)INT64_MAX + negative)
+        return &INTEGER_OUT_OF_RANGE;
+    *value = negative && n > 0 ? -(int64_t)(n - 1) - 1 : (int64_t)n;
+    return NULL;
+}
+
+/* longest number converted by strtod when it can not be done exactly here */
+#define MAX_NUMBER_LEN 128
+
+static csv_error_t *parse_double(const char *p, size_t len, double *value)
+{
+    /* powers of 10 which are exact in double */
+    static const double POW10[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+                                   1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+    const char *s = p;
+    const char *end = p + len;
+    int negative = 0;
+    if (p < end && (*p == '-' || *p == '+')) {
+        negative = *p == '-';
+        p++;
+    }
+
+    /* mantissa of at most 19 significant digits, and exponent of 10 */
+    uint64_t m = 0;
+    int significant = 0;
+    int exact = 1;
+    int any_digit = 0;
+    long exp10 = 0;
+    for (; p < end && is_digit(*p); p++) {
+        any_digit = 1;
+        if (significant < 19) {
+            m = m * 10 + (*p - '0');
+            significant += m != 0;
+        } else {
+            exp10++;
+            exact = exact && *p == '0';
+        }
+    }
+    if (p < end && *p == '.') {
+        for (p++; p < end && is_digit(*p); p++) {
+            any_digit = 1;
+            if (significant < 19) {
+                m = m * 10 + (*p - '0');
+                significant += m != 0;
+                exp10--;
+            } else {
+                exact = exact && *p == '0';
+            }
+        }
+    }
+    if (any_digit && p < end && (*p == 'e' || *p == 'E')) {
+        int exp_negative = 0;
+        long e = 0;
+        p++;
+        if (p < end && (*p == '-' || *p == '+')) {
+            exp_negative = *p == '-';
+            p++;
+        }
+        if (p == end || !is_digit(*p))
+            return &INVALID_NUMBER;
+        for (; p < end && is_digit(*p); p++) {
+            if (e < 100000)
+                e = e * 10 + (*p - '0');
+        }
+        exp10 += exp_negative ? -e : e;
+    }
+
+    /* only decimal numbers, not other forms strtod takes, like "0x1p3", "inf" or "nan" */
+    if (!any_digit || p != end)
+        return &INVALID_NUMBER;
+
+    /* fast path. both mantissa and power of 10 are exact, so is the result of one operation */
+    if (exact && m <= (1ULL << 53) && exp10 >= -22 && exp10 <= 22) {
+        double d = (double)m;
+        d = exp10 < 0 ? d / POW10[-exp10] : d * POW10[exp10];
+        *value = negative ? -d : d;
+        return NULL;
+    }
+
+    /* otherwise, e.g. "1e300", leave it to strtod, which needs a NUL-terminated string */
+    char tmp[MAX_NUMBER_LEN];
+    if (len >= MAX_NUMBER_LEN)
+        return &INVALID_NUMBER;
+    memcpy(tmp, s, len);
+    tmp[len] = '\0';
+    char *tmp_end;
+    errno = 0;
+    double d = strtod(tmp, &tmp_end);
+    if (tmp_end != tmp + len)
+        return &INVALID_NUMBER;
+    if ((d == HUGE_VAL || d == -HUGE_VAL) && errno == ERANGE)
+        return &NUMBER_OUT_OF_RANGE;
+    *value = d;
+    return NULL;
+}
+
+/* convert n digits at p, returns -1 if they are not all digits */
+static int parse_digits(const char *p, int n)
+{
+    int v = 0;
+    int i;
+    for (i = 0; i < n; i++) {
+        if (!is_digit(p[i]))
+            return -1;
+        v = v * 10 + (p[i] - '0');
+    }
+    return v;
+}
+
+/* days since 1970-01-01 of a date in proleptic gregorian calendar */
+static int64_t days_from_civil(int64_t y, int m, int d)
+{
+    y -= m <= 2;
+    int64_t era = (y >= 0 ? y : y - 399) / 400;
+    int64_t yoe = y - era * 400;
+    int64_t doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+    int64_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + doe - 719468;
+}
+
+/* `YYYY-MM-DD`, optionally followed by ` HH:MM:SS` or `THH:MM:SS`, fraction of second and `Z`.
+ * converted to seconds since 1970-01-01 00:00:00 UTC, fraction of second is dropped */
+static csv_error_t *parse_timestamp(const char *p, size_t len, int64_t *value)
+{
+    static const int DAYS_IN_MONTH[] = {31, 29, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+    if (len < 10 || p[4] != '-' || p[7] != '-')
+        return &INVALID_TIMESTAMP;
+    int year = parse_digits(p, 4);
+    int month = parse_digits(p + 5, 2);
+    int day = parse_digits(p + 8, 2);
+    if (year < 0 || month < 1 || month > 12 || day < 1 || day > DAYS_IN_MONTH[month - 1])
+        return &INVALID_TIMESTAMP;
+    if (month == 2 && day == 29 && !(year % 4 == 0 && (year % 100 != 0 || year % 400 == 0)))
+        return &INVALID_TIMESTAMP;
+
+    int hour = 0, minute = 0, second = 0;
+    size_t i = 10;
+    if (i < len && (p[i] == ' ' || p[i] == 'T')) {
+        if (len - i < 9 || p[i + 3] != ':' || p[i + 6] != ':')
+            return &INVALID_TIMESTAMP;
+        hour = parse_digits(p + i + 1, 2);
+        minute = parse_digits(p + i + 4, 2);
+        second = parse_digits(p + i + 7, 2);
+        if (hour < 0 || hour > 23 || minute < 0 || minute > 59 || second < 0 || second > 60)
+            return &INVALID_TIMESTAMP;
+        i += 9;
+        if (i < len && p[i] == '.') {
+            for (i++; i < len && is_digit(p[i]); i++)
+                ;
+        }
+        if (i < len && p[i] == 'Z')
+            i++;
+    }
+    if (i != len)
+        return &INVALID_TIMESTAMP;
+
+    *value = days_from_civil(year, month, day) * 86400 + hour * 3600 + minute * 60 + second;
+    return NULL;
+}
+
+/* turn the result of a converter into the one of public functions */
+static int conversion_result(csv_error_t *error, csv_error_t **err)
+{
+    if (error != NULL) {
+        *err = error;
+        return FAIL;
+    }
+    return SUCCEED;
+}
+
+int csv_row_field_int64(const csv_row_t *row, int idx, int64_t *value, csv_error_t **err)
+{
+    return conversion_result(parse_int64(csv_row_field_get(row, idx), csv_row_field_len(row, idx), value), err);
+}
+
+int csv_row_field_double(const csv_row_t *row, int idx, double *value, csv_error_t **err)
+{
+    return conversion_result(parse_double(csv_row_field_get(row, idx), csv_row_field_len(row, idx), value), err);
+}
+
+int csv_row_field_timestamp(const csv_row_t *row, int idx, int64_t *value, csv_error_t **err)
+{
+    return conversion_result(parse_timestamp(csv_row_field_get(row, idx), csv_row_field_len(row, idx), value), err);
+}
+
+enum PARSE_STATE {
+    ST_START,   /* before parse a field */
+    ST_INFIELD, /* parsing an field */
+};
+
+/* result of parse_row */
+enum {
+    ROW_END = 0,    /* parsing finished, no row parsed */
+    ROW_PARSED = 1, /* a row parsed */
+    ROW_SKIPPED,    /* a malformed row dropped, see CSV_ERRORS_SKIP_ROW */
+    ROW_RESTART,    /* the row should be parsed again by the kernel changed meanwhile */
+};
+
+
+/* scanners for unquoted fields.
+ * a scanner returns the first byte in [p, end) which ends an unquoted field, that is
+ * field_delimiter, `\r`, `\n`, or `"` which is illegal in unquoted field.
+ * it returns end if there is no such byte.
+ * a copier does the same, and copies bytes before the returned one to dst meanwhile, which is used
+ * by writer to find out whether a field needs quotes while copying it. dst should have room for
+ * all of [p, end).
+ *
+ * vectorized ones check 16 or 32 bytes at a time, and leave the tail to the scalar one.
+ * the ones to use are selected when parser or writer is created, according to what the cpu
+ * supports. define CSV_NO_SIMD to always use the scalar ones.
+ *
+ * quoted fields only need to look for `"`, memchr of libc already does that well.
+ *
+ * each kind is implemented once with an optional dst, the scanner and the copier of it are inlined
+ * from the implementation, so the scanner does not pay for copying.
+ */
+static inline const char *scan_copy_scalar(char *dst, const char *p, const char *end, char field_delimiter, int cr)
+{
+    for (; p < end; p++) {
+        char c = *p;
+        if (c == field_delimiter || (cr && c == CR_CHAR) || c == LF_CHAR || c == QUOTE_CHAR)
+            break;
+        if (dst != NULL)
+            *dst++ = c;
+    }
+    return p;
+}
+
+#if !defined(CSV_SCAN_SSE2) && !defined(CSV_SCAN_NEON)
+static const char *scan_unquoted_scalar(const char *p, const char *end, char field_delimiter)
+{
+    return scan_copy_scalar(NULL, p, end, field_delimiter, 1);
+}
+
+static const char *copy_unquoted_scalar(char *dst, const char *p, const char *end, char field_delimiter)
+{
+    return scan_copy_scalar(dst, p, end, field_delimiter, 1);
+}
+#endif
+
+#ifdef CSV_SCAN_SSE2
+static inline const char *scan_copy_sse2(char *dst, const char *p, const char *end, char field_delimiter, int cr)
+{
+    const __m128i delimiter = _mm_set1_epi8(field_delimiter);
+    const __m128i quote = _mm_set1_epi8(QUOTE_CHAR);
+    const __m128i lf = _mm_set1_epi8(LF_CHAR);
+    while (end - p >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)p);
+        __m128i m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, delimiter), _mm_cmpeq_epi8(v, quote)),
+                                 _mm_cmpeq_epi8(v, lf));
+        if (cr)
+            m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8(CR_CHAR)));
+        if (dst != NULL) { /* bytes after the found one are copied too, but they do no harm */
+            _mm_storeu_si128((__m128i *)dst, v);
+            dst += 16;
+        }
+        int mask = _mm_movemask_epi8(m);
+        if (mask != 0)
+            return p + __builtin_ctz(mask);
+        p += 16;
+    }
+    return scan_copy_scalar(dst, p, end, field_delimiter, cr);
+}
+
+static const char *scan_unquoted_sse2(const char *p, const char *end, char field_delimiter)
+{
+    return scan_copy_sse2(NULL, p, end, field_delimiter, 1);
+}
+
+static const char *copy_unquoted_sse2(char *dst, const char *p, const char *end, char field_delimiter)
+{
+    return scan_copy_sse2(dst, p, end, field_delimiter, 1);
+}
+#endif
+
+#ifdef CSV_SCAN_AVX2
+__attribute__((target("avx2")))
+static inline const char *scan_copy_avx2(char *dst, const char *p, const char *end, char field_delimiter, int cr)
+{
+    const __m256i delimiter = _mm256_set1_epi8(field_delimiter);
+    const __m256i quote = _mm256_set1_epi8(QUOTE_CHAR);
+    const __m256i lf = _mm256_set1_epi8(LF_CHAR);
+    while (end - p >= 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)p);
+        __m256i m = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, delimiter), _mm256_cmpeq_epi8(v, quote)),
+                                    _mm256_cmpeq_epi8(v, lf));
+        if (cr)
+            m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(CR_CHAR)));
+        if (dst != NULL) {
+            _mm256_storeu_si256((__m256i *)dst, v);
+            dst += 32;
+        }
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(m);
+        if (mask != 0)
+            return p + __builtin_ctz(mask);
+        p += 32;
+    }
+    return scan_copy_sse2(dst, p, end, field_delimiter, cr);
+}
+
+__attribute__((target("avx2")))
+static const char *scan_unquoted_avx2(const char *p, const char *end, char field_delimiter)
+{
+    return scan_copy_avx2(NULL, p, end, field_delimiter, 1);
+}
+
+__attribute__((target("avx2")))
+static const char *copy_unquoted_avx2(char *dst, const char *p, const char *end, char field_delimiter)
+{
+    return scan_copy_avx2(dst, p, end, field_delimiter, 1);
+}
+
+/* scanner for input without `\r`, inlined into parse kernels */
+__attribute__((target("avx2")))
+static inline const char *scan_lf_avx2(const char *p, const char *end, char field_delimiter)
+{
+    return scan_copy_avx2(NULL, p, end, field_delimiter, 0);
+}
+#endif
+
+#ifdef CSV_SCAN_NEON
+static inline const char *scan_copy_neon(char *dst, const char *p, const char *end, char field_delimiter, int cr)
+{
+    const uint8x16_t delimiter = vdupq_n_u8((uint8_t)field_delimiter);
+    const uint8x16_t quote = vdupq_n_u8((uint8_t)QUOTE_CHAR);
+    const uint8x16_t lf = vdupq_n_u8((uint8_t)LF_CHAR);
+    while (end - p >= 16) {
+        uint8x16_t v = vld1q_u8((const uint8_t *)p);
+        uint8x16_t m = vorrq_u8(vorrq_u8(vceqq_u8(v, delimiter), vceqq_u8(v, quote)), vceqq_u8(v, lf));
+        if (cr)
+            m = vorrq_u8(m, vceqq_u8(v, vdupq_n_u8((uint8_t)CR_CHAR)));
+        if (dst != NULL) {
+            vst1q_u8((uint8_t *)dst, v);
+            dst += 16;
+        }
+        /* narrow each byte of the comparison result to 4 bits, so it fits in 64 bits */
+        uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(m), 4)), 0);
+        if (mask != 0)
+            return p + (__builtin_ctzll(mask) >> 2);
+        p += 16;
+    }
+    return scan_copy_scalar(dst, p, end, field_delimiter, cr);
+}
+
+static const char *scan_unquoted_neon(const char *p, const char *end, char field_delimiter)
+{
+    return scan_copy_neon(NULL, p, end, field_delimiter, 1);
+}
+
+static const char *copy_unquoted_neon(char *dst, const char *p, const char *end, char field_delimiter)
+{
+    return scan_copy_neon(dst, p, end, field_delimiter, 1);
+}
+#endif
+
+/* scanner for input without `\r`, inlined into parse kernels */
+static inline const char *scan_lf(const char *p, const char *end, char field_delimiter)
+{
+#if defined(CSV_SCAN_SSE2)
+    return scan_copy_sse2(NULL, p, end, field_delimiter, 0);
+#elif defined(CSV_SCAN_NEON)
+    return scan_copy_neon(NULL, p, end, field_delimiter, 0);
+#else
+    return scan_copy_scalar(NULL, p, end, field_delimiter, 0);
+#endif
+}
+
+#ifdef CSV_SCAN_AVX2
+/* whether avx2 can be used */
+static int cpu_has_avx2(void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+#endif
+
+/* select the fastest scanner for unquoted fields which the cpu supports */
+static scan_func select_scan_unquoted(void)
+{
+#ifdef CSV_SCAN_AVX2
+    if (cpu_has_avx2())
+        return scan_unquoted_avx2;
+#endif
+#if defined(CSV_SCAN_SSE2)
+    return scan_unquoted_sse2;
+#elif defined(CSV_SCAN_NEON)
+    return scan_unquoted_neon;
+#else
+    return scan_unquoted_scalar;
+#endif
+}
+
+/* select the fastest copier for unquoted fields which the cpu supports */
+static copy_func select_copy_unquoted(void)
+{
+#ifdef CSV_SCAN_AVX2
+    if (cpu_has_avx2())
+        return copy_unquoted_avx2;
+#endif
+#if defined(CSV_SCAN_SSE2)
+    return copy_unquoted_sse2;
+#elif defined(CSV_SCAN_NEON)
+    return copy_unquoted_neon;
+#else
+    return copy_unquoted_scalar;
+#endif
+}
+
+/* append the current field, which ends at `field_end` of the read buffer, to the row.
+ * if the field has been escaped, its content before field_start is already in scratch buffer.
+ * for a view row, only location of the field is recorded.
+ * returns 0 when succeeds, -1 when fails */
+static int append_current_field(csv_parser_t *parser, size_t field_end, int escaped,
+                                csv_row_t *row, csv_error_t **err)
+{
+    const char *field = parser->buf + parser->field_start;
+    size_t len = field_end - parser->field_start;
+    if (!escaped) {
+        if (row->view)
+            return csv_row_append_view(row, parser->field_start - parser->row_start, len, 0, err);
+        return csv_row_append_field(row, field, len, err);
+    }
+
+    buffer_t *scratch = parser->scratch;
+    if (buffer_append(scratch, field, len, err) == FAIL)
+        return FAIL;
+    len = scratch->len - parser->escape_start;
+    if (row->view)
+        return csv_row_append_view(row, parser->escape_start, len, 1, err);
+
+    /* content has been copied, so it can be dropped from scratch buffer */
+    int res = csv_row_append_field(row, scratch->p + parser->escape_start, len, err);
+    scratch->len = parser->escape_start;
+    return res;
+}
+
+/* append an empty string field to the row.
+ * returns 0 when succeeds, -1 when fails */
+static int append_empty_field(csv_row_t *row, csv_error_t **err)
+{
+    if (row->view)
+        return csv_row_append_view(row, 0, 0, 0, err);
+    return csv_row_append_field(row, "", 0, err);
+}
+
+/* point fields of a view row into parser's buffers, after the row is done */
+static void resolve_view_fields(const csv_parser_t *parser, csv_row_t *row)
+{
+    int i;
+    for (i = 0; i < row->len; i++) {
+        field_t *field = &row->fields[i];
+        if (field->escaped)
+            field->p = parser->scratch->p + field->off;
+        else
+            field->p = parser->buf + parser->row_start + field->off;
+    }
+}
+
+/* whether the column is kept in rows, see `csv_parser_set_columns` */
+static int column_selected(const csv_parser_t *parser, int column)
+{
+    return parser->selected == NULL || (column < parser->selected_width && parser->selected[column]);
+}
+
+/* rearrange the kept fields of a row, which are collected in column order, by projection.
+ * kept columns beyond the end of row are empty. *collected is set to count of fields collected, each
+ * with content of its own, as fields of a column projected more than once share it.
+ * returns 0 when succeeds, -1 when fails */
+static int project_row(const csv_parser_t *parser, csv_row_t *row, int *collected, csv_error_t **err)
+{
+    while (row->len < parser->selected_count) {
+        if (append_empty_field(row, err) == FAIL)
+            return FAIL;
+    }
+    *collected = row->len;
+    if (parser->projection_identity)
+        return SUCCEED;
+
+    /* a column may be projected more than once, so fields are moved after the projected ones first */
+    int n = parser->projection_len;
+    int count = row->len;
+    while (row->capacity < n + count) {
+        if (csv_row_expand_fields(row, err) == FAIL)
+            return FAIL;
+    }
+    memcpy(row->fields + n, row->fields, count * sizeof(field_t));
+    int i;
+    for (i = 0; i < n; i++)
+        row->fields[i] = row->fields[n + parser->projection[i]];
+    row->len = n;
+    return SUCCEED;
+}
+
+/* lines are separated by `\r` or `\n` or `\r\n`.
+ * c is the line break just consumed. when it is `\r`, consume possible `\n`
+ * returns 0 when succeeds, -1 when fails */
+static int consume_end_of_line(csv_parser_t *parser, char c, csv_error_t **err)
+{
+    if (c == CR_CHAR) {
+        int r = parser_ensure(parser, err);
+        if (r == FAIL)
+            return FAIL;
+        if (r && parser->buf[parser->pos] == LF_CHAR)
+            parser->pos++;
+    }
+    return SUCCEED;
+}
+
+/* a malformed row is found, and message tells why. the row is counted and reported to callback,
+ * unless it fails parsing by error policy.
+ * returns 0 if the row can be skipped or tolerated, -1 when fails */
+static int bad_row(csv_parser_t *parser, const char *message, int column, csv_error_t **err)
+{
+    csv_error_t *error = parser_error(parser, CSV_EINVALID_FORMAT, message, column);
+    if (parser->error_policy == CSV_ERRORS_STRICT) {
+        *err = error;
+        return FAIL;
+    }
+    if (parser->row_bad)
+        return SUCCEED;
+    parser->row_bad = 1;
+    parser->bad_rows++;
+    if (parser->bad_row_callback != NULL && parser->bad_row_callback(error, parser->bad_row_ctx) != 0) {
+        *err = error;
+        return FAIL;
+    }
+    return SUCCEED;
+}
+
+/* drop the rest of a malformed row, till the next line break whether quoted or not.
+ * returns ROW_SKIPPED when succeeds, -1 when fails */
+static int skip_row(csv_parser_t *parser, csv_error_t **err)
+{
+    while (1) {
+        /* the dropped bytes need not be kept in the read buffer */
+        parser->row_start = parser->pos;
+        parser->field_start = parser->pos;
+        int r = parser_ensure(parser, err);
+        if (r == FAIL)
+            return FAIL;
+        if (r == 0)
+            return ROW_SKIPPED;
+
+        const char *p = parser->buf + parser->pos;
+        const char *end = parser->buf + parser->end;
+        while (p < end && *p != CR_CHAR && *p != LF_CHAR)
+            p++;
+        parser->pos = p - parser->buf;
+        if (p < end) {
+            parser->pos++;
+            if (consume_end_of_line(parser, *p, err) == FAIL)
+                return FAIL;
+            return ROW_SKIPPED;
+        }
+    }
+}
+
+/* like parser_ensure, for a kernel. when only `\n` ends lines, and `\r` is found in bytes read,
+ * returns ROW_RESTART so that the row is parsed again by the generic kernel */
+static inline int kernel_ensure(csv_parser_t *parser, int lf_only, csv_error_t **err)
+{
+    if (parser->pos < parser->end)
+        return 1;
+    int r = parser_ensure(parser, err);
+    if (lf_only && r != FAIL && !parser->cr_free)
+        return ROW_RESTART;
+    return r;
+}
+
+/* parse fields of the next row into row, the state machine is driven by scanning the read buffer.
+ * if row is a view row, its fields will point into parser's buffers.
+ * only kept columns are appended, and *columns is set to the number of all columns.
+ * malformed rows are handled by error policy of parser, ROW_SKIPPED is returned if one is dropped.
+ * returns ROW_PARSED, ROW_SKIPPED, ROW_RESTART or ROW_END when succeeds, -1 when fails
+ *
+ * this is the template of parse kernels, which is inlined into each of them with field_delimiter,
+ * lf_only (only `\n` ends lines) and scan as constants when they can be, see `select_parse_fields`.
+ */
+static inline __attribute__((always_inline))
+int parse_fields_kernel(csv_parser_t *parser, csv_row_t *row, int *columns, csv_error_t **err,
+                        char field_delimiter, int lf_only, scan_func scan)
+{
+    int state = ST_START;
+    int column = 0; /* index of the current field */
+    int quoted = 0;
+    int escaped = 0; /* current field contains `""`, so its content is collected in scratch buffer */
+
+    int r;
+    char c;
+    const char *p;
+    size_t quote_pos;
+
+    parser->row_start = parser->pos;
+    parser->field_start = parser->pos;
+    buffer_reset(parser->scratch);
+    while (1) {
+        r = kernel_ensure(parser, lf_only, err);
+        if (r == FAIL || r == ROW_RESTART)
+            return r;
+
+        switch (state) {
+            case ST_START:
+                if (r == 0) { /* eof */
+                    /* if this row has previous field(s), append an empty string field,
+                     * since field_delimiter has been encountered previously.
+                     * otherwise, this line is empty, parsing finished.
+                     */
+                    if (column > 0) {
+                        if (column_selected(parser, column) && append_empty_field(row, err) == FAIL)
+                            return FAIL;
+                        *columns = column + 1;
+                        return ROW_PARSED;
+                    }
+                    *columns = 0;
+                    return ROW_END;
+                }
+
+                c = parser->buf[parser->pos++];
+                if (c == QUOTE_CHAR) {
+                    /* this means, when state is ST_START, quoted is always 0 */
+                    quoted = 1;
+                    parser->stats.quoted_fields++;
+                    state = ST_INFIELD;
+                    parser->field_start = parser->pos;
+                } else if (c == LF_CHAR || (!lf_only && c == CR_CHAR)) {
+                    if (!lf_only && consume_end_of_line(parser, c, err) == FAIL)
+                        return FAIL;
+
+                    /* if this row has previous field(s), append an empty string field,
+                     * since field_delimiter has been encountered previously.
+                     * otherwise, this line is empty, we have a row with zero fields
+                     */
+                    if (column > 0) {
+                        if (column_selected(parser, column) && append_empty_field(row, err) == FAIL)
+                            return FAIL;
+                        column++;
+                    }
+                    *columns = column;
+                    return ROW_PARSED;
+                } else if (c == field_delimiter) {
+                    /* empty string field */
+                    if (column_selected(parser, column) && append_empty_field(row, err) == FAIL)
+                        return FAIL;
+                    column++;
+                } else { /* normal char */
+                    state = ST_INFIELD;
+                    parser->field_start = parser->pos - 1;
+                }
+                break;
+
+            case ST_INFIELD:
+                if (!quoted) {
+                    if (r == 0) {
+                        /* treat like end of row.
+                         * next invoke of parse_row will return ROW_END to indicate parsing finished */
+                        if (column_selected(parser, column) &&
+                            append_current_field(parser, parser->pos, escaped, row, err) == FAIL)
+                            return FAIL;
+                        *columns = column + 1;
+                        return ROW_PARSED;
+                    }
+
+                    /* skip normal chars in bulk */
+                    p = scan(parser->buf + parser->pos, parser->buf + parser->end, field_delimiter);
+                    parser->pos = p - parser->buf;
+                    if (parser->pos == parser->end) /* need more input */
+                        break;
+
+                    c = *p;
+                    if (c == QUOTE_CHAR) {
+                        if (bad_row(parser, "quote(\") should be quoted", column, err) == FAIL)
+                            return FAIL;
+                        if (parser->error_policy == CSV_ERRORS_SKIP_ROW)
+                            return skip_row(parser, err);
+                        parser->pos++; /* tolerated, the quote is content */
+                        break;
+                    }
+
+                    if (column_selected(parser, column) &&
+                        append_current_field(parser, parser->pos, escaped, row, err) == FAIL)
+                        return FAIL;
+                    column++;
+                    parser->pos++;
+                    escaped = 0;
+                    if (c == field_delimiter) { /* end of field */
+                        state = ST_START;
+                    } else { /* end of row */
+                        if (!lf_only && consume_end_of_line(parser, c, err) == FAIL)
+                            return FAIL;
+                        *columns = column;
+                        return ROW_PARSED;
+                    }
+                    break;
+                }
+
+                /* when quoted, `\r`, `\n` and field_delimiter are just like normal characters,
+                 * only `"` needs to be checked. */
+                if (r == 0) {
+                    if (bad_row(parser, "unclosed quote", column, err) == FAIL)
+                        return FAIL;
+                    if (parser->error_policy == CSV_ERRORS_SKIP_ROW) {
+                        /* the quote took all the rest of input, parse it again after the first line */
+                        parser->pos = parser->row_start;
+                        return skip_row(parser, err);
+                    }
+                    /* tolerated, the field ends with input */
+                    if (column_selected(parser, column) &&
+                        append_current_field(parser, parser->pos, escaped, row, err) == FAIL)
+                        return FAIL;
+                    *columns = column + 1;
+                    return ROW_PARSED;
+                }
+                p = memchr(parser->buf + parser->pos, QUOTE_CHAR, parser->end - parser->pos);
+                if (p == NULL) { /* need more input */
+                    parser->pos = parser->end;
+                    break;
+                }
+
+                /* look ahead to check if the quote indicates escape or field end or row end or illegal format */
+                quote_pos = p - parser->buf;
+                parser->pos = quote_pos + 1;
+                r = kernel_ensure(parser, lf_only, err);
+                if (r == FAIL || r == ROW_RESTART)
+                    return r;
+                quote_pos = parser->pos - 1; /* the read buffer may have been moved */
+
+                if (r == 0) { /* end of row, and parsing finished */
+                    if (column_selected(parser, column) &&
+                        append_current_field(parser, quote_pos, escaped, row, err) == FAIL)
+                        return FAIL;
+                    *columns = column + 1;
+                    return ROW_PARSED;
+                }
+
+                c = parser->buf[parser->pos++];
+                if (c == QUOTE_CHAR) { /* escape */
+                    parser->stats.escapes++;
+                    if (!column_selected(parser, column)) { /* content is not needed */
+                        parser->field_start = parser->pos;
+                        break;
+                    }
+                    /* collect content till now, with one quote */
+                    if (!escaped) {
+                        parser->escape_start = parser->scratch->len;
+                        escaped = 1;
+                    }
+                    if (buffer_append(parser->scratch, parser->buf + parser->field_start,
+                                      parser->pos - 1 - parser->field_start, err) == FAIL)
+                        return FAIL;
+                    parser->field_start = parser->pos;
+                } else if (c == field_delimiter) { /* end of field */
+                    if (column_selected(parser, column) &&
+                        append_current_field(parser, quote_pos, escaped, row, err) == FAIL)
+                        return FAIL;
+                    column++;
+                    state = ST_START;
+                    quoted = 0;
+                    escaped = 0;
+                } else if (c == LF_CHAR || (!lf_only && c == CR_CHAR)) { /* end of row */
+                    if (column_selected(parser, column) &&
+                        append_current_field(parser, quote_pos, escaped, row, err) == FAIL)
+                        return FAIL;
+                    if (!lf_only && consume_end_of_line(parser, c, err) == FAIL)
+                        return FAIL;
+                    *columns = column + 1;
+                    return ROW_PARSED;
+                } else { /* otherwise, illegal format */
+                    if (bad_row(parser, "closing quote can only followed by `\r\n` or field_delimiter", column,
+                                err) == FAIL)
+                        return FAIL;
+                    if (parser->error_policy == CSV_ERRORS_SKIP_ROW)
+                        return skip_row(parser, err);
+                    /* tolerated, the rest of field is unquoted content, appended to what is before
+                     * the closing quote */
+                    if (column_selected(parser, column)) {
+                        if (!escaped) {
+                            parser->escape_start = parser->scratch->len;
+                            escaped = 1;
+                        }
+                        if (buffer_append(parser->scratch, parser->buf + parser->field_start,
+                                          quote_pos - parser->field_start, err) == FAIL)
+                            return FAIL;
+                    }
+                    parser->field_start = parser->pos - 1;
+                    quoted = 0;
+                }
+                break;
+        }
+    }
+}
+
+/* parse kernels. the generic one handles any field delimiter and line break, the others are for
+ * the common dialects, comma or tab separated with `\n` only, so their hot loops compare against
+ * constants, inline the scanner and never check `\r`.
+ * a parser starts with the kernel of its dialect, and falls back to the generic one for good once
+ * `\r` is read, see `parser_check_cr`.
+ */
+static int parse_fields_generic(csv_parser_t *parser, csv_row_t *row, int *columns, csv_error_t **err)
+{
+    return parse_fields_kernel(parser, row, columns, err, parser->field_delimiter, 0, parser->scan_unquoted);
+}
+
+static int parse_fields_comma_lf(csv_parser_t *parser, csv_row_t *row, int *columns, csv_error_t **err)
+{
+    return parse_fields_kernel(parser, row, columns, err, COMMA_CHAR, 1, scan_lf);
+}
+
+static int parse_fields_tab_lf(csv_parser_t *parser, csv_row_t *row, int *columns, csv_error_t **err)
+{
+    return parse_fields_kernel(parser, row, columns, err, TAB_CHAR, 1, scan_lf);
+}
+
+#ifdef CSV_SCAN_AVX2
+__attribute__((target("avx2")))
+static int parse_fields_comma_lf_avx2(csv_parser_t *parser, csv_row_t *row, int *columns, csv_error_t **err)
+{
+    return parse_fields_kernel(parser, row, columns, err, COMMA_CHAR, 1, scan_lf_avx2);
+}
+
+__attribute__((target("avx2")))
+static int parse_fields_tab_lf_avx2(csv_parser_t *parser, csv_row_t *row, int *columns, csv_error_t **err)
+{
+    return parse_fields_kernel(parser, row, columns, err, TAB_CHAR, 1, scan_lf_avx2);
+}
+#endif
+
+/* select the kernel for field_delimiter, assuming only `\n` ends lines */
+static parse_func select_parse_fields(char field_delimiter)
+{
+    if (field_delimiter == COMMA_CHAR) {
+#ifdef CSV_SCAN_AVX2
+        if (cpu_has_avx2())
+            return parse_fields_comma_lf_avx2;
+#endif
+        return parse_fields_comma_lf;
+    }
+    if (field_delimiter == TAB_CHAR) {
+#ifdef CSV_SCAN_AVX2
+        if (cpu_has_avx2())
+            return parse_fields_tab_lf_avx2;
+#endif
+        return parse_fields_tab_lf;
+    }
+    return parse_fields_generic;
+}
+
+static void parser_set_field_delimiter(csv_parser_t *parser, char field_delimiter)
+{
+    parser->field_delimiter = field_delimiter;
+    parser->parse_fields = select_parse_fields(field_delimiter);
+    parser->cr_free = parser->parse_fields != parse_fields_generic;
+    parser->cr_from = 0;
+    parser->cr_checked = 0;
+    parser->cr_end = 0;
+}
+
+/* check len bytes at p just read into buffer, and fall back to the generic kernel if there is `\r`.
+ * nothing is checked once the generic kernel is used. */
+static void parser_check_cr(csv_parser_t *parser, const char *p, size_t len)
+{
+    if (parser->cr_free && len > 0 && memchr(p, CR_CHAR, len) != NULL) {
+        parser->cr_free = 0;
+        parser->parse_fields = parse_fields_generic;
+    }
+}
+
+/* parse fields of the next row by the kernel of parser, see `parse_fields_kernel`.
+ * input read into buffer is checked for `\r` as it is read. input on memory is checked a window at a
+ * time as the kernel reaches it, just like it is read, so a mapped file is not paged in all before
+ * the first row. */
+static int parser_parse_fields(csv_parser_t *parser, csv_row_t *row, int *columns, csv_error_t **err)
+{
+    if (parser->buf_kind == BUF_OWNED || !parser->cr_free)
+        return parser->parse_fields(parser, row, columns, err);
+
+    if (parser->pos < parser->cr_from || parser->pos > parser->cr_checked) /* parser has been moved */
+        parser->cr_from = parser->cr_checked = parser->pos;
+    parser->cr_end = parser->end;
+    parser->end = parser->cr_checked;
+    int res = parser->parse_fields(parser, row, columns, err);
+    parser->end = parser->cr_end;
+    parser->cr_end = 0;
+    return res;
+}
+
+/* parse the next row into row, with only kept columns when there is a projection.
+ * returns ROW_PARSED or ROW_END when succeeds, -1 when fails */
+static int push_row_complete(csv_parser_t *parser);
+
+static int parse_row(csv_parser_t *parser, csv_row_t *row, csv_error_t **err)
+{
+    /* a callback may start tracing in the middle */
+    int traced = parser->trace.enabled;
+    trace_mark_t mark;
+    if (traced)
+        trace_begin(&parser->stats, &mark);
+
+    int columns = 0;
+    int res;
+    parser->row_bad = 0;
+    /* counted again when the row is restarted */
+    uint64_t quoted_fields = parser->stats.quoted_fields;
+    uint64_t escapes = parser->stats.escapes;
+    while ((res = parser_parse_fields(parser, row, &columns, err)) == ROW_SKIPPED || res == ROW_RESTART) {
+        csv_row_reset(row);
+        if (res == ROW_RESTART) { /* kernel has changed, bytes of the row are still in buffer */
+            parser->pos = parser->row_start;
+            parser->stats.quoted_fields = quoted_fields;
+            parser->stats.escapes = escapes;
+            continue;
+        }
+        parser->stats.rows++;
+        parser->row_bad = 0;
+        quoted_fields = parser->stats.quoted_fields;
+        escapes = parser->stats.escapes;
+        /* a push parser only parses complete rows, so the next one has to be found first */
+        if (parser->push && !parser->eof) {
+            parser->scan_pos = parser->pos;
+            parser->scan_quoted = SCAN_UNQUOTED;
+            if (!push_row_complete(parser)) {
+                res = ROW_END;
+                break;
+            }
+        }
+    }
+    /* an empty line is still a row with zero field */
+    int collected = row->len;
+    if (res == ROW_PARSED && parser->selected != NULL && columns > 0 &&
+        project_row(parser, row, &collected, err) == FAIL)
+        res = FAIL;
+    parser->row_collected = collected;
+    if (res == ROW_PARSED) {
+        parser->stats.rows++;
+        parser->stats.fields += columns;
+    }
+
+    if (traced) {
+        trace_end(&parser->stats, &mark);
+        parser_report(parser, res == ROW_END && parser->eof);
+    }
+    return res;
+}
+
+csv_row_t *csv_parse_next_row(csv_parser_t *parser, csv_error_t **err)
+{
+    /* sized like the previous row, with room for content a half longer, so rows alike need no growth */
+    uint64_t allocations = thread_allocations;
+    csv_row_t *row = row_new(parser->row_fields, err);
+    if (row != NULL && parser->row_bytes > 0 &&
+        csv_row_reserve(row, parser->row_fields, parser->row_bytes + parser->row_bytes / 2, err) == FAIL) {
+        csv_row_free(row);
+        row = NULL;
+    }
+    if (parser->trace.enabled)
+        parser->stats.allocations += thread_allocations - allocations;
+    if (row == NULL)
+        return NULL;
+
+    if (parse_row(parser, row, err) != ROW_PARSED) {
+        csv_row_free(row);
+        return NULL;
+    }
+    parser->row_fields = row->len;
+    /* without NULs, one for each field collected */
+    size_t nuls = (size_t)parser->row_collected;
+    parser->row_bytes = row->arena_len > nuls ? row->arena_len - nuls : 0;
+    return row;
+}
+
+int csv_parse_next_row_into(csv_parser_t *parser, csv_row_t *row, csv_error_t **err)
+{
+    csv_row_reset(row);
+    return parse_row(parser, row, err);
+}
+
+/* parse the next row into the view row of parser.
+ * returns ROW_PARSED or ROW_END when succeeds, -1 when fails */
+static int parse_view_row(csv_parser_t *parser, csv_error_t **err)
+{
+    if (parser->view_row == NULL) {
+        parser->view_row = row_new(parser->row_fields, err);
+        if (parser->view_row == NULL)
+            return FAIL;
+        parser->view_row->view = 1;
+    }
+
+    csv_row_t *row = parser->view_row;
+    csv_row_reset(row);
+    int res = parse_row(parser, row, err);
+    if (res == ROW_PARSED)
+        resolve_view_fields(parser, row);
+    return res;
+}
+
+const csv_row_t *csv_parse_next_row_view(csv_parser_t *parser, csv_error_t **err)
+{
+    if (parse_view_row(parser, err) != ROW_PARSED)
+        return NULL;
+    return parser->view_row;
+}
+
+
+csv_parser_t *csv_parser_new_push(char field_delimiter, csv_error_t **err)
+{
+    csv_parser_t *parser = csv_parser_new_with_field_delimiter(NULL, field_delimiter, err);
+    if (parser != NULL)
+        parser->push = 1;
+    return parser;
+}
+
+/* append len bytes at buf to read buffer of a push parser. parsed bytes are dropped.
+ * returns 0 when succeeds, -1 when fails */
+static int push_append(csv_parser_t *parser, const char *buf, size_t len, csv_error_t **err)
+{
+    if (len == 0)
+        return SUCCEED;
+    if (len > parser->capacity - parser->end) {
+        size_t shift = parser->pos;
+        size_t new_cap = parser->capacity;
+        while (len > new_cap - (parser->end - shift))
+            new_cap *= 2;
+
+        char *new_buf = parser->buf;
+        if (new_cap > parser->capacity) {
+            new_buf = xmalloc(new_cap, err);
+            if (new_buf == NULL)
+                return FAIL;
+            parser->stats.buffer_growths++;
+        }
+        memmove(new_buf, parser->buf + shift, parser->end - shift);
+        if (new_buf != parser->buf) {
+            xfree(parser->buf);
+            parser->buf = new_buf;
+            parser->capacity = new_cap;
+        }
+        parser->row_start = 0;
+        parser->field_start = 0;
+        parser->pos = 0;
+        parser->end -= shift;
+        parser->scan_pos -= shift;
+        parser->buf_offset += shift;
+    }
+
+    memcpy(parser->buf + parser->end, buf, len);
+    parser_check_cr(parser, buf, len);
+    parser->end += len;
+    return SUCCEED;
+}
+
+/* find the end of the next row from scan_pos, by tracking whether it is in quotes.
+ * like the parser, a quote opens a quoted field only at the start of field, and the one right after
+ * its closing quote opens it again, which is `""`. so a row found is also complete for a parser
+ * tolerating stray quotes.
+ * returns 1 if the row is complete, 0 if more input is needed */
+static int push_row_complete(csv_parser_t *parser)
+{
+    const char *end = parser->buf + parser->end;
+    const char *p = parser->buf + parser->scan_pos;
+    while (p < end) {
+        if (parser->scan_quoted == SCAN_CLOSED) {
+            parser->scan_quoted = *p == QUOTE_CHAR ? SCAN_QUOTED : SCAN_UNQUOTED;
+            if (*p == QUOTE_CHAR)
+                p++;
+            continue;
+        }
+        if (parser->scan_quoted == SCAN_QUOTED) {
+            p = memchr(p, QUOTE_CHAR, end - p);
+            if (p == NULL) {
+                p = end;
+                break;
+            }
+            parser->scan_quoted = SCAN_CLOSED;
+            p++;
+            continue;
+        }
+
+        p = parser->scan_unquoted(p, end, parser->field_delimiter);
+        if (p == end)
+            break;
+        if (*p == QUOTE_CHAR) {
+            if (p == parser->buf + parser->pos || p[-1] == parser->field_delimiter)
+                parser->scan_quoted = SCAN_QUOTED;
+        } else if (*p == CR_CHAR || *p == LF_CHAR) {
+            /* `\r` may be followed by `\n` in the next input */
+            if (*p == CR_CHAR && p + 1 == end)
+                break;
+            parser->scan_pos = p - parser->buf;
+            return 1;
+        }
+        p++;
+    }
+    parser->scan_pos = p - parser->buf;
+    return 0;
+}
+
+/* parse and deliver complete rows of a push parser, or all rows when input ends.
+ * returns 0 when succeeds, 1 if stopped by callback, -1 when fails */
+static int push_deliver(csv_parser_t *parser, csv_push_callback_t callback, void *ctx, csv_error_t **err)
+{
+    while (parser->eof || push_row_complete(parser)) {
+        int res = parse_view_row(parser, err);
+        if (res == FAIL)
+            return FAIL;
+        if (res == ROW_END)
+            break;
+
+        parser->scan_pos = parser->pos;
+        parser->scan_quoted = SCAN_UNQUOTED;
+        if (callback(parser->view_row, ctx) != 0)
+            return 1;
+    }
+    return SUCCEED;
+}
+
+int csv_parser_feed(csv_parser_t *parser, const char *buf, size_t len, csv_push_callback_t callback,
+                    void *ctx, csv_error_t **err)
+{
+    if (push_append(parser, buf, len, err) == FAIL)
+        return FAIL;
+    return push_deliver(parser, callback, ctx, err);
+}
+
+int csv_parser_feed_end(csv_parser_t *parser, csv_push_callback_t callback, void *ctx, csv_error_t **err)
+{
+    parser->eof = 1;
+    return push_deliver(parser, callback, ctx, err);
+}
+
+/* FNV-1a hash of column names */
+static size_t hash_name(const char *name, size_t len)
+{
+    size_t h = 2166136261u;
+    size_t i;
+    for (i = 0; i < len; i++) {
+        h ^= (unsigned char)name[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/* index of the column named `name` in header, or -1 */
+static int header_lookup(const csv_parser_t *parser, const char *name, size_t len)
+{
+    if (parser->header == NULL)
+        return -1;
+    size_t mask = parser->header_index_cap - 1;
+    size_t slot = hash_name(name, len) & mask;
+    while (parser->header_index[slot] >= 0) {
+        int column = parser->header_index[slot];
+        if (csv_row_field_len(parser->header, column) == len &&
+            memcmp(csv_row_field_get(parser->header, column), name, len) == 0)
+            return column;
+        slot = (slot + 1) & mask;
+    }
+    return -1;
+}
+
+int csv_parser_read_header(csv_parser_t *parser, csv_error_t **err)
+{
+    csv_row_t *header = csv_row_new(err);
+    if (header == NULL)
+        return FAIL;
+
+    /* header is not projected */
+    unsigned char *selected = parser->selected;
+    parser->selected = NULL;
+    int res = parse_row(parser, header, err);
+    parser->selected = selected;
+    if (res != ROW_PARSED) {
+        csv_row_free(header);
+        return res;
+    }
+
+    /* keep the table at most half full */
+    int n = csv_row_field_count(header);
+    size_t cap = 8;
+    while (cap < (size_t)n * 2)
+        cap *= 2;
+    int *index = xmalloc(cap * sizeof(int), err);
+    if (index == NULL) {
+        csv_row_free(header);
+        return FAIL;
+    }
+
+    if (parser->header != NULL)
+        csv_row_free(parser->header);
+    xfree(parser->header_index);
+    parser->header = header;
+    parser->header_index = index;
+    parser->header_index_cap = cap;
+
+    size_t i;
+    for (i = 0; i < cap; i++)
+        index[i] = -1;
+    int column;
+    for (column = 0; column < n; column++) {
+        const char *name = csv_row_field_get(header, column);
+        size_t len = csv_row_field_len(header, column);
+        if (header_lookup(parser, name, len) >= 0) /* duplicated name, the first one is used */
+            continue;
+        size_t slot = hash_name(name, len) & (cap - 1);
+        while (index[slot] >= 0)
+            slot = (slot + 1) & (cap - 1);
+        index[slot] = column;
+    }
+    return ROW_PARSED;
+}
+
+const csv_row_t *csv_parser_header(const csv_parser_t *parser)
+{
+    return parser->header;
+}
+
+int csv_parser_column_index(const csv_parser_t *parser, const char *name)
+{
+    return header_lookup(parser, name, strlen(name));
+}
+
+int csv_parser_field_index(const csv_parser_t *parser, const char *name)
+{
+    int column = csv_parser_column_index(parser, name);
+    if (column < 0 || parser->selected == NULL)
+        return column;
+    return column < parser->selected_width ? parser->field_of[column] : -1;
+}
+
+char *csv_row_field_by_name(const csv_parser_t *parser, const csv_row_t *row, const char *name)
+{
+    int idx = csv_parser_field_index(parser, name);
+    if (idx < 0 || idx >= csv_row_field_count(row))
+        return NULL;
+    return csv_row_field_get(row, idx);
+}
+
+int csv_parser_set_columns_by_name(csv_parser_t *parser, const char *const *names, int n, csv_error_t **err)
+{
+    if (n == 0)
+        return csv_parser_set_columns(parser, NULL, 0, err);
+
+    int *columns = xmalloc(n * sizeof(int), err);
+    if (columns == NULL)
+        return FAIL;
+    int i;
+    for (i = 0; i < n; i++) {
+        columns[i] = csv_parser_column_index(parser, names[i]);
+        if (columns[i] < 0) {
+            xfree(columns);
+            *err = csv_error_new(CSV_EINVALID_COLUMN, "unknown column name");
+            return FAIL;
+        }
+    }
+    int res = csv_parser_set_columns(parser, columns, n, err);
+    xfree(columns);
+    return res;
+}
+
+
+/* columnar batch.
+ * each column of strings has its content of all rows in one contiguous region, and row i of the
+ * column is [offsets[i], offsets[i + 1]) of it. typed columns have converted values of rows, and
+ * whether each of them is valid, instead. memory is kept when the batch is reused. */
+typedef struct {
+    int type; /* CSV_TYPE_* */
+
+    char *data;
+    size_t len;
+    size_t cap;
+    size_t *offsets; /* rows + 1 of them are in use */
+    size_t offsets_cap;
+
+    void *values; /* int64_t or double, both are 8 bytes */
+    size_t values_cap;
+    unsigned char *valid;
+    size_t valid_cap;
+} column_t;
+
+struct csv_batch_t {
+    size_t rows;
+    int len;         /* columns in use */
+    int capacity;
+    column_t *columns;
+
+    /* conversion errors of typed columns */
+    size_t errors;
+    csv_error_t *first_error;
+    size_t first_error_row;
+    int first_error_column;
+};
+
+csv_batch_t *csv_batch_new(csv_error_t **err)
+{
+    csv_batch_t *batch = xmalloc(sizeof(csv_batch_t), err);
+    if (batch == NULL)
+        return NULL;
+
+    batch->rows = 0;
+    batch->len = 0;
+    batch->capacity = 0;
+    batch->columns = NULL;
+    batch->errors = 0;
+    batch->first_error = NULL;
+    batch->first_error_row = 0;
+    batch->first_error_column = 0;
+    return batch;
+}
+
+void csv_batch_free(csv_batch_t *batch)
+{
+    int i;
+    for (i = 0; i < batch->capacity; i++) {
+        xfree(batch->columns[i].data);
+        xfree(batch->columns[i].offsets);
+        xfree(batch->columns[i].values);
+        xfree(batch->columns[i].valid);
+    }
+    if (batch->first_error != NULL)
+        csv_error_free(batch->first_error);
+    xfree(batch->columns);
+    xfree(batch);
+}
+
+/* expand a memory region at *p of *cap bytes to at least need bytes, keeping its first len bytes.
+ * returns 0 when succeeds, -1 when fails */
+static int expand_region(void **p, size_t *cap, size_t len, size_t need, csv_error_t **err)
+{
+    size_t new_cap = *cap > 0 ? *cap * 2 : 256;
+    while (new_cap < need)
+        new_cap *= 2;
+    void *new_p = xrealloc(*p, len, new_cap, err);
+    if (new_p == NULL)
+        return FAIL;
+
+    *p = new_p;
+    *cap = new_cap;
+    return SUCCEED;
+}
+
+/* make room for n rows in per-row arrays of column, keeping their first `keep` elements.
+ * returns 0 when succeeds, -1 when fails */
+static int column_reserve(column_t *column, size_t keep, size_t n, csv_error_t **err)
+{
+    if (column->type == CSV_TYPE_STRING) {
+        size_t cap = column->offsets_cap * sizeof(size_t);
+        if ((n + 1) * sizeof(size_t) > cap &&
+            expand_region((void **)&column->offsets, &cap, keep * sizeof(size_t), (n + 1) * sizeof(size_t), err) == FAIL)
+            return FAIL;
+        column->offsets_cap = cap / sizeof(size_t);
+        return SUCCEED;
+    }
+
+    if (n * 8 > column->values_cap &&
+        expand_region(&column->values, &column->values_cap, keep * 8, n * 8, err) == FAIL)
+        return FAIL;
+    if (n > column->valid_cap &&
+        expand_region((void **)&column->valid, &column->valid_cap, keep, n, err) == FAIL)
+        return FAIL;
+    return SUCCEED;
+}
+
+/* make the batch have at least n columns, new columns are empty (or invalid if typed) for all rows
+ * so far, and typed according to schema of parser.
+ * returns 0 when succeeds, -1 when fails */
+static int batch_add_columns(csv_batch_t *batch, const csv_parser_t *parser, int n, csv_error_t **err)
+{
+    if (n > batch->capacity) {
+        int new_cap = batch->capacity > 0 ? batch->capacity * 2 : 16;
+        while (new_cap < n)
+            new_cap *= 2;
+        column_t *new_columns = xrealloc(batch->columns, batch->capacity * sizeof(column_t),
+                                         new_cap * sizeof(column_t), err);
+        if (new_columns == NULL)
+            return FAIL;
+
+        memset(new_columns + batch->capacity, 0, (new_cap - batch->capacity) * sizeof(column_t));
+        batch->columns = new_columns;
+        batch->capacity = new_cap;
+    }
+
+    for (; batch->len < n; batch->len++) {
+        column_t *column = &batch->columns[batch->len];
+        column->type = batch->len < parser->types_len ? parser->types[batch->len] : CSV_TYPE_STRING;
+        if (column_reserve(column, 0, batch->rows, err) == FAIL)
+            return FAIL;
+        column->len = 0;
+        if (column->type == CSV_TYPE_STRING) {
+            memset(column->offsets, 0, (batch->rows + 1) * sizeof(size_t));
+        } else if (batch->rows > 0) {
+            memset(column->values, 0, batch->rows * 8);
+            memset(column->valid, 0, batch->rows);
+        }
+    }
+    return SUCCEED;
+}
+
+/* convert a field into row `batch->rows` of a typed column, a conversion error is recorded in batch */
+static void batch_convert_field(csv_batch_t *batch, int idx, const field_t *field)
+{
+    column_t *column = &batch->columns[idx];
+    size_t row = batch->rows;
+    csv_error_t *error;
+    if (field == NULL) /* missing */
+        error = NULL;
+    else if (column->type == CSV_TYPE_INT64)
+        error = parse_int64(field->p, field->len, (int64_t *)column->values + row);
+    else if (column->type == CSV_TYPE_DOUBLE)
+        error = parse_double(field->p, field->len, (double *)column->values + row);
+    else /* CSV_TYPE_TIMESTAMP */
+        error = parse_timestamp(field->p, field->len, (int64_t *)column->values + row);
+
+    column->valid[row] = field != NULL && error == NULL;
+    if (column->valid[row])
+        return;
+
+    memset((char *)column->values + row * 8, 0, 8);
+    if (error == NULL)
+        return;
+    if (batch->errors++ == 0) {
+        batch->first_error = error;
+        batch->first_error_row = row;
+        batch->first_error_column = idx;
+    }
+}
+
+/* append a row to the batch.
+ * returns 0 when succeeds, -1 when fails */
+static int batch_append_row(csv_batch_t *batch, const csv_parser_t *parser, const csv_row_t *row, csv_error_t **err)
+{
+    if (row->len > batch->len && batch_add_columns(batch, parser, row->len, err) == FAIL)
+        return FAIL;
+
+    int i;
+    for (i = 0; i < batch->len; i++) {
+        column_t *column = &batch->columns[i];
+        size_t keep = column->type == CSV_TYPE_STRING ? batch->rows + 1 : batch->rows;
+        if (column_reserve(column, keep, batch->rows + 1, err) == FAIL)
+            return FAIL;
+        const field_t *field = i < row->len ? &row->fields[i] : NULL; /* missing fields are empty */
+        if (column->type != CSV_TYPE_STRING) {
+            batch_convert_field(batch, i, field);
+            continue;
+        }
+        if (field != NULL && field->len > 0) {
+            if (column->len + field->len > column->cap &&
+                expand_region((void **)&column->data, &column->cap, column->len, column->len + field->len, err) == FAIL)
+                return FAIL;
+            memcpy(column->data + column->len, field->p, field->len);
+            column->len += field->len;
+        }
+        column->offsets[batch->rows + 1] = column->len;
+    }
+    batch->rows++;
+    return SUCCEED;
+}
+
+long csv_parse_next_batch(csv_parser_t *parser, csv_batch_t *batch, size_t max_rows, csv_error_t **err)
+{
+    /* reset, columns are added again as rows need them */
+    batch->rows = 0;
+    batch->len = 0;
+    batch->errors = 0;
+    if (batch->first_error != NULL) {
+        csv_error_free(batch->first_error);
+        batch->first_error = NULL;
+    }
+
+    /* fields are copied or converted once, from views into the columns */
+    while (batch->rows < max_rows) {
+        int res = parse_view_row(parser, err);
+        if (res == FAIL)
+            return FAIL;
+        if (res == ROW_END)
+            break;
+        if (batch_append_row(batch, parser, parser->view_row, err) == FAIL)
+            return FAIL;
+    }
+    return (long)batch->rows;
+}
+
+size_t csv_batch_row_count(const csv_batch_t *batch)
+{
+    return batch->rows;
+}
+
+int csv_batch_column_count(const csv_batch_t *batch)
+{
+    return batch->len;
+}
+
+int csv_batch_column_type(const csv_batch_t *batch, int column)
+{
+    return batch->columns[column].type;
+}
+
+const char *csv_batch_column_data(const csv_batch_t *batch, int column)
+{
+    return batch->columns[column].data;
+}
+
+const size_t *csv_batch_column_offsets(const csv_batch_t *batch, int column)
+{
+    return batch->columns[column].offsets;
+}
+
+const int64_t *csv_batch_column_int64(const csv_batch_t *batch, int column)
+{
+    return batch->columns[column].values;
+}
+
+const double *csv_batch_column_double(const csv_batch_t *batch, int column)
+{
+    return batch->columns[column].values;
+}
+
+const unsigned char *csv_batch_column_valid(const csv_batch_t *batch, int column)
+{
+    return batch->columns[column].valid;
+}
+
+size_t csv_batch_error_count(const csv_batch_t *batch)
+{
+    return batch->errors;
+}
+
+const csv_error_t *csv_batch_first_error(const csv_batch_t *batch, size_t *row, int *column)
+{
+    if (batch->first_error != NULL) {
+        *row = batch->first_error_row;
+        *column = batch->first_error_column;
+    }
+    return batch->first_error;
+}
+
+
+/* row offset index */
+struct csv_index_t {
+    size_t stride;
+    size_t rows;       /* count of rows indexed */
+    uint64_t size;     /* bytes of input indexed */
+    uint64_t *offsets; /* offset of every stride-th row */
+    size_t len;
+    size_t capacity;
+};
+
+/* magic number at the beginning of index files, followed by version */
+static const char INDEX_MAGIC[8] = {'C', 'S', 'V', 'I', 'N', 'D', 'E', 'X'};
+static const uint64_t INDEX_VERSION = 1;
+
+uint64_t csv_parser_offset(const csv_parser_t *parser)
+{
+    return parser->buf_offset + parser->pos;
+}
+
+/* create an empty index.
+ * return the index if succeeds. otherwise return NULL and err will be set */
+static csv_index_t *index_new(size_t stride, size_t capacity, csv_error_t **err)
+{
+    csv_index_t *index = xmalloc(sizeof(csv_index_t), err);
+    if (index == NULL)
+        return NULL;
+    index->offsets = xmalloc(capacity * sizeof(uint64_t), err);
+    if (index->offsets == NULL) {
+        xfree(index);
+        return NULL;
+    }
+    index->stride = stride;
+    index->rows = 0;
+    index->size = 0;
+    index->len = 0;
+    index->capacity = capacity;
+    return index;
+}
+
+/* append offset of the next indexed row.
+ * returns 0 when succeeds, -1 when fails */
+static int index_append(csv_index_t *index, uint64_t offset, csv_error_t **err)
+{
+    if (index->len == index->capacity) {
+        size_t new_cap = index->capacity * 2;
+        uint64_t *new_offsets = xrealloc(index->offsets, index->len * sizeof(uint64_t), new_cap * sizeof(uint64_t), err);
+        if (new_offsets == NULL)
+            return FAIL;
+        index->offsets = new_offsets;
+        index->capacity = new_cap;
+    }
+    index->offsets[index->len++] = offset;
+    return SUCCEED;
+}
+
+csv_index_t *csv_index_build(csv_parser_t *parser, size_t stride, csv_error_t **err)
+{
+    if (stride == 0) {
+        *err = csv_error_new(CSV_EINVALID_INDEX, "stride should be positive");
+        return NULL;
+    }
+    if (parser->push) {
+        *err = csv_error_new(CSV_EINVALID_INDEX, "push parser can not be indexed");
+        return NULL;
+    }
+    csv_index_t *index = index_new(stride, 1024, err);
+    if (index == NULL)
+        return NULL;
+
+    /* rows are parsed as usual, so their boundaries are the same as when they are read back */
+    while (1) {
+        uint64_t offset = csv_parser_offset(parser);
+        int res = parse_view_row(parser, err);
+        if (res == FAIL) {
+            csv_index_free(index);
+            return NULL;
+        }
+        if (res == ROW_END)
+            break;
+        if (index->rows % stride == 0 && index_append(index, offset, err) == FAIL) {
+            csv_index_free(index);
+            return NULL;
+        }
+        index->rows++;
+    }
+    index->size = csv_parser_offset(parser);
+    return index;
+}
+
+void csv_index_free(csv_index_t *index)
+{
+    xfree(index->offsets);
+    xfree(index);
+}
+
+size_t csv_index_row_count(const csv_index_t *index)
+{
+    return index->rows;
+}
+
+size_t csv_index_stride(const csv_index_t *index)
+{
+    return index->stride;
+}
+
+uint64_t csv_index_offset(const csv_index_t *index, size_t row, size_t *indexed_row)
+{
+    if (row >= index->rows) {
+        *indexed_row = index->rows;
+        return index->size;
+    }
+    size_t i = row / index->stride;
+    *indexed_row = i * index->stride;
+    return index->offsets[i];
+}
+
+/* index file is made of varints (7 bits per byte, least significant group first, high bit set when
+ * more bytes follow): after magic, version, stride, rows, size, count of offsets, then offsets as
+ * deltas to previous ones, which take only a few bytes each. */
+static int write_varint(FILE *file, uint64_t v)
+{
+    unsigned char bytes[10];
+    int n = 0;
+    while (v >= 0x80) {
+        bytes[n++] = (unsigned char)(v | 0x80);
+        v >>= 7;
+    }
+    bytes[n++] = (unsigned char)v;
+    return fwrite(bytes, 1, n, file) == (size_t)n ? SUCCEED : FAIL;
+}
+
+/* returns 0 when succeeds, -1 on end of file or if a varint is too long */
+static int read_varint(FILE *file, uint64_t *v)
+{
+    *v = 0;
+    int shift;
+    for (shift = 0; shift < 64; shift += 7) {
+        int c = getc(file);
+        if (c == EOF)
+            return FAIL;
+        *v |= (uint64_t)(c & 0x7f) << shift;
+        if ((c & 0x80) == 0)
+            return SUCCEED;
+    }
+    return FAIL;
+}
+
+int csv_index_save(const csv_index_t *index, const char *path, csv_error_t **err)
+{
+    FILE *file = fopen(path, "wb");
+    if (file == NULL) {
+        *err = csv_error_new(CSV_EIO, strerror(errno));
+        return FAIL;
+    }
+    int res = fwrite(INDEX_MAGIC, 1, sizeof(INDEX_MAGIC), file) == sizeof(INDEX_MAGIC) ? SUCCEED : FAIL;
+    if (res == SUCCEED)
+        res = write_varint(file, INDEX_VERSION);
+    if (res == SUCCEED)
+        res = write_varint(file, index->stride);
+    if (res == SUCCEED)
+        res = write_varint(file, index->rows);
+    if (res == SUCCEED)
+        res = write_varint(file, index->size);
+    if (res == SUCCEED)
+        res = write_varint(file, index->len);
+    size_t i;
+    for (i = 0; i < index->len && res == SUCCEED; i++)
+        res = write_varint(file, index->offsets[i] - (i > 0 ? index->offsets[i - 1] : 0));
+    if (fclose(file) != 0)
+        res = FAIL;
+    if (res == FAIL)
+        *err = csv_error_new(CSV_EIO, strerror(errno));
+    return res;
+}
+
+/* initial capacity of offsets of a loaded index */
+#define INDEX_LOAD_CAPACITY 1024
+
+csv_index_t *csv_index_load(const char *path, csv_error_t **err)
+{
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        *err = csv_error_new(CSV_EIO, strerror(errno));
+        return NULL;
+    }
+
+    char magic[sizeof(INDEX_MAGIC)];
+    uint64_t version, stride, rows, size, len;
+    if (fread(magic, 1, sizeof(magic), file) != sizeof(magic) || memcmp(magic, INDEX_MAGIC, sizeof(magic)) != 0 ||
+        read_varint(file, &version) == FAIL || version != INDEX_VERSION ||
+        read_varint(file, &stride) == FAIL || read_varint(file, &rows) == FAIL ||
+        read_varint(file, &size) == FAIL || read_varint(file, &len) == FAIL ||
+        stride == 0 || stride > SIZE_MAX || rows > SIZE_MAX || len != rows / stride + (rows % stride != 0)) {
+        *err = ferror(file) ? csv_error_new(CSV_EIO, strerror(errno))
+                            : csv_error_new(CSV_EINVALID_INDEX, "invalid index file");
+        fclose(file);
+        return NULL;
+    }
+
+    /* len in the header is not trusted to size offsets, they grow as deltas are actually read */
+    size_t capacity = len > 0 && len < INDEX_LOAD_CAPACITY ? (size_t)len : INDEX_LOAD_CAPACITY;
+    csv_index_t *index = index_new((size_t)stride, capacity, err);
+    if (index == NULL) {
+        fclose(file);
+        return NULL;
+    }
+    index->rows = (size_t)rows;
+    index->size = size;
+    uint64_t offset = 0;
+    while (index->len < len) {
+        uint64_t delta;
+        if (read_varint(file, &delta) == FAIL || delta > size - offset) {
+            *err = ferror(file) ? csv_error_new(CSV_EIO, strerror(errno))
+                                : csv_error_new(CSV_EINVALID_INDEX, "invalid index file");
+            csv_index_free(index);
+            fclose(file);
+            return NULL;
+        }
+        offset += delta;
+        if (index_append(index, offset, err) == FAIL) {
+            csv_index_free(index);
+            fclose(file);
+            return NULL;
+        }
+    }
+    fclose(file);
+    return index;
+}
+
+/* move parser to offset in its input, which should be where a row starts.
+ * returns 0 when succeeds, -1 when fails */
+static int parser_seek(csv_parser_t *parser, uint64_t offset, csv_error_t **err)
+{
+    if (parser->push || parser->source.read_fn != NULL) {
+        *err = csv_error_new(CSV_EINVALID_INDEX, "parser can not seek");
+        return FAIL;
+    }
+
+    /* the whole input is in buffer for parsers on memory, so is already read input other parsers */
+    if (offset >= parser->buf_offset && offset - parser->buf_offset <= parser->end) {
+        parser->pos = (size_t)(offset - parser->buf_offset);
+    } else if (parser->buf_kind != BUF_OWNED) {
+        *err = csv_error_new(CSV_EINVALID_INDEX, "offset beyond end of input");
+        return FAIL;
+    } else {
+        if ((uint64_t)(off_t)offset != offset || fseeko(parser->file, (off_t)offset, SEEK_SET) != 0) {
+            *err = csv_error_new(CSV_EIO, errno != 0 ? strerror(errno) : "offset too large");
+            return FAIL;
+        }
+        parser->buf_offset = offset;
+        parser->pos = 0;
+        parser->end = 0;
+        parser->eof = 0;
+    }
+    parser->row_start = parser->pos;
+    parser->field_start = parser->pos;
+    return SUCCEED;
+}
+
+int csv_parser_seek_row(csv_parser_t *parser, const csv_index_t *index, size_t row, csv_error_t **err)
+{
+    size_t indexed_row;
+    uint64_t offset = csv_index_offset(index, row, &indexed_row);
+    if (parser_seek(parser, offset, err) == FAIL)
+        return FAIL;
+
+    /* at most stride - 1 rows to skip */
+    for (; indexed_row < row; indexed_row++) {
+        int res = parse_view_row(parser, err);
+        if (res == FAIL)
+            return FAIL;
+        if (res == ROW_END)
+            break;
+    }
+    return SUCCEED;
+}
+
+
+/* dialect sniffing */
+
+/* candidates of field delimiter, the earlier one wins a tie */
+static const char SNIFF_DELIMITERS[] = {COMMA_CHAR, TAB_CHAR, ';', '|', ':'};
+/* at most this many rows of the prefix are looked at */
+#define SNIFF_MAX_ROWS 1024
+
+/* types a field fits, as bits of SNIFF_* */
+enum {
+    SNIFF_INT64 = 1,
+    SNIFF_DOUBLE = 2,
+    SNIFF_TIMESTAMP = 4,
+    SNIFF_ANY = SNIFF_INT64 | SNIFF_DOUBLE | SNIFF_TIMESTAMP,
+};
+
+struct csv_dialect_t {
+    char field_delimiter;
+    int line_break;
+    int has_header;
+    int columns;
+    int *types; /* columns of them */
+};
+
+/* get types the field of len bytes at p fits */
+static int sniff_field_types(const char *p, size_t len)
+{
+    int64_t i;
+    double d;
+    csv_error_t *error = parse_int64(p, len, &i);
+    if (error == NULL)
+        return SNIFF_INT64 | SNIFF_DOUBLE;
+    if (error == &INTEGER_OUT_OF_RANGE) /* e.g. a long id, which would lose digits as double */
+        return 0;
+    if (parse_double(p, len, &d) == NULL)
+        return SNIFF_DOUBLE;
+    if (parse_timestamp(p, len, &i) == NULL)
+        return SNIFF_TIMESTAMP;
+    return 0;
+}
+
+static int compare_int(const void *a, const void *b)
+{
+    int x = *(const int *)a, y = *(const int *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* parser of the len bytes at buf for sniffing, where every row can be parsed.
+ * return the parser if succeeds. otherwise return NULL and err will be set */
+static csv_parser_t *sniff_parser_new(const char *buf, size_t len, char field_delimiter, csv_error_t **err)
+{
+    csv_parser_t *parser = parser_new_on_memory(buf, len, field_delimiter, err);
+    if (parser != NULL)
+        parser->error_policy = CSV_ERRORS_TOLERANT;
+    return parser;
+}
+
+/* get whether the row just parsed by parser is the last one of the sample, and not complete */
+static int sniff_row_cut(const csv_parser_t *parser, int complete)
+{
+    size_t end = parser->pos;
+    return !complete && end == parser->end && end > 0 && parser->buf[end - 1] != LF_CHAR &&
+           parser->buf[end - 1] != CR_CHAR;
+}
+
+/* count fields of rows in sample with field_delimiter, and get the most common count and how many
+ * rows have it. empty lines are not counted.
+ * returns 0 when succeeds, -1 when fails */
+static int sniff_delimiter(const char *buf, size_t len, int complete, char field_delimiter, int *columns,
+                           size_t *consistent, csv_error_t **err)
+{
+    int counts[SNIFF_MAX_ROWS];
+    size_t n = 0;
+    *columns = 0;
+    *consistent = 0;
+
+    csv_parser_t *parser = sniff_parser_new(buf, len, field_delimiter, err);
+    if (parser == NULL)
+        return FAIL;
+    int res;
+    while (n < SNIFF_MAX_ROWS && (res = parse_view_row(parser, err)) == ROW_PARSED) {
+        if (n > 0 && sniff_row_cut(parser, complete))
+            break;
+        if (csv_row_field_count(parser->view_row) > 0)
+            counts[n++] = csv_row_field_count(parser->view_row);
+    }
+    csv_parser_free(parser);
+    if (res == FAIL)
+        return FAIL;
+
+    qsort(counts, n, sizeof(int), compare_int);
+    size_t i, run = 0;
+    for (i = 0; i < n; i++) {
+        run = i > 0 && counts[i] == counts[i - 1] ? run + 1 : 1;
+        if (run > *consistent) {
+            *consistent = run;
+            *columns = counts[i];
+        }
+    }
+    return SUCCEED;
+}
+
+/* line break after the row just parsed by parser */
+static int sniff_line_break(const csv_parser_t *parser)
+{
+    size_t end = parser->pos;
+    if (end > 0 && parser->buf[end - 1] == CR_CHAR)
+        return LINEBREAK_CR;
+    if (end > 1 && parser->buf[end - 1] == LF_CHAR && parser->buf[end - 2] == CR_CHAR)
+        return LINEBREAK_CRLF;
+    return LINEBREAK_LF;
+}
+
+/* what is found of a column when sniffing */
+typedef struct {
+    int fit;       /* types fitting all non-empty fields after the first row, see SNIFF_* */
+    int seen;      /* whether there is any non-empty field after the first row */
+    int first_fit; /* types fitting the field of the first row, -1 if it is empty or missing */
+    int repeated;  /* whether the field of the first row appears again */
+} sniff_column_t;
+
+/* infer line break, header and types of columns of dialect from sample.
+ * returns 0 when succeeds, -1 when fails */
+static int sniff_schema(csv_dialect_t *dialect, const char *buf, size_t len, int complete, csv_error_t **err)
+{
+    csv_parser_t *parser = sniff_parser_new(buf, len, dialect->field_delimiter, err);
+    if (parser == NULL)
+        return FAIL;
+    sniff_column_t *found = xmalloc(dialect->columns * sizeof(sniff_column_t), err);
+    csv_row_t *first = csv_row_new(err);
+    int res = found == NULL || first == NULL ? FAIL : csv_parse_next_row_into(parser, first, err);
+    if (res == FAIL) {
+        if (first != NULL)
+            csv_row_free(first);
+        xfree(found);
+        csv_parser_free(parser);
+        return FAIL;
+    }
+    dialect->line_break = sniff_line_break(parser);
+
+    int first_count = csv_row_field_count(first);
+    int column;
+    for (column = 0; column < dialect->columns; column++) {
+        sniff_column_t *c = &found[column];
+        c->fit = SNIFF_ANY;
+        c->seen = 0;
+        c->first_fit = -1;
+        c->repeated = 0;
+        if (column < first_count && csv_row_field_len(first, column) > 0)
+            c->first_fit = sniff_field_types(csv_row_field_get(first, column), csv_row_field_len(first, column));
+    }
+
+    size_t n = 1;
+    while (n < SNIFF_MAX_ROWS && (res = parse_view_row(parser, err)) == ROW_PARSED) {
+        if (sniff_row_cut(parser, complete))
+            break;
+        n++;
+        const csv_row_t *row = parser->view_row;
+        int count = csv_row_field_count(row);
+        for (column = 0; column < count && column < dialect->columns; column++) {
+            sniff_column_t *c = &found[column];
+            const char *p = csv_row_field_get(row, column);
+            size_t field_len = csv_row_field_len(row, column);
+            if (field_len == 0)
+                continue;
+            c->seen = 1;
+            c->fit &= sniff_field_types(p, field_len);
+            if (column < first_count && field_len == csv_row_field_len(first, column) &&
+                memcmp(p, csv_row_field_get(first, column), field_len) == 0)
+                c->repeated = 1;
+        }
+    }
+    csv_parser_free(parser);
+    csv_row_free(first);
+    if (res == FAIL) {
+        xfree(found);
+        return FAIL;
+    }
+
+    /* votes of columns for the first row being header */
+    int votes = 0;
+    for (column = 0; column < dialect->columns; column++) {
+        const sniff_column_t *c = &found[column];
+        if (!c->seen || c->first_fit == -1)
+            continue;
+        if (c->fit != 0)
+            votes += (c->first_fit & c->fit) == 0 ? 1 : -1;
+        else if (c->repeated)
+            votes--;
+    }
+    dialect->has_header = n > 1 && votes > 0;
+
+    for (column = 0; column < dialect->columns; column++) {
+        const sniff_column_t *c = &found[column];
+        int types = c->fit;
+        if (!dialect->has_header && c->first_fit != -1)
+            types &= c->first_fit;
+        else if (!c->seen) /* no field to tell */
+            types = 0;
+        dialect->types[column] = types & SNIFF_INT64       ? CSV_TYPE_INT64
+                                 : types & SNIFF_DOUBLE    ? CSV_TYPE_DOUBLE
+                                 : types & SNIFF_TIMESTAMP ? CSV_TYPE_TIMESTAMP
+                                                           : CSV_TYPE_STRING;
+    }
+    xfree(found);
+    return SUCCEED;
+}
+
+/* sniff dialect from the len bytes at buf, which is the whole input if complete.
+ * return the dialect if succeeds. otherwise return NULL and err will be set */
+static csv_dialect_t *sniff(const char *buf, size_t len, int complete, csv_error_t **err)
+{
+    char field_delimiter = COMMA_CHAR;
+    int columns = 0;
+    size_t best = 0;
+    size_t i;
+    for (i = 0; i < sizeof(SNIFF_DELIMITERS); i++) {
+        int n;
+        size_t consistent;
+        if (sniff_delimiter(buf, len, complete, SNIFF_DELIMITERS[i], &n, &consistent, err) == FAIL)
+            return NULL;
+        if (i == 0)
+            columns = n; /* the default, even if no delimiter splits rows */
+        if (n > 1 && consistent > best) {
+            field_delimiter = SNIFF_DELIMITERS[i];
+            columns = n;
+            best = consistent;
+        }
+    }
+
+    csv_dialect_t *dialect = xmalloc(sizeof(csv_dialect_t), err);
+    if (dialect == NULL)
+        return NULL;
+    dialect->field_delimiter = field_delimiter;
+    dialect->line_break = LINEBREAK_LF;
+    dialect->has_header = 0;
+    dialect->columns = columns;
+    dialect->types = NULL;
+    if (columns > 0) {
+        dialect->types = xmalloc(columns * sizeof(int), err);
+        if (dialect->types == NULL || sniff_schema(dialect, buf, len, complete, err) == FAIL) {
+            csv_dialect_free(dialect);
+            return NULL;
+        }
+    }
+    return dialect;
+}
+
+csv_dialect_t *csv_sniff(const char *buf, size_t len, csv_error_t **err)
+{
+    return sniff(buf, len, 0, err);
+}
+
+/* check that parser can still be set up for a dialect.
+ * returns 0 when it can, -1 when not and err is set */
+static int parser_check_unparsed(const csv_parser_t *parser, csv_error_t **err)
+{
+    if (parser->push || parser->stats.rows > 0 || parser->pos > 0) {
+        *err = csv_error_new(CSV_EINVALID_DIALECT, "dialect can only be set before parsing, and not to a push parser");
+        return FAIL;
+    }
+    return SUCCEED;
+}
+
+csv_dialect_t *csv_parser_sniff(csv_parser_t *parser, csv_error_t **err)
+{
+    if (parser_check_unparsed(parser, err) == FAIL)
+        return NULL;
+    /* the first block, input in memory is all there already */
+    while (!parser->eof && parser->end < parser->capacity) {
+        if (parser_fill(parser, err) == FAIL)
+            return NULL;
+    }
+    size_t len = parser->end < CSV_READ_BUFFER_SIZE ? parser->end : CSV_READ_BUFFER_SIZE;
+    csv_dialect_t *dialect = sniff(parser->buf, len, parser->eof && len == parser->end, err);
+    if (dialect == NULL)
+        return NULL;
+    if (csv_parser_set_dialect(parser, dialect, err) == FAIL) {
+        csv_dialect_free(dialect);
+        return NULL;
+    }
+    return dialect;
+}
+
+int csv_parser_set_dialect(csv_parser_t *parser, const csv_dialect_t *dialect, csv_error_t **err)
+{
+    if (parser_check_unparsed(parser, err) == FAIL)
+        return FAIL;
+    parser_set_field_delimiter(parser, dialect->field_delimiter);
+    /* bytes already read may have been checked for another kernel, those on memory are checked later */
+    if (parser->buf_kind == BUF_OWNED)
+        parser_check_cr(parser, parser->buf, parser->end);
+    if (dialect->has_header && csv_parser_read_header(parser, err) == FAIL)
+        return FAIL;
+    return csv_parser_set_schema(parser, dialect->types, dialect->columns, err);
+}
+
+void csv_dialect_free(csv_dialect_t *dialect)
+{
+    xfree(dialect->types);
+    xfree(dialect);
+}
+
+char csv_dialect_field_delimiter(const csv_dialect_t *dialect)
+{
+    return dialect->field_delimiter;
+}
+
+int csv_dialect_line_break(const csv_dialect_t *dialect)
+{
+    return dialect->line_break;
+}
+
+int csv_dialect_has_header(const csv_dialect_t *dialect)
+{
+    return dialect->has_header;
+}
+
+int csv_dialect_column_count(const csv_dialect_t *dialect)
+{
+    return dialect->columns;
+}
+
+int csv_dialect_column_type(const csv_dialect_t *dialect, int column)
+{
+    return dialect->types[column];
+}
+
+
+#ifdef CSV_WITH_THREADS
+/* parallel parsing.
+ *
+ * input is split into chunks of bytes, and parsed in two phases, both on a pool of worker threads:
+ * 1. each chunk is scanned for `"` and line breaks. since every `"` toggles whether we are in a
+ *    quoted field (an escape `""` toggles twice), parity of quotes before a chunk tells whether the
+ *    chunk starts in a quoted field. for both cases, the first line break which is not quoted is
+ *    recorded, so the true row boundary in each chunk is known once quote counts of all previous
+ *    chunks are summed up.
+ * 2. input is split again at those row boundaries, and each piece is parsed by its own parser, with
+ *    the same state machine as sequential parsing.
+ */
+
+/* no line break found */
+static const size_t NO_LINE_BREAK = (size_t)-1;
+
+/* chunks in flight in ordered mode, per thread. bounds memory of parsed but not delivered rows */
+static const size_t CHUNKS_IN_FLIGHT = 2;
+
+typedef struct {
+    size_t begin;
+    size_t end;
+
+    /* phase 1 */
+    size_t quotes;           /* count of `"` */
+    size_t line_break[2];    /* first line break after even/odd count of `"` in chunk */
+
+    /* phase 2, results in ordered mode */
+    field_t *fields;         /* fields of all rows */
+    size_t n_fields;
+    size_t fields_cap;
+    int *row_lens;           /* field count of each row */
+    size_t n_rows;
+    size_t rows_cap;
+    buffer_t *escaped;       /* content of escaped fields */
+    csv_error_t *err;
+    int done;
+} chunk_t;
+
+typedef struct {
+    const char *buf;
+    size_t len;
+    char field_delimiter;
+    int ordered;
+    csv_row_callback_t callback;
+    void *ctx;
+    scan_func scan;
+
+    chunk_t *chunks;
+    size_t n_chunks;
+    size_t window;           /* max chunks in flight in ordered mode */
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    size_t next;             /* next chunk to be processed */
+    size_t delivered;        /* chunks delivered in ordered mode */
+    size_t stop_at;          /* chunks from it on are not needed any more, because of error or callback */
+} parallel_t;
+
+/* stop_at is read by workers while parsing without lock, so it is always accessed atomically */
+static int parallel_stopped(parallel_t *pp, size_t idx)
+{
+    return idx >= __atomic_load_n(&pp->stop_at, __ATOMIC_RELAXED);
+}
+
+/* stop parsing chunks from idx on.
+ * in ordered mode, rows before a failed chunk are still needed, so only chunks after it are stopped */
+static void parallel_stop(parallel_t *pp, size_t idx)
+{
+    size_t stop_at = __atomic_load_n(&pp->stop_at, __ATOMIC_RELAXED);
+    while (idx < stop_at
+           && !__atomic_compare_exchange_n(&pp->stop_at, &stop_at, idx, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+/* phase 1 for a chunk */
+static void scan_chunk_line_breaks(parallel_t *pp, chunk_t *chunk)
+{
+    const char *p = pp->buf + chunk->begin;
+    const char *end = pp->buf + chunk->end;
+    int parity = 0;
+    int found = 0;
+
+    chunk->quotes = 0;
+    chunk->line_break[0] = chunk->line_break[1] = NO_LINE_BREAK;
+    /* with `"` as delimiter, the scanner stops at `"`, `\r` and `\n` */
+    while (found < 2 && (p = pp->scan(p, end, QUOTE_CHAR)) < end) {
+        if (*p == QUOTE_CHAR) {
+            chunk->quotes++;
+            parity ^= 1;
+        } else if (chunk->line_break[parity] == NO_LINE_BREAK) {
+            chunk->line_break[parity] = p - pp->buf;
+            found++;
+        }
+        p++;
+    }
+    /* only need to count quotes for the rest */
+    while (p < end && (p = memchr(p, QUOTE_CHAR, end - p)) != NULL) {
+        chunk->quotes++;
+        p++;
+    }
+}
+
+/* split input again at row boundaries found in phase 1.
+ * returns count of the new chunks, which are not empty */
+static size_t split_at_row_boundaries(parallel_t *pp)
+{
+    size_t n = 0;
+    size_t i;
+    int parity = 0;
+    size_t begin = 0;
+    for (i = 1; i < pp->n_chunks; i++) {
+        parity ^= pp->chunks[i - 1].quotes & 1;
+        size_t lb = pp->chunks[i].line_break[parity];
+        if (lb == NO_LINE_BREAK) /* the row goes on in the next chunk */
+            continue;
+
+        size_t boundary = lb + 1;
+        if (pp->buf[lb] == CR_CHAR && boundary < pp->len && pp->buf[boundary] == LF_CHAR)
+            boundary++;
+        if (boundary > begin) {
+            pp->chunks[n].begin = begin;
+            pp->chunks[n].end = boundary;
+            n++;
+            begin = boundary;
+        }
+    }
+    if (begin < pp->len) {
+        pp->chunks[n].begin = begin;
+        pp->chunks[n].end = pp->len;
+        n++;
+    }
+    return n;
+}
+
+/* keep a row parsed in a chunk, to be delivered in order later.
+ * returns 0 when succeeds, -1 when fails */
+static int chunk_keep_row(chunk_t *chunk, const csv_row_t *row, csv_error_t **err)
+{
+    if (chunk->n_rows == chunk->rows_cap) {
+        size_t new_cap = chunk->rows_cap > 0 ? chunk->rows_cap * 2 : 1024;
+        int *new_lens = xrealloc(chunk->row_lens, chunk->n_rows * sizeof(int), new_cap * sizeof(int), err);
+        if (new_lens == NULL)
+            return FAIL;
+        chunk->row_lens = new_lens;
+        chunk->rows_cap = new_cap;
+    }
+    while (chunk->n_fields + row->len > chunk->fields_cap) {
+        size_t new_cap = chunk->fields_cap > 0 ? chunk->fields_cap * 2 : 4096;
+        field_t *new_fields = xrealloc(chunk->fields, chunk->n_fields * sizeof(field_t), new_cap * sizeof(field_t), err);
+        if (new_fields == NULL)
+            return FAIL;
+        chunk->fields = new_fields;
+        chunk->fields_cap = new_cap;
+    }
+
+    int i;
+    for (i = 0; i < row->len; i++) {
+        field_t *field = &chunk->fields[chunk->n_fields++];
+        *field = row->fields[i];
+        /* fields without escape point into input, which never moves. others are in scratch buffer
+         * of parser which will be reused, copy them */
+        if (field->escaped) {
+            field->off = chunk->escaped->len;
+            if (buffer_append(chunk->escaped, row->fields[i].p, field->len, err) == FAIL)
+                return FAIL;
+        }
+    }
+    chunk->row_lens[chunk->n_rows++] = row->len;
+    return SUCCEED;
+}
+
+/* release results of a chunk */
+static void chunk_release(chunk_t *chunk)
+{
+    xfree(chunk->fields);
+    xfree(chunk->row_lens);
+    if (chunk->escaped != NULL)
+        buffer_free(chunk->escaped);
+    chunk->fields = NULL;
+    chunk->row_lens = NULL;
+    chunk->escaped = NULL;
+}
+
+/* phase 2 for a chunk, rows are delivered to callback in unordered mode, or kept in chunk. */
+static void parse_chunk(parallel_t *pp, size_t idx)
+{
+    chunk_t *chunk = &pp->chunks[idx];
+    csv_error_t *err = NULL;
+    csv_parser_t *parser = parser_new_on_memory(pp->buf + chunk->begin, chunk->end - chunk->begin,
+                                                pp->field_delimiter, &err);
+    if (parser == NULL)
+        goto DONE;
+    if (pp->ordered) {
+        chunk->escaped = buffer_new(&err);
+        if (chunk->escaped == NULL)
+            goto DONE;
+    }
+
+    const csv_row_t *row;
+    size_t row_idx = 0;
+    while (!parallel_stopped(pp, idx)
+           && (row = csv_parse_next_row_view(parser, &err)) != NULL) {
+        if (pp->ordered) {
+            if (chunk_keep_row(chunk, row, &err) == FAIL)
+                break;
+        } else if (pp->callback(row, idx, row_idx, pp->ctx) != 0) {
+            parallel_stop(pp, 0);
+        }
+        row_idx++;
+    }
+
+    /* escaped content will not move any more, point fields into it */
+    if (pp->ordered && chunk->escaped != NULL) {
+        size_t i;
+        for (i = 0; i < chunk->n_fields; i++) {
+            if (chunk->fields[i].escaped)
+                chunk->fields[i].p = chunk->escaped->p + chunk->fields[i].off;
+        }
+    }
+
+DONE:
+    /* errors of parsing live in the parser, keep a copy located in whole input. row of it is still
+     * counted from the beginning of chunk */
+    if (err != NULL && parser != NULL && err == &parser->error) {
+        err = csv_error_copy(err);
+        if (err != csv_error_oom()) {
+            err->row_offset += chunk->begin;
+            err->offset += chunk->begin;
+        }
+    }
+    if (parser != NULL)
+        csv_parser_free(parser);
+
+    pthread_mutex_lock(&pp->lock);
+    chunk->err = err;
+    chunk->done = 1;
+    if (err != NULL)
+        parallel_stop(pp, pp->ordered ? idx + 1 : 0);
+    pthread_cond_broadcast(&pp->cond);
+    pthread_mutex_unlock(&pp->lock);
+}
+
+/* worker of phase 1 */
+static void *scan_worker(void *arg)
+{
+    parallel_t *pp = arg;
+    while (1) {
+        pthread_mutex_lock(&pp->lock);
+        size_t idx = pp->next++;
+        pthread_mutex_unlock(&pp->lock);
+        if (idx >= pp->n_chunks)
+            return NULL;
+        scan_chunk_line_breaks(pp, &pp->chunks[idx]);
+    }
+}
+
+/* worker of phase 2 */
+static void *parse_worker(void *arg)
+{
+    parallel_t *pp = arg;
+    while (1) {
+        pthread_mutex_lock(&pp->lock);
+        /* in ordered mode, do not run too far ahead of delivery */
+        while (pp->ordered && !parallel_stopped(pp, pp->next) && pp->next >= pp->delivered + pp->window)
+            pthread_cond_wait(&pp->cond, &pp->lock);
+        if (parallel_stopped(pp, pp->next) || pp->next >= pp->n_chunks) {
+            pthread_mutex_unlock(&pp->lock);
+            return NULL;
+        }
+        size_t idx = pp->next++;
+        pthread_mutex_unlock(&pp->lock);
+        parse_chunk(pp, idx);
+    }
+}
+
+/* run worker on n_threads threads, and wait them to finish.
+ * if `ordered_delivery` is set, rows of chunks are delivered to callback in order meanwhile.
+ * returns 0 when succeeds, -1 when fails */
+static int run_workers(parallel_t *pp, int n_threads, void *(*worker)(void *), int ordered_delivery,
+                       csv_error_t **err)
+{
+    pthread_t *threads = xmalloc(n_threads * sizeof(pthread_t), err);
+    if (threads == NULL)
+        return FAIL;
+
+    pp->next = 0;
+    int i;
+    int started = 0;
+    for (i = 0; i < n_threads; i++) {
+        if (pthread_create(&threads[i], NULL, worker, pp) != 0)
+            break;
+        started++;
+    }
+    if (started == 0) {
+        xfree(threads);
+        *err = csv_error_new(CSV_ETHREAD, "failed to create thread");
+        return FAIL;
+    }
+
+    if (ordered_delivery) {
+        size_t k;
+        for (k = 0; k < pp->n_chunks; k++) {
+            chunk_t *chunk = &pp->chunks[k];
+            pthread_mutex_lock(&pp->lock);
+            while (!chunk->done && !(parallel_stopped(pp, k) && pp->next <= k))
+                pthread_cond_wait(&pp->cond, &pp->lock);
+            int done = chunk->done;
+            pthread_mutex_unlock(&pp->lock);
+            if (!done) /* stopped before the chunk is parsed */
+                break;
+
+            /* view rows on the kept fields */
+            csv_row_t row;
+            row.view = 1;
+            row.fields = chunk->fields;
+            row.arena = NULL;
+            size_t r;
+            int stopped = 0;
+            for (r = 0; r < chunk->n_rows && !stopped; r++) {
+                row.len = row.capacity = chunk->row_lens[r];
+                stopped = pp->callback(&row, k, r, pp->ctx) != 0;
+                row.fields += row.len;
+            }
+            chunk_release(chunk);
+
+            pthread_mutex_lock(&pp->lock);
+            pp->delivered++;
+            if (stopped)
+                parallel_stop(pp, k + 1);
+            pthread_cond_broadcast(&pp->cond);
+            pthread_mutex_unlock(&pp->lock);
+            if (stopped || chunk->err != NULL)
+                break;
+        }
+    }
+
+    for (i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    xfree(threads);
+    return SUCCEED;
+}
+
+int csv_parse_parallel(const char *buf, size_t len, char field_delimiter, int n_threads, int flags,
+                       csv_row_callback_t callback, void *ctx, csv_error_t **err)
+{
+    if (!is_valid_field_delimiter(field_delimiter)) {
+        *err = csv_error_new(CSV_EINVALID_FIELD_DELIMITER, "invalid field delimiter");
+        return FAIL;
+    }
+    if (n_threads <= 0) {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        n_threads = n > 0 ? (int)n : 1;
+    }
+
+    parallel_t pp;
+    pp.buf = buf;
+    pp.len = len;
+    pp.field_delimiter = field_delimiter;
+    pp.ordered = (flags & CSV_PARALLEL_ORDERED) != 0;
+    pp.callback = callback;
+    pp.ctx = ctx;
+    pp.scan = select_scan_unquoted();
+    pp.window = CHUNKS_IN_FLIGHT * n_threads;
+    pp.delivered = 0;
+    pp.stop_at = (size_t)-1;
+
+    /* several chunks per thread to balance load, but not too small or too large */
+    size_t chunk_size = len / ((size_t)n_threads * 4);
+    if (chunk_size < CSV_PARALLEL_MIN_CHUNK)
+        chunk_size = CSV_PARALLEL_MIN_CHUNK;
+    if (chunk_size > CSV_PARALLEL_MAX_CHUNK)
+        chunk_size = CSV_PARALLEL_MAX_CHUNK;
+    pp.n_chunks = len > 0 ? (len + chunk_size - 1) / chunk_size : 0;
+    if (pp.n_chunks == 0)
+        return SUCCEED;
+
+    pp.chunks = xmalloc(pp.n_chunks * sizeof(chunk_t), err);
+    if (pp.chunks == NULL)
+        return FAIL;
+    memset(pp.chunks, 0, pp.n_chunks * sizeof(chunk_t));
+    size_t i;
+    for (i = 0; i < pp.n_chunks; i++) {
+        pp.chunks[i].begin = i * chunk_size;
+        pp.chunks[i].end = i + 1 < pp.n_chunks ? (i + 1) * chunk_size : len;
+    }
+
+    pthread_mutex_init(&pp.lock, NULL);
+    pthread_cond_init(&pp.cond, NULL);
+
+    int res = SUCCEED;
+    if (pp.n_chunks > 1)
+        res = run_workers(&pp, n_threads, scan_worker, 0, err);
+    if (res == SUCCEED) {
+        pp.n_chunks = split_at_row_boundaries(&pp);
+        res = run_workers(&pp, n_threads, parse_worker, pp.ordered, err);
+    }
+
+    /* report error of the first failed chunk */
+    for (i = 0; i < pp.n_chunks; i++) {
+        chunk_release(&pp.chunks[i]);
+        if (pp.chunks[i].err != NULL) {
+            if (res == SUCCEED) {
+                *err = pp.chunks[i].err;
+                res = FAIL;
+            } else {
+                csv_error_free(pp.chunks[i].err);
+            }
+        }
+    }
+
+    pthread_cond_destroy(&pp.cond);
+    pthread_mutex_destroy(&pp.lock);
+    xfree(pp.chunks);
+    return res;
+}
+
+#ifdef CSV_HAVE_MMAP
+int csv_parse_file_parallel(const char *path, char field_delimiter, int n_threads, int flags,
+                            csv_row_callback_t callback, void *ctx, csv_error_t **err)
+{
+    char *buf;
+    size_t len;
+    if (map_file(path, &buf, &len, err) == FAIL)
+        return FAIL;
+
+    int res = csv_parse_parallel(buf, len, field_delimiter, n_threads, flags, callback, ctx, err);
+    if (buf != NULL)
+        munmap(buf, len);
+    return res;
+}
+#endif
+
+/* pipelined parsing.
+ * input is read ahead by the helper thread of a read-ahead source, rows are parsed into batches on
+ * a parser thread, and batches are consumed by the caller. full batches are passed to the caller
+ * through a single-producer single-consumer ring, and consumed ones flow back through another, so
+ * a fixed set of batches is reused. rings are lock free, a side only sleeps on the condition
+ * variable when its ring stays empty. */
+
+/* times to poll an empty ring before sleeping */
+static const int PIPELINE_SPINS = 1000;
+
+typedef struct {
+    void **slots;
+    size_t mask;  /* capacity - 1, capacity is power of 2 */
+    size_t head;  /* next slot to pop, only written by consumer */
+    size_t tail;  /* next slot to push, only written by producer */
+} ring_t;
+
+struct csv_pipeline_t {
+    csv_parser_t *parser;
+    size_t batch_rows;
+    csv_batch_t **batches;
+    int n_batches;
+
+    ring_t full;     /* parsed batches, from parser thread to caller */
+    ring_t spare;    /* consumed batches, from caller to parser thread */
+    csv_batch_t *last;       /* the last batch returned to caller, to be recycled */
+    csv_batch_t *final;      /* the last batch parsed, set before it is pushed */
+    csv_error_t *error;      /* error of parsing, set before the final batch is pushed */
+    int ended;               /* the final batch has been popped by caller */
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int caller_waiting;      /* sides sleeping on cond */
+    int parser_waiting;
+    int stop;                /* parser thread should exit */
+};
+
+/* ring can never be full, since it has room for all batches */
+static void ring_push(ring_t *ring, void *p)
+{
+    size_t tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    ring->slots[tail & ring->mask] = p;
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/* returns NULL if ring is empty */
+static void *ring_pop(ring_t *ring)
+{
+    size_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    if (head == __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE))
+        return NULL;
+    void *p = ring->slots[head & ring->mask];
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    return p;
+}
+
+/* push to ring, and wake the other side if it is sleeping */
+static void pipeline_push(csv_pipeline_t *pl, ring_t *ring, void *p, int *waiting)
+{
+    ring_push(ring, p);
+    /* pairs with the fence in pipeline_pop, so either the waiter sees the item or we see it waiting */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(waiting, __ATOMIC_RELAXED)) {
+        pthread_mutex_lock(&pl->lock);
+        pthread_cond_broadcast(&pl->cond);
+        pthread_mutex_unlock(&pl->lock);
+    }
+}
+
+/* pop from ring, and sleep if it stays empty.
+ * returns NULL if stopped */
+static void *pipeline_pop(csv_pipeline_t *pl, ring_t *ring, int *waiting)
+{
+    void *p;
+    int i;
+    for (i = 0; i < PIPELINE_SPINS; i++) {
+        if ((p = ring_pop(ring)) != NULL)
+            return p;
+    }
+
+    pthread_mutex_lock(&pl->lock);
+    __atomic_store_n(waiting, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    while ((p = ring_pop(ring)) == NULL && !__atomic_load_n(&pl->stop, __ATOMIC_RELAXED))
+        pthread_cond_wait(&pl->cond, &pl->lock);
+    __atomic_store_n(waiting, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&pl->lock);
+    return p;
+}
+
+static void *pipeline_worker(void *arg)
+{
+    csv_pipeline_t *pl = arg;
+    while (!__atomic_load_n(&pl->stop, __ATOMIC_RELAXED)) {
+        csv_batch_t *batch = pipeline_pop(pl, &pl->spare, &pl->parser_waiting);
+        if (batch == NULL) /* stopped */
+            break;
+        csv_error_t *err = NULL;
+        long n = csv_parse_next_batch(pl->parser, batch, pl->batch_rows, &err);
+        if (n <= 0) {
+            /* the caller may keep the error after the parser is gone */
+            pl->error = err != NULL && err == &pl->parser->error ? csv_error_copy(err) : err;
+            __atomic_store_n(&pl->final, batch, __ATOMIC_RELAXED);
+        }
+        pipeline_push(pl, &pl->full, batch, &pl->caller_waiting);
+        if (n <= 0)
+            break;
+    }
+    return NULL;
+}
+
+/* read from FILE, so that it can be read ahead */
+static long file_read(void *ctx, char *buf, size_t len, csv_error_t **err)
+{
+    size_t n = fread(buf, 1, len, ctx);
+    if (n == 0 && ferror((FILE *)ctx)) {
+        *err = csv_error_new(CSV_EIO, strerror(errno));
+        return FAIL;
+    }
+    return (long)n;
+}
+
+/* release pipeline, whose parser thread is not running */
+static void pipeline_release(csv_pipeline_t *pl)
+{
+    int i;
+    for (i = 0; i < pl->n_batches; i++) {
+        if (pl->batches[i] != NULL)
+            csv_batch_free(pl->batches[i]);
+    }
+    if (pl->error != NULL)
+        csv_error_free(pl->error);
+    xfree(pl->batches);
+    xfree(pl->full.slots);
+    xfree(pl->spare.slots);
+    pthread_mutex_destroy(&pl->lock);
+    pthread_cond_destroy(&pl->cond);
+    xfree(pl);
+}
+
+csv_pipeline_t *csv_pipeline_new(csv_parser_t *parser, size_t batch_rows, int depth, csv_error_t **err)
+{
+    if (parser->push) {
+        *err = csv_error_new(CSV_EINVALID_VALUE, "push parser can not be pipelined");
+        return NULL;
+    }
+    if (batch_rows == 0)
+        batch_rows = 1;
+    if (depth < 2)
+        depth = 2;
+
+    csv_pipeline_t *pl = xmalloc(sizeof(csv_pipeline_t), err);
+    if (pl == NULL)
+        return NULL;
+    size_t cap = 2;
+    while (cap < (size_t)depth)
+        cap *= 2;
+    pl->parser = parser;
+    pl->batch_rows = batch_rows;
+    pl->n_batches = depth;
+    pl->batches = xmalloc(depth * sizeof(csv_batch_t *), err);
+    pl->full.slots = xmalloc(cap * sizeof(void *), err);
+    pl->spare.slots = xmalloc(cap * sizeof(void *), err);
+    pl->full.mask = pl->spare.mask = cap - 1;
+    pl->full.head = pl->full.tail = 0;
+    pl->spare.head = pl->spare.tail = 0;
+    pl->last = NULL;
+    pl->final = NULL;
+    pl->error = NULL;
+    pl->ended = 0;
+    pl->caller_waiting = 0;
+    pl->parser_waiting = 0;
+    pl->stop = 0;
+    pthread_mutex_init(&pl->lock, NULL);
+    pthread_cond_init(&pl->cond, NULL);
+    if (pl->batches != NULL)
+        memset(pl->batches, 0, depth * sizeof(csv_batch_t *));
+    if (pl->batches == NULL || pl->full.slots == NULL || pl->spare.slots == NULL) {
+        pipeline_release(pl);
+        return NULL;
+    }
+    int i;
+    for (i = 0; i < depth; i++) {
+        pl->batches[i] = csv_batch_new(err);
+        if (pl->batches[i] == NULL) {
+            pipeline_release(pl);
+            return NULL;
+        }
+        ring_push(&pl->spare, pl->batches[i]);
+    }
+
+    /* input of a FILE is read ahead by the reader thread of a read-ahead source. bytes already in
+     * read buffer are still parsed first */
+    if (parser->source.read_fn == NULL && parser->buf_kind == BUF_OWNED && !parser->eof) {
+        csv_source_t source = {file_read, NULL, parser->file};
+        if (csv_source_read_ahead(&source, err) == FAIL) {
+            pipeline_release(pl);
+            return NULL;
+        }
+        parser->source = source;
+    } else if (parser->source.read_fn != NULL && parser->source.read_fn != read_ahead_read &&
+               csv_source_read_ahead(&parser->source, err) == FAIL) {
+        pipeline_release(pl);
+        return NULL;
+    }
+
+    if (pthread_create(&pl->thread, NULL, pipeline_worker, pl) != 0) {
+        pipeline_release(pl);
+        *err = csv_error_new(CSV_ETHREAD, "failed to create thread");
+        return NULL;
+    }
+    return pl;
+}
+
+const csv_batch_t *csv_pipeline_next(csv_pipeline_t *pipeline, csv_error_t **err)
+{
+    csv_pipeline_t *pl = pipeline;
+    if (pl->last != NULL) {
+        pipeline_push(pl, &pl->spare, pl->last, &pl->parser_waiting);
+        pl->last = NULL;
+    }
+    if (pl->ended)
+        goto END;
+
+    csv_batch_t *batch = pipeline_pop(pl, &pl->full, &pl->caller_waiting);
+    /* final is set before the batch is pushed, so it is seen here */
+    if (batch == __atomic_load_n(&pl->final, __ATOMIC_RELAXED))
+        pl->ended = 1;
+    if (csv_batch_row_count(batch) > 0) { /* rows before error are delivered first */
+        pl->last = batch;
+        return batch;
+    }
+    pipeline_push(pl, &pl->spare, batch, &pl->parser_waiting);
+
+END:
+    if (pl->error != NULL) {
+        *err = pl->error;
+        pl->error = NULL;
+    }
+    return NULL;
+}
+
+void csv_pipeline_free(csv_pipeline_t *pipeline)
+{
+    csv_pipeline_t *pl = pipeline;
+    pthread_mutex_lock(&pl->lock);
+    __atomic_store_n(&pl->stop, 1, __ATOMIC_RELAXED);
+    pthread_cond_broadcast(&pl->cond);
+    pthread_mutex_unlock(&pl->lock);
+    pthread_join(pl->thread, NULL);
+
+    csv_parser_free(pl->parser);
+    pipeline_release(pl);
+}
+#endif /* CSV_WITH_THREADS */
+
+
+/* size of the output buffer of writer */
+#ifndef CSV_WRITE_BUFFER_SIZE
+#define CSV_WRITE_BUFFER_SIZE (64 * 1024)
+#endif
+
+/* writer */
+struct csv_writer_t {
+    FILE *file;
+    csv_sink_t sink; /* written instead of file if write_fn is set, see `csv_writer_new_sink` */
+    char field_delimiter;
+    int quote_style;
+    int line_break;
+    scan_func scan_unquoted; /* to find special characters in fields */
+    copy_func copy_unquoted; /* to find special characters in fields while copying them */
+
+    /* output buffer, [0, len) are not written to file yet */
+    char *buf;
+    size_t len;
+    size_t capacity;
+    int in_memory; /* output is kept in buf, which grows instead, see `csv_writer_new_buffer` */
+
+    /* statistics, see `csv_writer_stats` */
+    csv_stats_t stats;
+    trace_t trace;
+
+#ifdef CSV_WITH_THREADS
+    /* buffers committed in order, see `csv_writer_commit` */
+    pthread_mutex_t commit_lock;
+    pthread_cond_t commit_cond;
+    int64_t next_seq;
+    int commit_failed; /* a commit failed, so output is incomplete */
+#endif
+};
+
+
+csv_writer_t *csv_writer_new(FILE *file, char field_delimiter, int quote_style, int line_break, csv_error_t **err)
+{
+    if (!is_valid_field_delimiter(field_delimiter)) {
+        *err = csv_error_new(CSV_EINVALID_FIELD_DELIMITER, "invalid field delimiter");
+        return NULL;
+    }
+    if (quote_style != QUOTE_ALL && quote_style != QUOTE_MINIMAL) {
+        *err = csv_error_new(CSV_EINVALID_QUOTE_STYLE, "invalid quote style");
+        return NULL;
+    }
+    if (line_break != LINEBREAK_LF && line_break != LINEBREAK_CRLF && line_break != LINEBREAK_CR) {
+        *err = csv_error_new(CSV_EINVALID_LINEBREAK, "invalid line break");
+        return NULL;
+    }
+
+    csv_writer_t *writer = xmalloc(sizeof(csv_writer_t), err);
+    if (writer == NULL)
+        return NULL;
+
+    writer->capacity = CSV_WRITE_BUFFER_SIZE;
+    writer->buf = xmalloc(writer->capacity, err);
+    if (writer->buf == NULL) {
+        xfree(writer);
+        return NULL;
+    }
+
+    writer->file = file;
+    writer->sink.write_fn = NULL;
+    writer->sink.flush_fn = NULL;
+    writer->sink.close_fn = NULL;
+    writer->sink.ctx = NULL;
+    writer->field_delimiter = field_delimiter;
+    writer->quote_style = quote_style;
+    writer->line_break = line_break;
+    writer->scan_unquoted = select_scan_unquoted();
+    writer->copy_unquoted = select_copy_unquoted();
+    writer->len = 0;
+    writer->in_memory = 0;
+    memset(&writer->stats, 0, sizeof(csv_stats_t));
+    trace_init(&writer->trace);
+#ifdef CSV_WITH_THREADS
+    pthread_mutex_init(&writer->commit_lock, NULL);
+    pthread_cond_init(&writer->commit_cond, NULL);
+    writer->next_seq = 0;
+    writer->commit_failed = 0;
+#endif
+    return writer;
+}
+
+csv_writer_t *csv_writer_default(FILE *file, csv_error_t **err)
+{
+    return csv_writer_new(file, COMMA_CHAR, QUOTE_MINIMAL, LINEBREAK_LF, err);
+}
+
+csv_writer_t *csv_writer_new_sink(const csv_sink_t *sink, char field_delimiter, int quote_style, int line_break,
+                                  csv_error_t **err)
+{
+    csv_writer_t *writer = csv_writer_new(NULL, field_delimiter, quote_style, line_break, err);
+    if (writer == NULL) {
+        if (sink->close_fn != NULL) {
+            csv_error_t *close_err = NULL;
+            if (sink->close_fn(sink->ctx, &close_err) == FAIL)
+                csv_error_free(close_err);
+        }
+        return NULL;
+    }
+    writer->sink = *sink;
+    return writer;
+}
+
+#ifdef CSV_WITH_ZLIB
+/* gzip sink, by zlib */
+static void gzip_sink_error(gzFile gz, csv_error_t **err)
+{
+    int errnum;
+    const char *msg = gzerror(gz, &errnum);
+    *err = csv_error_new(CSV_EIO, errnum == Z_ERRNO ? strerror(errno) : msg);
+}
+
+static int gzip_write(void *ctx, const char *buf, size_t len, csv_error_t **err)
+{
+    gzFile gz = ctx;
+    while (len > 0) {
+        unsigned n = len > INT_MAX ? INT_MAX : (unsigned)len;
+        if (gzwrite(gz, buf, n) == 0) {
+            gzip_sink_error(gz, err);
+            return FAIL;
+        }
+        buf += n;
+        len -= n;
+    }
+    return SUCCEED;
+}
+
+static int gzip_flush(void *ctx, csv_error_t **err)
+{
+    gzFile gz = ctx;
+    if (gzflush(gz, Z_SYNC_FLUSH) != Z_OK) {
+        gzip_sink_error(gz, err);
+        return FAIL;
+    }
+    return SUCCEED;
+}
+
+static int gzip_sink_close(void *ctx, csv_error_t **err)
+{
+    int res = gzclose(ctx);
+    if (res != Z_OK) {
+        *err = csv_error_new(CSV_EIO, res == Z_ERRNO ? strerror(errno) : "gzclose failed");
+        return FAIL;
+    }
+    return SUCCEED;
+}
+
+int csv_sink_gzip(csv_sink_t *sink, const char *path, int level, csv_error_t **err)
+{
+    if (level < -1 || level > 9) {
+        *err = csv_error_new(CSV_EINVALID_VALUE, "invalid compression level");
+        return FAIL;
+    }
+    char mode[4] = "wb";
+    if (level >= 0) {
+        mode[2] = (char)('0' + level);
+        mode[3] = '\0';
+    }
+    gzFile gz = gzopen(path, mode);
+    if (gz == NULL) {
+        *err = csv_error_new(CSV_EIO, errno != 0 ? strerror(errno) : "gzopen failed");
+        return FAIL;
+    }
+    gzbuffer(gz, CSV_WRITE_BUFFER_SIZE);
+    sink->write_fn = gzip_write;
+    sink->flush_fn = gzip_flush;
+    sink->close_fn = gzip_sink_close;
+    sink->ctx = gz;
+    return SUCCEED;
+}
+#endif
+
+#ifdef CSV_WITH_ZSTD
+/* zstd sink */
+typedef struct {
+    FILE *file;
+    ZSTD_CCtx *cctx;
+    char *out_buf;
+    size_t out_cap;
+} zstd_sink_t;
+
+/* compress len bytes at buf into file, mode is ZSTD_e_continue, or ZSTD_e_flush / ZSTD_e_end to
+ * also write out everything buffered by the compressor.
+ * returns 0 when succeeds, -1 when fails */
+static int zstd_compress(zstd_sink_t *zs, const char *buf, size_t len, ZSTD_EndDirective mode, csv_error_t **err)
+{
+    ZSTD_inBuffer in = {buf, len, 0};
+    size_t remaining;
+    do {
+        ZSTD_outBuffer out = {zs->out_buf, zs->out_cap, 0};
+        remaining = ZSTD_compressStream2(zs->cctx, &out, &in, mode);
+        if (ZSTD_isError(remaining)) {
+            *err = csv_error_new(CSV_EIO, ZSTD_getErrorName(remaining));
+            return FAIL;
+        }
+        if (fwrite(zs->out_buf, 1, out.pos, zs->file) != out.pos) {
+            *err = csv_error_new(CSV_EIO, strerror(errno));
+            return FAIL;
+        }
+    } while (mode == ZSTD_e_continue ? in.pos < in.size : remaining != 0);
+    return SUCCEED;
+}
 
-void csv_writer_free(csv_writer_t *writer)
+static int zstd_write(void *ctx, const char *buf, size_t len, csv_error_t **err)
+{
+    return zstd_compress(ctx, buf, len, ZSTD_e_continue, err);
+}
+
+static int zstd_flush(void *ctx, csv_error_t **err)
+{
+    zstd_sink_t *zs = ctx;
+    if (zstd_compress(zs, NULL, 0, ZSTD_e_flush, err) == FAIL)
+        return FAIL;
+    if (fflush(zs->file) != 0) {
+        *err = csv_error_new(CSV_EIO, strerror(errno));
+        return FAIL;
+    }
+    return SUCCEED;
+}
+
+static int zstd_sink_close(void *ctx, csv_error_t **err)
+{
+    zstd_sink_t *zs = ctx;
+    int res = zstd_compress(zs, NULL, 0, ZSTD_e_end, err);
+    if (fclose(zs->file) != 0 && res == SUCCEED) {
+        *err = csv_error_new(CSV_EIO, strerror(errno));
+        res = FAIL;
+    }
+    ZSTD_freeCCtx(zs->cctx);
+    xfree(zs->out_buf);
+    xfree(zs);
+    return res;
+}
+
+int csv_sink_zstd(csv_sink_t *sink, const char *path, int level, csv_error_t **err)
+{
+    zstd_sink_t *zs = xmalloc(sizeof(zstd_sink_t), err);
+    if (zs == NULL)
+        return FAIL;
+
+    zs->out_cap = ZSTD_CStreamOutSize();
+    zs->out_buf = xmalloc(zs->out_cap, err);
+    if (zs->out_buf == NULL) {
+        xfree(zs);
+        return FAIL;
+    }
+    zs->cctx = ZSTD_createCCtx();
+    if (zs->cctx == NULL) {
+        xfree(zs->out_buf);
+        xfree(zs);
+        *err = csv_error_oom();
+        return FAIL;
+    }
+    size_t res = ZSTD_CCtx_setParameter(zs->cctx, ZSTD_c_compressionLevel, level);
+    if (ZSTD_isError(res)) {
+        *err = csv_error_new(CSV_EINVALID_VALUE, "invalid compression level");
+        ZSTD_freeCCtx(zs->cctx);
+        xfree(zs->out_buf);
+        xfree(zs);
+        return FAIL;
+    }
+    zs->file = fopen(path, "wb");
+    if (zs->file == NULL) {
+        *err = csv_error_new(CSV_EIO, strerror(errno));
+        ZSTD_freeCCtx(zs->cctx);
+        xfree(zs->out_buf);
+        xfree(zs);
+        return FAIL;
+    }
+
+    sink->write_fn = zstd_write;
+    sink->flush_fn = zstd_flush;
+    sink->close_fn = zstd_sink_close;
+    sink->ctx = zs;
+    return SUCCEED;
+}
+#endif
+
+#ifdef CSV_WITH_DIRECT_IO
+/* direct sink.
+ * output is collected into one block, while writes of the previous ones are in flight. */
+typedef struct {
+    int fd;
+    int direct;     /* opened with O_DIRECT */
+    int flags;      /* file status flags of fd */
+    char *mem;      /* allocation of blocks */
+    char *blocks[CSV_DIRECT_IO_DEPTH];
+    struct aiocb cbs[CSV_DIRECT_IO_DEPTH];
+    int pending[CSV_DIRECT_IO_DEPTH]; /* write of the block is in flight */
+    int cur;        /* index of the block being filled */
+    size_t len;     /* bytes in cur */
+    off_t offset;   /* offset of cur in the file */
+} direct_sink_t;
+
+/* wait for the write of block i, if any.
+ * returns 0 when succeeds, -1 when fails */
+static int direct_complete_write(direct_sink_t *ds, int i, csv_error_t **err)
+{
+    if (!ds->pending[i])
+        return SUCCEED;
+    struct aiocb *cb = &ds->cbs[i];
+    ssize_t n = direct_wait(cb);
+    ds->pending[i] = 0;
+    if (n == -1) {
+        *err = csv_error_new(CSV_EIO, strerror(errno));
+        return FAIL;
+    }
+    if ((size_t)n != cb->aio_nbytes) {
+        *err = csv_error_new(CSV_EIO, "short write");
+        return FAIL;
+    }
+    if (!ds->direct)
+        posix_fadvise(ds->fd, cb->aio_offset, n, POSIX_FADV_DONTNEED);
+    return SUCCEED;
+}
+
+static int direct_write(void *ctx, const char *buf, size_t len, csv_error_t **err)
+{
+    direct_sink_t *ds = ctx;
+    while (len > 0) {
+        size_t n = CSV_DIRECT_IO_BLOCK_SIZE - ds->len;
+        if (n > len)
+            n = len;
+        memcpy(ds->blocks[ds->cur] + ds->len, buf, n);
+        ds->len += n;
+        buf += n;
+        len -= n;
+        if (ds->len < CSV_DIRECT_IO_BLOCK_SIZE)
+            break;
+
+        struct aiocb *cb = &ds->cbs[ds->cur];
+        memset(cb, 0, sizeof(struct aiocb));
+        cb->aio_fildes = ds->fd;
+        cb->aio_buf = ds->blocks[ds->cur];
+        cb->aio_nbytes = CSV_DIRECT_IO_BLOCK_SIZE;
+        cb->aio_offset = ds->offset;
+        cb->aio_sigevent.sigev_notify = SIGEV_NONE;
+        if (aio_write(cb) == -1) {
+            *err = csv_error_new(CSV_EIO, strerror(errno));
+            return FAIL;
+        }
+        ds->pending[ds->cur] = 1;
+        ds->offset += CSV_DIRECT_IO_BLOCK_SIZE;
+        ds->len = 0;
+        ds->cur = (ds->cur + 1) % CSV_DIRECT_IO_DEPTH;
+        /* the next block is free once its previous write completed */
+        if (direct_complete_write(ds, ds->cur, err) == FAIL)
+            return FAIL;
+    }
+    return SUCCEED;
+}
+
+/* set file status flags of fd to flags.
+ * returns 0 when succeeds, -1 when fails */
+static int direct_set_flags(direct_sink_t *ds, int flags, csv_error_t **err)
+{
+    if (fcntl(ds->fd, F_SETFL, flags) == -1) {
+        *err = csv_error_new(CSV_EIO, strerror(errno));
+        return FAIL;
+    }
+    return SUCCEED;
+}
+
+/* wait for all writes in flight, and write the partial block without O_DIRECT, as its size is not
+ * aligned. the block is kept, so it is written again in full once filled.
+ * returns 0 when succeeds, -1 when fails */
+static int direct_flush(void *ctx, csv_error_t **err)
+{
+    direct_sink_t *ds = ctx;
+    int i;
+    for (i = 0; i < CSV_DIRECT_IO_DEPTH; i++) {
+        if (direct_complete_write(ds, i, err) == FAIL)
+            return FAIL;
+    }
+    if (ds->len == 0)
+        return SUCCEED;
+
+    if (ds->direct && direct_set_flags(ds, ds->flags & ~O_DIRECT, err) == FAIL)
+        return FAIL;
+    size_t done = 0;
+    while (done < ds->len) {
+        ssize_t n = pwrite(ds->fd, ds->blocks[ds->cur] + done, ds->len - done, ds->offset + (off_t)done);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            *err = csv_error_new(CSV_EIO, strerror(errno));
+            if (ds->direct)
+                fcntl(ds->fd, F_SETFL, ds->flags);
+            return FAIL;
+        }
+        done += (size_t)n;
+    }
+    if (ds->direct && direct_set_flags(ds, ds->flags, err) == FAIL)
+        return FAIL;
+    return SUCCEED;
+}
+
+static int direct_sink_close(void *ctx, csv_error_t **err)
+{
+    direct_sink_t *ds = ctx;
+    int res = direct_flush(ds, err);
+    if (res == SUCCEED && fdatasync(ds->fd) == -1) {
+        *err = csv_error_new(CSV_EIO, strerror(errno));
+        res = FAIL;
+    }
+    if (res == SUCCEED)
+        posix_fadvise(ds->fd, 0, 0, POSIX_FADV_DONTNEED);
+
+    int i;
+    for (i = 0; i < CSV_DIRECT_IO_DEPTH; i++) {
+        if (ds->pending[i])
+            direct_wait(&ds->cbs[i]);
+    }
+    if (close(ds->fd) == -1 && res == SUCCEED) {
+        *err = csv_error_new(CSV_EIO, strerror(errno));
+        res = FAIL;
+    }
+    xfree(ds->mem);
+    xfree(ds);
+    return res;
+}
+
+int csv_sink_direct(csv_sink_t *sink, const char *path, csv_error_t **err)
+{
+    direct_sink_t *ds = xmalloc(sizeof(direct_sink_t), err);
+    if (ds == NULL)
+        return FAIL;
+    memset(ds, 0, sizeof(direct_sink_t));
+    if (direct_alloc_blocks(&ds->mem, ds->blocks, err) == FAIL) {
+        xfree(ds);
+        return FAIL;
+    }
+    ds->fd = direct_open(path, O_WRONLY | O_CREAT | O_TRUNC, &ds->direct, err);
+    if (ds->fd == -1) {
+        xfree(ds->mem);
+        xfree(ds);
+        return FAIL;
+    }
+    ds->flags = fcntl(ds->fd, F_GETFL);
+    if (ds->flags == -1) {
+        *err = csv_error_new(CSV_EIO, strerror(errno));
+        close(ds->fd);
+        xfree(ds->mem);
+        xfree(ds);
+        return FAIL;
+    }
+
+    sink->write_fn = direct_write;
+    sink->flush_fn = direct_flush;
+    sink->close_fn = direct_sink_close;
+    sink->ctx = ds;
+    return SUCCEED;
+}
+#endif
+
+#ifdef CSV_WITH_THREADS
+/* asynchronous sink.
+ * output is collected into one of two buffers, while a helper thread writes (and so compresses) the
+ * other one to the wrapped sink. */
+typedef struct {
+    csv_sink_t inner;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    char *bufs[2];
+    size_t lens[2];
+    int queued[2];      /* buffer is handed to helper thread, not written yet */
+    int write_idx;      /* the buffer being filled */
+    int stop;           /* helper thread should exit */
+    int failed;         /* inner sink failed, later output is dropped */
+    csv_error_t *error; /* error of inner sink, not reported yet */
+} async_sink_t;
+
+static void *async_sink_worker(void *arg)
+{
+    async_sink_t *as = arg;
+    int idx = 0;
+    int failed = 0;
+    while (1) {
+        pthread_mutex_lock(&as->lock);
+        while (!as->queued[idx] && !as->stop)
+            pthread_cond_wait(&as->cond, &as->lock);
+        int queued = as->queued[idx];
+        pthread_mutex_unlock(&as->lock);
+        if (!queued) /* stopped, and everything is written */
+            break;
+
+        csv_error_t *err = NULL;
+        int res = failed ? SUCCEED : as->inner.write_fn(as->inner.ctx, as->bufs[idx], as->lens[idx], &err);
+
+        pthread_mutex_lock(&as->lock);
+        if (res == FAIL) {
+            as->error = err;
+            as->failed = failed = 1;
+        }
+        as->lens[idx] = 0;
+        as->queued[idx] = 0;
+        pthread_cond_broadcast(&as->cond);
+        pthread_mutex_unlock(&as->lock);
+        idx ^= 1;
+    }
+    return NULL;
+}
+
+/* report failure of helper thread, if any.
+ * must be called with lock held. returns 0 when succeeds, -1 when fails */
+static int async_sink_check(async_sink_t *as, csv_error_t **err)
+{
+    if (!as->failed)
+        return SUCCEED;
+    *err = as->error;
+    as->error = NULL;
+    if (*err == NULL) /* already reported */
+        *err = csv_error_new(CSV_EIO, "write failed");
+    return FAIL;
+}
+
+/* hand the buffer being filled to helper thread, and wait for the other one.
+ * must be called with lock held */
+static void async_sink_submit(async_sink_t *as)
+{
+    if (as->lens[as->write_idx] == 0)
+        return;
+    as->queued[as->write_idx] = 1;
+    pthread_cond_broadcast(&as->cond);
+    as->write_idx ^= 1;
+    while (as->queued[as->write_idx])
+        pthread_cond_wait(&as->cond, &as->lock);
+}
+
+/* hand the buffer being filled to helper thread, and wait until everything is written.
+ * must be called with lock held */
+static void async_sink_wait(async_sink_t *as)
+{
+    async_sink_submit(as);
+    while (as->queued[0] || as->queued[1])
+        pthread_cond_wait(&as->cond, &as->lock);
+}
+
+static int async_sink_write(void *ctx, const char *buf, size_t len, csv_error_t **err)
+{
+    async_sink_t *as = ctx;
+    pthread_mutex_lock(&as->lock);
+    int res = async_sink_check(as, err);
+    pthread_mutex_unlock(&as->lock);
+    if (res == FAIL)
+        return FAIL;
+
+    while (len > 0) {
+        int idx = as->write_idx;
+        size_t n = CSV_WRITE_BUFFER_SIZE - as->lens[idx];
+        if (n > len)
+            n = len;
+        memcpy(as->bufs[idx] + as->lens[idx], buf, n);
+        as->lens[idx] += n;
+        buf += n;
+        len -= n;
+        if (as->lens[idx] == CSV_WRITE_BUFFER_SIZE) {
+            pthread_mutex_lock(&as->lock);
+            async_sink_submit(as);
+            pthread_mutex_unlock(&as->lock);
+        }
+    }
+    return SUCCEED;
+}
+
+static int async_sink_flush(void *ctx, csv_error_t **err)
+{
+    async_sink_t *as = ctx;
+    pthread_mutex_lock(&as->lock);
+    async_sink_wait(as);
+    int res = async_sink_check(as, err);
+    pthread_mutex_unlock(&as->lock);
+    if (res == FAIL)
+        return FAIL;
+    /* helper thread is idle until next buffer is handed to it */
+    return as->inner.flush_fn != NULL ? as->inner.flush_fn(as->inner.ctx, err) : SUCCEED;
+}
+
+static int async_sink_close(void *ctx, csv_error_t **err)
+{
+    async_sink_t *as = ctx;
+    pthread_mutex_lock(&as->lock);
+    async_sink_wait(as);
+    int res = async_sink_check(as, err);
+    as->stop = 1;
+    pthread_cond_broadcast(&as->cond);
+    pthread_mutex_unlock(&as->lock);
+    pthread_join(as->thread, NULL);
+
+    if (as->inner.close_fn != NULL) {
+        csv_error_t *close_err = NULL;
+        if (as->inner.close_fn(as->inner.ctx, &close_err) == FAIL) {
+            if (res == FAIL)
+                csv_error_free(close_err);
+            else
+                *err = close_err;
+            res = FAIL;
+        }
+    }
+    if (as->error != NULL)
+        csv_error_free(as->error);
+    pthread_mutex_destroy(&as->lock);
+    pthread_cond_destroy(&as->cond);
+    xfree(as->bufs[0]);
+    xfree(as);
+    return res;
+}
+
+int csv_sink_async(csv_sink_t *sink, csv_error_t **err)
 {
-    free(writer);
+    async_sink_t *as = xmalloc(sizeof(async_sink_t), err);
+    if (as == NULL)
+        return FAIL;
+    as->bufs[0] = xmalloc(2 * CSV_WRITE_BUFFER_SIZE, err);
+    if (as->bufs[0] == NULL) {
+        xfree(as);
+        return FAIL;
+    }
+    as->bufs[1] = as->bufs[0] + CSV_WRITE_BUFFER_SIZE;
+    as->inner = *sink;
+    as->lens[0] = as->lens[1] = 0;
+    as->queued[0] = as->queued[1] = 0;
+    as->write_idx = 0;
+    as->stop = 0;
+    as->failed = 0;
+    as->error = NULL;
+    pthread_mutex_init(&as->lock, NULL);
+    pthread_cond_init(&as->cond, NULL);
+    if (pthread_create(&as->thread, NULL, async_sink_worker, as) != 0) {
+        pthread_mutex_destroy(&as->lock);
+        pthread_cond_destroy(&as->cond);
+        xfree(as->bufs[0]);
+        xfree(as);
+        *err = csv_error_new(CSV_ETHREAD, "failed to create thread");
+        return FAIL;
+    }
+
+    sink->write_fn = async_sink_write;
+    sink->flush_fn = async_sink_flush;
+    sink->close_fn = async_sink_close;
+    sink->ctx = as;
+    return SUCCEED;
 }
+#endif
 
+/* write len bytes at s to sink or file.
+ * returns 0 when succeeds, -1 when fails */
+static int csv_writer_output(csv_writer_t *writer, const char *s, size_t len, csv_error_t **err)
+{
+    uint64_t start = writer->trace.enabled ? now_ns() : 0;
+    int res = SUCCEED;
+    if (writer->sink.write_fn != NULL) {
+        res = writer->sink.write_fn(writer->sink.ctx, s, len, err);
+    } else if (fwrite(s, 1, len, writer->file) != len) {
+        *err = csv_error_new(CSV_EIO, strerror(errno));
+        res = FAIL;
+    }
+    if (res == SUCCEED)
+        writer->stats.bytes += len;
+    if (writer->trace.enabled)
+        writer->stats.io_ns += now_ns() - start;
+    return res;
+}
 
-/* write str
+/* write content of output buffer to sink or file.
  * returns 0 when succeeds, -1 when fails */
-static int csv_write_str(csv_writer_t *writer, const char *str, csv_error_t **err)
+static int csv_writer_drain(csv_writer_t *writer, csv_error_t **err)
 {
-    if (fputs(str, writer->file) < 0) {
+    if (writer->in_memory) /* kept till committed */
+        return SUCCEED;
+    if (writer->len > 0 && csv_writer_output(writer, writer->buf, writer->len, err) == FAIL)
+        return FAIL;
+    writer->len = 0;
+    return SUCCEED;
+}
+
+int csv_writer_flush(csv_writer_t *writer, csv_error_t **err)
+{
+    if (csv_writer_drain(writer, err) == FAIL)
+        return FAIL;
+    if (writer->in_memory)
+        return SUCCEED;
+    if (writer->sink.write_fn != NULL)
+        return writer->sink.flush_fn != NULL ? writer->sink.flush_fn(writer->sink.ctx, err) : SUCCEED;
+    if (fflush(writer->file) != 0) {
         *err = csv_error_new(CSV_EIO, strerror(errno));
         return FAIL;
     }
     return SUCCEED;
 }
 
+int csv_writer_close(csv_writer_t *writer, csv_error_t **err)
+{
+    int res = SUCCEED;
+    if (writer->in_memory) {
+        /* rows not committed are dropped */
+    } else if (writer->sink.write_fn == NULL) {
+        res = csv_writer_flush(writer, err);
+    } else {
+        res = csv_writer_drain(writer, err);
+        if (writer->sink.close_fn != NULL) {
+            /* the sink is closed anyway, the first error is reported */
+            csv_error_t *close_err = NULL;
+            if (writer->sink.close_fn(writer->sink.ctx, &close_err) == FAIL) {
+                if (res == FAIL)
+                    csv_error_free(close_err);
+                else
+                    *err = close_err;
+                res = FAIL;
+            }
+        }
+    }
+    if (trace_due(&writer->trace, writer->stats.rows, 1))
+        writer->trace.callback(&writer->stats, writer->trace.ctx);
+#ifdef CSV_WITH_THREADS
+    pthread_mutex_destroy(&writer->commit_lock);
+    pthread_cond_destroy(&writer->commit_cond);
+#endif
+    xfree(writer->buf);
+    xfree(writer);
+    return res;
+}
+
+void csv_writer_free(csv_writer_t *writer)
+{
+    /* best effort, call csv_writer_close instead to know whether it succeeds */
+    csv_error_t *err = NULL;
+    if (csv_writer_close(writer, &err) == FAIL)
+        csv_error_free(err);
+}
+
+void csv_writer_stats(const csv_writer_t *writer, csv_stats_t *stats)
+{
+    *stats = writer->stats;
+}
+
+void csv_writer_trace(csv_writer_t *writer, size_t interval, csv_stats_callback_t callback, void *ctx)
+{
+    writer->trace.enabled = 1;
+    writer->trace.interval = interval;
+    writer->trace.callback = callback;
+    writer->trace.ctx = ctx;
+    writer->trace.reported_rows = writer->stats.rows;
+}
+
+
+/* make room for more than len bytes in output buffer, by writing it to file, or growing it for a
+ * writer in memory. for the former, the room may be less, i.e. when len exceeds the buffer.
+ * returns 0 when succeeds, -1 when fails */
+static int csv_writer_make_room(csv_writer_t *writer, size_t len, csv_error_t **err)
+{
+    if (!writer->in_memory)
+        return csv_writer_drain(writer, err);
+
+    size_t new_cap = writer->capacity * 2;
+    while (new_cap - writer->len <= len)
+        new_cap *= 2;
+    char *new_buf = xrealloc(writer->buf, writer->len, new_cap, err);
+    if (new_buf == NULL)
+        return FAIL;
+    writer->buf = new_buf;
+    writer->capacity = new_cap;
+    writer->stats.buffer_growths++;
+    return SUCCEED;
+}
+
+/* write len bytes at s into output buffer, the buffer is written to file when full.
+ * returns 0 when succeeds, -1 when fails */
+static int csv_write_bytes(csv_writer_t *writer, const char *s, size_t len, csv_error_t **err)
+{
+    if (len > writer->capacity - writer->len) {
+        if (csv_writer_make_room(writer, len, err) == FAIL)
+            return FAIL;
+        /* too large for the buffer, write it directly */
+        if (len >= writer->capacity)
+            return csv_writer_output(writer, s, len, err);
+    }
+    memcpy(writer->buf + writer->len, s, len);
+    writer->len += len;
+    return SUCCEED;
+}
+
 static int csv_write_char(csv_writer_t *writer, char c, csv_error_t **err)
 {
-    char str[2] = {c, '\0'};
-    return csv_write_str(writer, str, err);
+    if (writer->len == writer->capacity && csv_writer_make_room(writer, 1, err) == FAIL)
+        return FAIL;
+    writer->buf[writer->len++] = c;
+    return SUCCEED;
 }
 
 static int csv_write_newline(csv_writer_t *writer, csv_error_t **err)
@@ -545,39 +5283,58 @@ static int csv_write_newline(csv_writer_t *writer, csv_error_t **err)
         newline = CRLF_STR;
     else /* LINEBREAK_CR */
         newline = CR_STR;
-    return csv_write_str(writer, newline, err);
+    return csv_write_bytes(writer, newline, strlen(newline), err);
 }
 
-static int csv_write_field(csv_writer_t *writer, const char *field, int field_idx, int field_count, csv_error_t **err)
+static int csv_write_field(csv_writer_t *writer, const char *field, size_t len, int field_idx, int field_count, csv_error_t **err)
 {
-    const char* p;
+    const char *p = field;
+    const char *end = field + len;
     int need_quote = 0;
-    if (writer->quote_style == QUOTE_ALL)
+    int quoted = 0; /* whether begining quote is written */
+    if (writer->quote_style == QUOTE_ALL) {
         need_quote = 1;
-    else { /* QUOTE_MINIMAL */
-        /* check each character in field to determine whether quote is needed */
-        for (p = field; *p != '\0'; p++) {
-            if (*p == CR_CHAR || *p == LF_CHAR || *p == QUOTE_CHAR || *p == writer->field_delimiter) {
-                need_quote = 1;
-                break;
+    } else { /* QUOTE_MINIMAL, quote is needed if there is any special character in field */
+        if (len > writer->capacity - writer->len && csv_writer_make_room(writer, len, err) == FAIL)
+            return FAIL;
+        if (len < writer->capacity) {
+            /* copy the field into output buffer while looking for special characters, so a field
+             * which needs no quote, the common case, is read only once */
+            char *dst = writer->buf + writer->len;
+            p = writer->copy_unquoted(dst, field, end, writer->field_delimiter);
+            need_quote = p != end;
+            if (need_quote) {
+                /* insert begining quote before the copied part, the rest is escaped below.
+                 * there is room since the part is shorter than the field */
+                memmove(dst + 1, dst, p - field);
+                *dst = QUOTE_CHAR;
+                writer->len++;
+                quoted = 1;
             }
+            writer->len += p - field;
+        } else {
+            /* too large for the buffer, it will be written directly */
+            need_quote = writer->scan_unquoted(field, end, writer->field_delimiter) != end;
         }
     }
 
-    /* begining quote */
-    if (need_quote && csv_write_char(writer, QUOTE_CHAR, err) == FAIL)
+    /* begining quote, unless it is inserted above */
+    if (need_quote && !quoted && csv_write_char(writer, QUOTE_CHAR, err) == FAIL)
         return FAIL;
+    writer->stats.quoted_fields += need_quote;
 
-    /* content */
-    int res = SUCCEED;
-    for (p = field; *p != '\0'; p++) {
-        if (*p == QUOTE_CHAR) /* escape */
-            res = csv_write_str(writer, DOUBLE_QUOTES_STR, err);
-        else
-            res = csv_write_char(writer, *p, err);
-
-        if (res == FAIL)
+    /* content, copied in spans between quotes, each quote is escaped by doubling it */
+    while (p < end) {
+        const char *q = need_quote ? memchr(p, QUOTE_CHAR, end - p) : NULL;
+        if (q == NULL) {
+            if (csv_write_bytes(writer, p, end - p, err) == FAIL)
+                return FAIL;
+            break;
+        }
+        if (csv_write_bytes(writer, p, q + 1 - p, err) == FAIL || csv_write_char(writer, QUOTE_CHAR, err) == FAIL)
             return FAIL;
+        writer->stats.escapes++;
+        p = q + 1;
     }
 
     /* ending quote */
@@ -592,24 +5349,144 @@ static int csv_write_field(csv_writer_t *writer, const char *field, int field_id
 }
 
 
-int csv_write_row(csv_writer_t *writer, const csv_row_t *row, csv_error_t **err)
+/* a row of field_count fields is written, which began at mark, or NULL if not traced */
+static void writer_row_done(csv_writer_t *writer, int field_count, const trace_mark_t *mark)
+{
+    writer->stats.rows++;
+    writer->stats.fields += field_count;
+    if (mark != NULL) {
+        trace_end(&writer->stats, mark);
+        if (trace_due(&writer->trace, writer->stats.rows, 0))
+            writer->trace.callback(&writer->stats, writer->trace.ctx);
+    }
+}
+
+static int write_row(csv_writer_t *writer, const csv_row_t *row, csv_error_t **err)
 {
     const int field_count = csv_row_field_count(row);
     if (field_count == 0)
         /* special case: 1) a row with zero field, will be written as an empty line. */
         /* do nothing */;
-    else if (field_count == 1 && csv_row_field_get(row, 0)[0] == '\0') {
+    else if (field_count == 1 && csv_row_field_len(row, 0) == 0) {
         /* special case: 2) a row with one field which is empty string will be written as `""` */
-        if (csv_write_str(writer, DOUBLE_QUOTES_STR, err) == FAIL)
+        if (csv_write_bytes(writer, DOUBLE_QUOTES_STR, 2, err) == FAIL)
             return FAIL;
+        writer->stats.quoted_fields++;
     } else {
         /* normal case */
         int i;
         for (i = 0; i < field_count; i++) {
-            if (csv_write_field(writer, csv_row_field_get(row, i), i, field_count, err) == FAIL)
+            if (csv_write_field(writer, csv_row_field_get(row, i), csv_row_field_len(row, i), i, field_count, err) == FAIL)
+                return FAIL;
+        }
+    }
+
+    return csv_write_newline(writer, err);
+}
+
+static int write_fields(csv_writer_t *writer, const char *const *fields, const size_t *lens, int field_count,
+                        csv_error_t **err)
+{
+    /* same special cases as csv_write_row */
+    if (field_count == 1 && (lens != NULL ? lens[0] : strlen(fields[0])) == 0) {
+        if (csv_write_bytes(writer, DOUBLE_QUOTES_STR, 2, err) == FAIL)
+            return FAIL;
+        writer->stats.quoted_fields++;
+    } else {
+        int i;
+        for (i = 0; i < field_count; i++) {
+            size_t len = lens != NULL ? lens[i] : strlen(fields[i]);
+            if (csv_write_field(writer, fields[i], len, i, field_count, err) == FAIL)
                 return FAIL;
         }
     }
 
     return csv_write_newline(writer, err);
 }
+
+int csv_write_row(csv_writer_t *writer, const csv_row_t *row, csv_error_t **err)
+{
+    trace_mark_t mark;
+    int traced = writer->trace.enabled;
+    if (traced)
+        trace_begin(&writer->stats, &mark);
+    if (write_row(writer, row, err) == FAIL)
+        return FAIL;
+    writer_row_done(writer, csv_row_field_count(row), traced ? &mark : NULL);
+    return SUCCEED;
+}
+
+int csv_write_fields(csv_writer_t *writer, const char *const *fields, const size_t *lens, int field_count, csv_error_t **err)
+{
+    trace_mark_t mark;
+    int traced = writer->trace.enabled;
+    if (traced)
+        trace_begin(&writer->stats, &mark);
+    if (write_fields(writer, fields, lens, field_count, err) == FAIL)
+        return FAIL;
+    writer_row_done(writer, field_count, traced ? &mark : NULL);
+    return SUCCEED;
+}
+
+#ifdef CSV_WITH_THREADS
+csv_writer_t *csv_writer_new_buffer(const csv_writer_t *writer, csv_error_t **err)
+{
+    csv_writer_t *buffer = csv_writer_new(NULL, writer->field_delimiter, writer->quote_style, writer->line_break, err);
+    if (buffer != NULL)
+        buffer->in_memory = 1;
+    return buffer;
+}
+
+int csv_writer_commit(csv_writer_t *writer, csv_writer_t *buffer, int64_t seq, csv_error_t **err)
+{
+    /* every commit to a buffer fails here, so none of them waits for another */
+    if (writer->in_memory) {
+        *err = csv_error_new(CSV_EINVALID_VALUE, "only a buffer can be committed, to a writer of output");
+        return FAIL;
+    }
+    /* an invalid buffer still takes its turn and fails the later ones, so none of them waits forever */
+    int valid = buffer->in_memory;
+
+    pthread_mutex_lock(&writer->commit_lock);
+    while (seq > writer->next_seq)
+        pthread_cond_wait(&writer->commit_cond, &writer->commit_lock);
+    int res = SUCCEED;
+    if (seq >= 0 && seq < writer->next_seq) {
+        *err = csv_error_new(CSV_EINVALID_VALUE, "sequence number committed already");
+        pthread_mutex_unlock(&writer->commit_lock);
+        return FAIL;
+    }
+    if (!valid) {
+        *err = csv_error_new(CSV_EINVALID_VALUE, "only a buffer can be committed, to a writer of output");
+        writer->commit_failed = 1;
+        res = FAIL;
+    } else if (writer->commit_failed) {
+        *err = csv_error_new(CSV_EIO, "an earlier commit failed");
+        res = FAIL;
+    } else if (csv_write_bytes(writer, buffer->buf, buffer->len, err) == FAIL) {
+        writer->commit_failed = 1;
+        res = FAIL;
+    } else {
+        csv_stats_t *stats = &writer->stats;
+        stats->rows += buffer->stats.rows;
+        stats->fields += buffer->stats.fields;
+        stats->quoted_fields += buffer->stats.quoted_fields;
+        stats->escapes += buffer->stats.escapes;
+        stats->buffer_growths += buffer->stats.buffer_growths;
+        if (trace_due(&writer->trace, stats->rows, 0))
+            writer->trace.callback(stats, writer->trace.ctx);
+    }
+    /* later ones go on even if this one fails, they fail too then */
+    if (seq >= 0) {
+        writer->next_seq++;
+        pthread_cond_broadcast(&writer->commit_cond);
+    }
+    pthread_mutex_unlock(&writer->commit_lock);
+
+    if (valid) {
+        buffer->len = 0;
+        memset(&buffer->stats, 0, sizeof(csv_stats_t));
+    }
+    return res;
+}
+#endif
@@ -1,3 +1,4 @@
+#include <stdint.h>
 #include <stdio.h>
 
 /*
@@ -40,45 +41,200 @@ enum {
 
     CSV_EINVALID_QUOTE_STYLE,     /* invalid quote style. should be QUOTE_ALL or QUOTE_MINIMAL */
     CSV_EINVALID_LINEBREAK,       /* invalid line break. should be LINEBREAK_LF, LINEBREAK_CRLF, LINEBREAK_CRLF */
+    CSV_ETHREAD,                  /* failed to create thread */
+    CSV_EINVALID_COLUMN,          /* invalid column, i.e. negative column index */
+    CSV_EINVALID_VALUE,           /* field can not be converted to the type, i.e. `abc` as integer */
+    CSV_EINVALID_INDEX,           /* invalid index file, or index can not be used, i.e. with a push parser */
+    CSV_EINVALID_DIALECT,         /* dialect can not be sniffed or set, i.e. after rows are parsed */
 };
 
-/* error struct */
+/* error struct.
+ * errors of parsing carry where they happen, other errors have column -1 and 0 in the rest.
+ * errors of parsing are owned by the parser, and valid until the next call on it or it is freed;
+ * csv_error_copy them to keep longer. csv_error_free does nothing to them, as to the global oom one.
+ */
 typedef struct {
     int error_code;
     char *message;
+    size_t row;          /* index of the row being parsed, from 0 */
+    int column;          /* index of the field being parsed, from 0, or -1 if unknown */
+    uint64_t row_offset; /* offset in input where the row starts */
+    uint64_t offset;     /* offset in input where the error is found */
+    int flags;           /* internal */
 } csv_error_t;
 
 /* create an error.
  * if oom happens when dynamiclly alloc memory for the new error, or the new
  * error we want to create is oom, just return the global one. */
 csv_error_t *csv_error_new(int error_code, const char *message);
+/* create a copy of the error, with its location, owned by the caller */
+csv_error_t *csv_error_copy(const csv_error_t *err);
 /* free the error */
 void csv_error_free(csv_error_t *err);
 
 
+/* memory allocator.
+ * malloc_fn returns NULL when out of memory. ctx is passed to malloc_fn, free_fn and realloc_fn as is.
+ * realloc_fn resizes memory like realloc, and leaves it as is when out of memory. it can be NULL, then
+ * memory grows by malloc_fn, copying and free_fn. */
+typedef struct {
+    void *(*malloc_fn)(size_t size, void *ctx);
+    void (*free_fn)(void *ptr, void *ctx);
+    void *ctx;
+    void *(*realloc_fn)(void *ptr, size_t size, void *ctx);
+} csv_allocator_t;
+
+/* set the allocator used for all memory dynamically allocated by this library, including errors.
+ * the allocator is copied. pass NULL to restore the default one which uses malloc and free.
+ * it should be set before any object is created, and not be changed while any object is alive,
+ * since objects are released with the allocator they were allocated with. */
+void csv_set_allocator(const csv_allocator_t *allocator);
+
+
 typedef struct csv_parser_t csv_parser_t;
 /* create a parser.
  * return the parser if succeeds. otherwise return NULL and err will be set
  * parser will not take ownership of `file`, you have to close the file yourself after parsing finished.
- * this may be inconvenient, but so you can parse input from stdin. */
+ * this may be inconvenient, but so you can parse input from stdin.
+ * parser reads `file` in large blocks, so it may read beyond the last row returned. do not read from
+ * `file` yourself while parsing. */
 csv_parser_t *csv_parser_new(FILE *file, csv_error_t **err);
 /* create a parser with specified field_delimiter.
  * return the parser if succeeds. otherwise return NULL and err will be set */
 csv_parser_t *csv_parser_new_with_field_delimiter(FILE *file, char field_delimiter, csv_error_t **err);
+/* create a parser which parses the `len` bytes at `buf` directly.
+ * parser will not take ownership of `buf`, it should be valid and unchanged until parser is freed.
+ * fields of rows returned by `csv_parse_next_row_view` point into `buf`.
+ * return the parser if succeeds. otherwise return NULL and err will be set */
+csv_parser_t *csv_parser_new_mem(const char *buf, size_t len, char field_delimiter, csv_error_t **err);
+#if defined(__unix__) || defined(__APPLE__)
+#define CSV_HAVE_MMAP
+/* create a parser which parses the file at `path` directly from its memory mapping, instead of
+ * reading it through a FILE. pages of the file are shared via page cache with other processes
+ * mapping or reading the same file, and fields of rows returned by `csv_parse_next_row_view` point
+ * into the mapping. the file should not be truncated while parsing.
+ * return the parser if succeeds. otherwise return NULL and err will be set */
+csv_parser_t *csv_parser_new_mmap(const char *path, char field_delimiter, csv_error_t **err);
+#endif
+/* create a push parser, to which input is fed by `csv_parser_feed` in pieces of any size, instead
+ * of read from a file. so rows can be parsed as input arrives, e.g. from a non-blocking socket,
+ * without a thread blocking on it. pull functions like `csv_parse_next_row` can not be used on it.
+ * return the parser if succeeds. otherwise return NULL and err will be set */
+csv_parser_t *csv_parser_new_push(char field_delimiter, csv_error_t **err);
+
+/* input source of parser, other than FILE.
+ * read_fn reads at most len bytes into buf, and returns count of bytes read, 0 at end of input, or
+ * -1 if error occurred and err is set. close_fn releases ctx, it can be NULL.
+ * ctx is passed to them as is. */
+typedef struct {
+    long (*read_fn)(void *ctx, char *buf, size_t len, csv_error_t **err);
+    void (*close_fn)(void *ctx);
+    void *ctx;
+} csv_source_t;
+/* create a parser which reads input from source. the source is copied, and parser takes ownership
+ * of it, i.e. it is closed when parser is freed, or creating parser fails.
+ * return the parser if succeeds. otherwise return NULL and err will be set */
+csv_parser_t *csv_parser_new_source(const csv_source_t *source, char field_delimiter, csv_error_t **err);
+#ifdef CSV_WITH_ZLIB
+/* make source read the gzip file at `path`, decompressed. a file not compressed is read as is.
+ * only available when compiled with CSV_WITH_ZLIB defined (and linked with -lz).
+ * returns 0 when succeeds, -1 when fails */
+int csv_source_gzip(csv_source_t *source, const char *path, csv_error_t **err);
+#endif
+#ifdef CSV_WITH_ZSTD
+/* make source read the zstd file at `path`, decompressed.
+ * only available when compiled with CSV_WITH_ZSTD defined (and linked with -lzstd).
+ * returns 0 when succeeds, -1 when fails */
+int csv_source_zstd(csv_source_t *source, const char *path, csv_error_t **err);
+#endif
+#ifdef CSV_WITH_DIRECT_IO
+/* make source read the file at `path` with O_DIRECT, bypassing page cache, so parsing a huge file
+ * does not evict the working set of other processes. CSV_DIRECT_IO_DEPTH reads of
+ * CSV_DIRECT_IO_BLOCK_SIZE bytes are kept in flight by POSIX AIO. on a file system without O_DIRECT,
+ * the file is read as usual and pages are dropped from page cache once read.
+ * only available on linux when compiled with CSV_WITH_DIRECT_IO defined (and linked with -lrt before
+ * glibc 2.34).
+ * returns 0 when succeeds, -1 when fails */
+int csv_source_direct(csv_source_t *source, const char *path, csv_error_t **err);
+#endif
+#ifdef CSV_WITH_THREADS
+/* wrap source, so that it is read ahead by a helper thread, i.e. the next block is decompressed
+ * while the current one is parsed. source is replaced with the wrapper, which owns the original one.
+ * returns 0 when succeeds, -1 when fails (source is unchanged then) */
+int csv_source_read_ahead(csv_source_t *source, csv_error_t **err);
+#endif
+
 /* destroy parser */
 void csv_parser_free(csv_parser_t *parser);
+/* keep only the n columns at indices columns[0..n) (0-based) in rows returned by parser.
+ * other fields are still checked for format errors, but not copied. the i-th field of a returned
+ * row is the column columns[i], a column can be given more than once.
+ * if a row has fewer columns, the missing ones are empty strings. an empty line is still a row with
+ * zero field.
+ * pass n = 0 to keep all columns again. this should be called before parsing the next row.
+ * returns 0 when succeeds, -1 when fails */
+int csv_parser_set_columns(csv_parser_t *parser, const int *columns, int n, csv_error_t **err);
 
+/* error policy, how a parser handles malformed rows, i.e. those failing with CSV_EINVALID_FORMAT */
+enum {
+    CSV_ERRORS_STRICT,   /* parsing fails at the first malformed row, the default */
+    CSV_ERRORS_SKIP_ROW, /* a malformed row is dropped, and parsing goes on from the next line break */
+    CSV_ERRORS_TOLERANT, /* like python's csv, a stray quote is content, and an unclosed quote ends with input */
+};
+/* callback for each malformed row, with the error telling why and where, see `csv_error_t`.
+ * return non-zero to stop parsing, which then fails with the error. */
+typedef int (*csv_bad_row_callback_t)(const csv_error_t *error, void *ctx);
+/* set error policy of parser, and callback (can be NULL) for malformed rows skipped or tolerated.
+ * skipped rows still count in row numbers of errors.
+ * returns 0 when succeeds, -1 when fails, e.g. invalid policy */
+int csv_parser_set_error_policy(csv_parser_t *parser, int policy, csv_bad_row_callback_t callback, void *ctx,
+                                csv_error_t **err);
+/* get number of malformed rows skipped or tolerated by parser so far */
+size_t csv_parser_bad_rows(const csv_parser_t *parser);
+/* hint parser that rows have about `fields` fields with `bytes` bytes of content in total. rows
+ * returned by `csv_parse_next_row` are allocated at the size of the previous row (with some room for
+ * longer content), or of the hint before there is one, so a row needs no growth when rows are alike,
+ * e.g. of many columns. buffers for escaped fields are sized by the hint too.
+ * returns 0 when succeeds, -1 when fails */
+int csv_parser_set_row_hint(csv_parser_t *parser, int fields, size_t bytes, csv_error_t **err);
+
+/* header.
+ * csv files often have names of columns in the first row, like the one written by
+ * example_dump_mysql_db.c. call `csv_parser_read_header` before parsing other rows to take that row
+ * as header, then fields can be looked up by names in constant time.
+ */
 typedef struct csv_row_t csv_row_t;
+/* parse the next row as header, all of its columns are kept no matter `csv_parser_set_columns`.
+ * if some names appear more than once, the first column is used for the name.
+ * returns 1 if header is parsed, 0 if input is empty, -1 if error occurred and err is set. */
+int csv_parser_read_header(csv_parser_t *parser, csv_error_t **err);
+/* get header, or NULL if there is none. */
+const csv_row_t *csv_parser_header(const csv_parser_t *parser);
+/* get index of the column named `name` in header, or -1 if there is no such column. */
+int csv_parser_column_index(const csv_parser_t *parser, const char *name);
+/* get index of the field named `name` in rows returned by parser, which differs from column index
+ * when columns are projected. returns -1 if there is no such column or it is not kept. */
+int csv_parser_field_index(const csv_parser_t *parser, const char *name);
+/* like `csv_parser_set_columns`, but columns are specified by names in header.
+ * returns 0 when succeeds, -1 when fails, e.g. a name is not in header */
+int csv_parser_set_columns_by_name(csv_parser_t *parser, const char *const *names, int n, csv_error_t **err);
+
 /* create a empty csv row.
  * return the new row if succeeds. otherwise return NULL and err will be set */
 csv_row_t *csv_row_new(csv_error_t **err);
 /* destroy csv row */
 void csv_row_free(csv_row_t *row);
 /* reset csv row, but do not release resources it holds.
- * after reset, the row can be treated as a new empty row and reused.
+ * after reset, the row can be treated as a new empty row and reused. content of all fields lives in
+ * one memory region of the row, which is just rewound by reset, so appending fields to it again
+ * usually needs no allocation.
  * call `csv_row_free` if the row is not needed any more. */
 void csv_row_reset(csv_row_t *row);
 
+/* make room in row for at least `fields` fields with `bytes` bytes of content in total, so that
+ * appending them needs no allocation.
+ * returns 0 when succeeds, -1 when fails */
+int csv_row_reserve(csv_row_t *row, int fields, size_t bytes, csv_error_t **err);
 /* append a new field to the row.
  * returns 0 when succeeds, -1 when fails */
 int csv_row_append_field(csv_row_t *row, const char *field, size_t len, csv_error_t **err);
@@ -86,6 +242,24 @@ int csv_row_append_field(csv_row_t *row, const char *field, size_t len, csv_erro
 int csv_row_field_count(const csv_row_t *row);
 /* get field with specified index */
 char *csv_row_field_get(const csv_row_t *row, int idx);
+/* get length of field with specified index, without scanning for the terminating NUL */
+size_t csv_row_field_len(const csv_row_t *row, int idx);
+/* convert field with specified index to an integer, in decimal with optional sign.
+ * returns 0 when succeeds, -1 when fails, e.g. out of range */
+int csv_row_field_int64(const csv_row_t *row, int idx, int64_t *value, csv_error_t **err);
+/* convert field with specified index to a floating point number, in decimal with optional sign,
+ * fraction and exponent, e.g. `-1.5e3`. other forms strtod takes, like hex, `inf` and `nan`, and
+ * surrounding spaces are not allowed.
+ * returns 0 when succeeds, -1 when fails */
+int csv_row_field_double(const csv_row_t *row, int idx, double *value, csv_error_t **err);
+/* convert field with specified index to seconds since 1970-01-01 00:00:00 UTC.
+ * the field should be `YYYY-MM-DD`, optionally followed by ` HH:MM:SS` or `THH:MM:SS`, then
+ * fraction of second (which is dropped) and `Z`, like those exported from databases.
+ * returns 0 when succeeds, -1 when fails */
+int csv_row_field_timestamp(const csv_row_t *row, int idx, int64_t *value, csv_error_t **err);
+/* get field named `name` in header of parser, of a row returned by the parser.
+ * returns NULL if there is no such field, see `csv_parser_field_index`. */
+char *csv_row_field_by_name(const csv_parser_t *parser, const csv_row_t *row, const char *name);
 
 /* do the actual parse work.
  * returns the parsed row if succeeds.
@@ -98,6 +272,234 @@ char *csv_row_field_get(const csv_row_t *row, int idx);
  */
 csv_row_t *csv_parse_next_row(csv_parser_t *parser, csv_error_t **err);
 
+/* parse the next row into `row`, which is reset first, so a single row can be reused for all rows
+ * without allocating each time.
+ * returns 1 if a row is parsed, 0 if parsing finished, -1 if error occurred and err is set.
+ *
+ * usually you will call this function in a loop until it returns 0 or -1.
+ * the row is still owned by you, call csv_row_free when parsing finished.
+ */
+int csv_parse_next_row_into(csv_parser_t *parser, csv_row_t *row, csv_error_t **err);
+
+/* parse the next row like `csv_parse_next_row`, but without copying its fields.
+ * the returned row is owned by parser, and its fields point into parser's internal buffers, so the
+ * row is only valid until the next parse call on parser. do not free or modify it.
+ * fields of the row are NOT NUL-terminated, use `csv_row_field_len` to get their lengths.
+ * only fields with escaped quotes (`""`) are copied.
+ */
+const csv_row_t *csv_parse_next_row_view(csv_parser_t *parser, csv_error_t **err);
+
+
+/* callback of push parser for each row, which is a row like those returned by
+ * `csv_parse_next_row_view`, only valid during the call. return non-zero to stop parsing. */
+typedef int (*csv_push_callback_t)(const csv_row_t *row, void *ctx);
+/* feed the next len bytes of input to a push parser. each row completed by them is passed to
+ * callback, and an incomplete row at the end is kept, with its state, till the next feed.
+ * since a row is only parsed when it is complete, format errors are reported when the row is
+ * complete, or when input ends, if quotes are never closed.
+ * returns 0 when succeeds, 1 if stopped by callback, -1 if error occurred and err is set.
+ * when stopped, rows not passed to callback yet are kept, and passed on the next feed. */
+int csv_parser_feed(csv_parser_t *parser, const char *buf, size_t len, csv_push_callback_t callback,
+                    void *ctx, csv_error_t **err);
+/* tell a push parser input ends, and pass the remaining rows to callback.
+ * returns 0 when succeeds, 1 if stopped by callback, -1 if error occurred and err is set. */
+int csv_parser_feed_end(csv_parser_t *parser, csv_push_callback_t callback, void *ctx, csv_error_t **err);
+
+/* columnar batch.
+ * a batch holds several rows by columns, like Apache Arrow does. content of a column in all rows is
+ * stored one after another (without NUL) in one region, and content of row i of the column is
+ * [offsets[i], offsets[i + 1]) of the region. so rows of a column can be processed in a tight loop.
+ *
+ * with a schema set by `csv_parser_set_schema`, columns of numbers and timestamps are converted
+ * while parsing, and hold arrays of values instead. a field which can not be converted does not
+ * stop parsing, it is just marked invalid, and the error is recorded in batch.
+ */
+
+/* types of columns */
+enum {
+    CSV_TYPE_STRING,    /* not converted */
+    CSV_TYPE_INT64,     /* int64_t, see `csv_row_field_int64` */
+    CSV_TYPE_DOUBLE,    /* double, see `csv_row_field_double` */
+    CSV_TYPE_TIMESTAMP, /* int64_t, seconds since epoch, see `csv_row_field_timestamp` */
+};
+
+/* set types of the first n fields in rows returned by parser (after column projection), others are
+ * CSV_TYPE_STRING. it applies to batches parsed afterwards.
+ * returns 0 when succeeds, -1 when fails */
+int csv_parser_set_schema(csv_parser_t *parser, const int *types, int n, csv_error_t **err);
+
+typedef struct csv_batch_t csv_batch_t;
+/* create an empty batch.
+ * return the new batch if succeeds. otherwise return NULL and err will be set */
+csv_batch_t *csv_batch_new(csv_error_t **err);
+/* destroy batch */
+void csv_batch_free(csv_batch_t *batch);
+/* parse at most max_rows next rows into batch, which is reset first. memory of batch is kept and
+ * reused, so parse all rows into one batch to avoid allocating for each batch.
+ * columns of the batch are as many as fields of its longest row, shorter rows (including empty
+ * lines) have empty strings for missing fields. column projection of parser applies.
+ * returns number of rows parsed, which is 0 if parsing finished, -1 if error occurred and err is set.
+ * rows parsed before the error are still in batch. */
+long csv_parse_next_batch(csv_parser_t *parser, csv_batch_t *batch, size_t max_rows, csv_error_t **err);
+/* get number of rows in batch */
+size_t csv_batch_row_count(const csv_batch_t *batch);
+/* get number of columns in batch */
+int csv_batch_column_count(const csv_batch_t *batch);
+/* get type of column with specified index, see CSV_TYPE_* */
+int csv_batch_column_type(const csv_batch_t *batch, int column);
+/* get content of column with specified index, see offsets. only for CSV_TYPE_STRING columns. */
+const char *csv_batch_column_data(const csv_batch_t *batch, int column);
+/* get offsets of rows into content of column with specified index, there are row_count + 1 of them.
+ * only for CSV_TYPE_STRING columns. */
+const size_t *csv_batch_column_offsets(const csv_batch_t *batch, int column);
+/* get values of rows in column with specified index, for CSV_TYPE_INT64 and CSV_TYPE_TIMESTAMP columns */
+const int64_t *csv_batch_column_int64(const csv_batch_t *batch, int column);
+/* get values of rows in column with specified index, for CSV_TYPE_DOUBLE columns */
+const double *csv_batch_column_double(const csv_batch_t *batch, int column);
+/* get whether values of rows in typed column with specified index are valid. a value is invalid (and
+ * 0) if its field is missing or can not be converted. */
+const unsigned char *csv_batch_column_valid(const csv_batch_t *batch, int column);
+/* get number of fields which can not be converted in batch */
+size_t csv_batch_error_count(const csv_batch_t *batch);
+/* get the error of the first field which can not be converted in batch, and its location, or NULL if
+ * there is none. the error is owned by batch, and valid until the next parse into batch. */
+const csv_error_t *csv_batch_first_error(const csv_batch_t *batch, size_t *row, int *column);
+
+/*
+ * row offset index, which records where every stride-th row starts in input, so that a parser can
+ * start from any row without parsing rows before it again, i.e. for pagination, or for workers to
+ * parse ranges of rows from their own parsers.
+ * offsets are counted from where the parser started reading, so for a parser of FILE, the file
+ * should be at its beginning when the parser is created. an index is not valid after the input
+ * is changed.
+ */
+
+typedef struct csv_index_t csv_index_t;
+/* build index by parsing all remaining rows in parser, which are numbered from 0, i.e. the header
+ * is not counted if it has been read. row boundaries are found as rows are parsed, so `\r` and `\n`
+ * in quoted fields are handled, and the input is validated.
+ * return the index if succeeds. otherwise return NULL and err will be set */
+csv_index_t *csv_index_build(csv_parser_t *parser, size_t stride, csv_error_t **err);
+/* write index to the file at `path`, i.e. a sidecar file of input. offsets are stored as varint
+ * deltas, which take a few bytes for each indexed row.
+ * returns 0 when succeeds, -1 when fails */
+int csv_index_save(const csv_index_t *index, const char *path, csv_error_t **err);
+/* read index from the file at `path`, written by `csv_index_save`.
+ * return the index if succeeds. otherwise return NULL and err will be set */
+csv_index_t *csv_index_load(const char *path, csv_error_t **err);
+/* destroy index */
+void csv_index_free(csv_index_t *index);
+/* get count of rows in index */
+size_t csv_index_row_count(const csv_index_t *index);
+/* get stride of index */
+size_t csv_index_stride(const csv_index_t *index);
+/* get offset in input of the last indexed row at or before `row`, and set *indexed_row to its number.
+ * for a row beyond the last one, it is the end of input. */
+uint64_t csv_index_offset(const csv_index_t *index, size_t row, size_t *indexed_row);
+/* get offset in input of the next row to be parsed */
+uint64_t csv_parser_offset(const csv_parser_t *parser);
+/* move parser to the row numbered `row` in index, so it is the next row returned. at most stride - 1
+ * rows are parsed and skipped after seeking to the indexed row. parsers of FILE, memory and memory
+ * mapping can seek, those created by `csv_parser_new_source` or `csv_parser_new_push` can not.
+ * a FILE on a pipe can not seek either, except within rows already read.
+ * returns 0 when succeeds, -1 when fails */
+int csv_parser_seek_row(csv_parser_t *parser, const csv_index_t *index, size_t row, csv_error_t **err);
+
+/*
+ * dialect sniffing, which infers how input is formatted from a prefix of it, the first block read by
+ * a parser, instead of trying delimiters with failed parses of the whole input.
+ * the field delimiter is the one among `,`, `\t`, `;`, `|` and `:` which splits rows of the prefix
+ * into the same number (more than one) of fields most consistently. a column is typed if all of its
+ * non-empty fields in the prefix are of the type, and the first row is taken as header if its fields
+ * do not fit types of their columns, or do not appear again in columns of strings.
+ */
+typedef struct csv_dialect_t csv_dialect_t;
+/* sniff dialect of input from its first len bytes at buf. the last row is ignored if it does not end
+ * with a line break, since it may be cut, unless it is the only one.
+ * return the dialect if succeeds. otherwise return NULL and err will be set */
+csv_dialect_t *csv_sniff(const char *buf, size_t len, csv_error_t **err);
+/* sniff dialect of the input of parser from its first block, which is read into parser but not
+ * parsed, then set it to parser, see `csv_parser_set_dialect`. it should be called before parsing
+ * any row, and can not be used with a push parser.
+ * return the dialect if succeeds, which is owned by caller. otherwise return NULL and err will be set */
+csv_dialect_t *csv_parser_sniff(csv_parser_t *parser, csv_error_t **err);
+/* make parser parse input of dialect: set its field delimiter, which selects the specialized parsing
+ * for it, read header if dialect has one, and set schema of columns to types of dialect. it should be
+ * called before parsing any row. schema applies to fields after column projection, so set schema
+ * again if columns are projected.
+ * returns 0 when succeeds, -1 when fails */
+int csv_parser_set_dialect(csv_parser_t *parser, const csv_dialect_t *dialect, csv_error_t **err);
+/* destroy dialect */
+void csv_dialect_free(csv_dialect_t *dialect);
+/* get field delimiter of dialect */
+char csv_dialect_field_delimiter(const csv_dialect_t *dialect);
+/* get line break of dialect, LINEBREAK_* of the first row, or LINEBREAK_LF if there is none */
+int csv_dialect_line_break(const csv_dialect_t *dialect);
+/* get whether input of dialect has header */
+int csv_dialect_has_header(const csv_dialect_t *dialect);
+/* get number of columns of dialect, the most common number of fields in rows */
+int csv_dialect_column_count(const csv_dialect_t *dialect);
+/* get type of column with specified index of dialect, see CSV_TYPE_* */
+int csv_dialect_column_type(const csv_dialect_t *dialect, int column);
+
+#ifdef CSV_WITH_THREADS
+/*
+ * parallel parsing, of input in memory or a file.
+ * it is only available when compiled with CSV_WITH_THREADS defined (and linked with -pthread).
+ *
+ * input is split into chunks, whose row boundaries are resolved correctly even if quoted fields
+ * contain `\r` or `\n`. chunks are parsed on a pool of threads, with the same semantics as
+ * `csv_parse_next_row`.
+ */
+
+/* callback receiving rows parsed in parallel.
+ * row is like those returned by `csv_parse_next_row_view`, only valid during the call.
+ * chunk is index of the chunk where the row is, chunks are numbered in input order. row_idx is index
+ * of the row in its chunk. so (chunk, row_idx) gives the position of row in input.
+ * return 0 to continue, non-zero to stop parsing. */
+typedef int (*csv_row_callback_t)(const csv_row_t *row, size_t chunk, size_t row_idx, void *ctx);
+
+/* flags of parallel parsing */
+enum {
+    /* deliver rows in input order, all from the calling thread.
+     * otherwise rows are delivered as soon as they are parsed, from worker threads concurrently,
+     * then callback must be thread safe. */
+    CSV_PARALLEL_ORDERED = 1,
+};
+
+/* parse the `len` bytes at `buf` with n_threads threads (number of cpus if n_threads <= 0), and
+ * deliver each row to callback.
+ * returns 0 when succeeds (or stopped by callback), -1 when fails and err is set. when parallel
+ * parsing fails, rows after the error may or may not have been delivered, unless in ordered mode. */
+int csv_parse_parallel(const char *buf, size_t len, char field_delimiter, int n_threads, int flags,
+                       csv_row_callback_t callback, void *ctx, csv_error_t **err);
+#ifdef CSV_HAVE_MMAP
+/* parse the file at `path` in parallel, from its memory mapping. see `csv_parse_parallel` */
+int csv_parse_file_parallel(const char *path, char field_delimiter, int n_threads, int flags,
+                            csv_row_callback_t callback, void *ctx, csv_error_t **err);
+#endif
+
+/*
+ * pipelined parsing: input is read on a reader thread, parsed into batches on a parser thread, and
+ * consumed by the caller meanwhile. batches are handed over through lock-free rings and reused, so
+ * no memory is allocated once batches have grown to their working size.
+ */
+typedef struct csv_pipeline_t csv_pipeline_t;
+/* start parsing rows of parser into batches of at most batch_rows rows, at most depth (at least 2)
+ * batches are in flight. a FILE or source of parser is read by a read-ahead source on the reader
+ * thread, see `csv_source_read_ahead`; input in memory needs no reader. schema and projection of
+ * parser apply, and they should be set before.
+ * return the pipeline if succeeds, which takes ownership of parser, do not use parser any more.
+ * otherwise return NULL and err will be set, and parser is still owned by caller. */
+csv_pipeline_t *csv_pipeline_new(csv_parser_t *parser, size_t batch_rows, int depth, csv_error_t **err);
+/* get the next batch, which is owned by pipeline, and valid until the next call.
+ * returns NULL if parsing finished, or error occurred and err is set. rows parsed before an error
+ * are delivered before it. */
+const csv_batch_t *csv_pipeline_next(csv_pipeline_t *pipeline, csv_error_t **err);
+/* stop parsing, and destroy pipeline with its parser */
+void csv_pipeline_free(csv_pipeline_t *pipeline);
+#endif
+
 
 /* quote style */
 enum {
@@ -122,7 +524,70 @@ csv_writer_t *csv_writer_new(FILE *file, char field_delimiter, int quote_style,
  * line_break      = LINEBREAK_LF
  */
 csv_writer_t *csv_writer_default(FILE *file, csv_error_t **err);
-/* destroy csv writer */
+
+/* output sink of writer, other than FILE.
+ * write_fn writes all len bytes at buf. flush_fn makes bytes written so far reach their destination,
+ * it can be NULL. close_fn finishes output (e.g. writes the trailer of a compressed stream) and
+ * releases ctx, it can be NULL. they return 0 when succeed, or -1 if error occurred and err is set.
+ * ctx is passed to them as is. */
+typedef struct {
+    int (*write_fn)(void *ctx, const char *buf, size_t len, csv_error_t **err);
+    int (*flush_fn)(void *ctx, csv_error_t **err);
+    int (*close_fn)(void *ctx, csv_error_t **err);
+    void *ctx;
+} csv_sink_t;
+/* create a writer which writes output to sink. the sink is copied, and writer takes ownership of it,
+ * i.e. it is closed when writer is closed or freed, or creating writer fails.
+ * return the writer if succeeds. otherwise return NULL and err will be set */
+csv_writer_t *csv_writer_new_sink(const csv_sink_t *sink, char field_delimiter, int quote_style, int line_break,
+                                  csv_error_t **err);
+#ifdef CSV_WITH_ZLIB
+/* make sink write the gzip file at `path`, compressed at level 1 (fastest) to 9 (smallest), or -1 for
+ * the default of zlib.
+ * only available when compiled with CSV_WITH_ZLIB defined (and linked with -lz).
+ * returns 0 when succeeds, -1 when fails */
+int csv_sink_gzip(csv_sink_t *sink, const char *path, int level, csv_error_t **err);
+#endif
+#ifdef CSV_WITH_ZSTD
+/* make sink write the zstd file at `path`, compressed at level, as accepted by zstd (e.g. 1 to 19, 0
+ * for the default, negative for faster ones).
+ * only available when compiled with CSV_WITH_ZSTD defined (and linked with -lzstd).
+ * returns 0 when succeeds, -1 when fails */
+int csv_sink_zstd(csv_sink_t *sink, const char *path, int level, csv_error_t **err);
+#endif
+#ifdef CSV_WITH_DIRECT_IO
+/* make sink write the file at `path` (truncated or created) with O_DIRECT, bypassing page cache.
+ * output is collected into blocks of CSV_DIRECT_IO_BLOCK_SIZE bytes, and up to CSV_DIRECT_IO_DEPTH
+ * of them are written in flight by POSIX AIO. the last partial block is written without O_DIRECT by
+ * flush and close, and close waits for the output to reach the disk before dropping it from page
+ * cache. on a file system without O_DIRECT, the file is written as usual and dropped the same way.
+ * only available on linux when compiled with CSV_WITH_DIRECT_IO defined (and linked with -lrt before
+ * glibc 2.34).
+ * returns 0 when succeeds, -1 when fails */
+int csv_sink_direct(csv_sink_t *sink, const char *path, csv_error_t **err);
+#endif
+#ifdef CSV_WITH_THREADS
+/* wrap sink, so that it is written by a helper thread, i.e. the previous block is compressed while
+ * the next one is formatted. an error of the wrapped sink is reported by a later write, flush or
+ * close. sink is replaced with the wrapper, which owns the original one.
+ * returns 0 when succeeds, -1 when fails (sink is unchanged then) */
+int csv_sink_async(csv_sink_t *sink, csv_error_t **err);
+#endif
+
+/* write rows buffered in writer to the file, and flush the file.
+ * writer buffers output in a large block, and only writes to the file when it is full, so call this
+ * function when rows are needed to be in the file, i.e. before closing the file.
+ * for a sink, flush_fn of it is called, which may make compression worse if called often.
+ * returns 0 when succeeds, -1 when fails */
+int csv_writer_flush(csv_writer_t *writer, csv_error_t **err);
+/* write rows buffered in writer, close its sink if any, and destroy writer. the file of a writer
+ * created by `csv_writer_new` is flushed but not closed.
+ * writer is destroyed even if it fails.
+ * returns 0 when succeeds, -1 when fails */
+int csv_writer_close(csv_writer_t *writer, csv_error_t **err);
+/* destroy csv writer.
+ * rows still buffered are written to the file, but errors are ignored. call `csv_writer_flush` (or
+ * `csv_writer_close` instead) to find out whether they are written */
 void csv_writer_free(csv_writer_t *writer);
 
 /* write one row into the file
@@ -139,3 +604,63 @@ void csv_writer_free(csv_writer_t *writer);
  * each row is separated by line break according to line_break.
  */
 int csv_write_row(csv_writer_t *writer, const csv_row_t *row, csv_error_t **err);
+/* write a row of field_count fields to csv file, like `csv_write_row`, without building a csv_row_t.
+ * fields[i] is content of the i-th field with length lens[i], lens can be NULL if the fields are
+ * NUL-terminated strings.
+ * returns 0 when succeeds, -1 when fails */
+int csv_write_fields(csv_writer_t *writer, const char *const *fields, const size_t *lens, int field_count, csv_error_t **err);
+
+#ifdef CSV_WITH_THREADS
+/*
+ * parallel writing: rows are formatted on several threads, each into its own buffer, which is a
+ * writer in memory, and the buffers are committed to one writer of output in order.
+ * it is only available when compiled with CSV_WITH_THREADS defined (and linked with -pthread).
+ */
+
+/* create a buffer, a writer which keeps rows written by `csv_write_row` or `csv_write_fields` in
+ * memory, formatted with field delimiter, quote style and line break of writer, till they are
+ * committed to writer. rows not committed are dropped when it is freed.
+ * buffers can be used on different threads at the same time, each by one thread.
+ * return the buffer if succeeds. otherwise return NULL and err will be set */
+csv_writer_t *csv_writer_new_buffer(const csv_writer_t *writer, csv_error_t **err);
+/* append rows in buffer to output of writer, then the buffer is empty and can be reused. buffers
+ * committed with sequence numbers 0, 1, 2, ... are written in that order, and a commit waits until
+ * the one of the previous number is done, so each number should be committed once, by any thread.
+ * pass seq = -1 to write the buffer as soon as possible, in no order.
+ * it can be called concurrently from several threads, but writer should not be used otherwise then.
+ * statistics of buffer are added to those of writer.
+ * returns 0 when succeeds, -1 when fails. once a commit fails, later ones fail too. */
+int csv_writer_commit(csv_writer_t *writer, csv_writer_t *buffer, int64_t seq, csv_error_t **err);
+#endif
+
+
+/*
+ * statistics and tracing of parser and writer.
+ * counters are always kept, at the cost of a few additions per row. time and allocations are only
+ * measured after tracing is enabled, which also reports statistics to a callback every some rows.
+ */
+typedef struct {
+    uint64_t bytes;          /* bytes of input parsed, or of output written to file or sink */
+    uint64_t rows;           /* rows parsed (including header and skipped ones) or written */
+    uint64_t fields;
+    uint64_t quoted_fields;
+    uint64_t escapes;        /* quotes escaped as `""` */
+    uint64_t buffer_growths; /* times internal buffers are expanded */
+    uint64_t allocations;    /* memory allocations by this library, while traced */
+    uint64_t io_ns;          /* nanoseconds in reading input or writing output, while traced */
+    uint64_t scan_ns;        /* nanoseconds in parsing or formatting, besides io, while traced */
+} csv_stats_t;
+/* callback with statistics so far, which are only valid during the call */
+typedef void (*csv_stats_callback_t)(const csv_stats_t *stats, void *ctx);
+
+/* get statistics of parser so far */
+void csv_parser_stats(const csv_parser_t *parser, csv_stats_t *stats);
+/* start tracing parser. callback (can be NULL) is called every `interval` rows, and when parsing
+ * finishes. pass interval = 0 to call it only when parsing finishes.
+ * callback is called in the thread parsing rows, e.g. the parser thread of a pipeline. */
+void csv_parser_trace(csv_parser_t *parser, size_t interval, csv_stats_callback_t callback, void *ctx);
+/* get statistics of writer so far */
+void csv_writer_stats(const csv_writer_t *writer, csv_stats_t *stats);
+/* start tracing writer, like `csv_parser_trace`. callback is also called when writer is closed or
+ * freed. */
+void csv_writer_trace(csv_writer_t *writer, size_t interval, csv_stats_callback_t callback, void *ctx);
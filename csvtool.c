@@ -0,0 +1,554 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+
+#include "csv.h"
+
+/* command line tool to select columns, filter rows, re-delimit, re-quote or count rows of csv files.
+ *
+ * build:
+ * gcc -O2 -o csvtool csvtool.c csv.c
+ *
+ * to support -j, add `-DCSV_WITH_THREADS -pthread`.
+ *
+ * rows are parsed as views without copying fields, with only the needed columns (see
+ * `csv_parser_set_columns`), and written by the buffered writer, so a pass-through transform costs
+ * little more than copying the input.
+ */
+
+
+/* print usage and exit */
+static void usage(const char *progname)
+{
+    const char *TMPL = ""
+    "%s [OPTIONS] [FILE]                                                                      \n"
+    "transform csv FILE (or stdin if it is not given or is -) into csv on stdout.             \n"
+    "OPTIONS:                                                                                 \n"
+    "-d     field delimiter of input, a character, `tab` or `auto` to sniff it. defaults to , \n"
+    "-H     the first row is header, which is written too, and columns can be named           \n"
+    "-c     columns to keep in that order, comma separated numbers from 1 or names (with -H), \n"
+    "       e.g. -c 3,1,name. optional, defaults to all columns                               \n"
+    "-w     keep rows where a condition on a column holds, COL=TEXT, COL!=TEXT, COL~TEXT      \n"
+    "       (contains), COL<NUMBER or COL>NUMBER. can be given more than once, all must hold  \n"
+    "-D     field delimiter of output, a character or `tab`. defaults to the one of input     \n"
+    "-q     quote style of output, `minimal` or `all`. defaults to minimal                    \n"
+    "-l     line break of output, `lf`, `crlf` or `cr`. defaults to lf                        \n"
+    "-e     malformed rows, `strict` (fail), `skip` or `tolerant`. defaults to strict         \n"
+    "-n     only print count of rows kept (header excluded), instead of writing them          \n"
+    "-j     number of threads to parse FILE in parallel, rows are still written in order.     \n"
+    "       FILE should be a regular file, and -e can not be used then                        \n"
+    "-o     output file. optional, defaults to stdout                                         \n"
+    "--help print usage info and exit                                                        \n";
+    printf(TMPL, progname);
+    exit(EXIT_FAILURE);
+}
+
+
+/* conditions of -w */
+enum {
+    COND_EQ,       /* = */
+    COND_NE,       /* != */
+    COND_CONTAINS, /* ~ */
+    COND_LT,       /* < */
+    COND_GT,       /* > */
+};
+
+typedef struct {
+    const char *column; /* name or number of column */
+    int op;             /* COND_* */
+    const char *text;
+    size_t len;
+    double number;      /* text as number, for COND_LT and COND_GT */
+} condition;
+
+#define MAX_COLUMNS 1024
+#define MAX_CONDITIONS 64
+
+typedef struct {
+    const char *input;      /* NULL for stdin */
+    const char *output;     /* NULL for stdout */
+    char field_delimiter;   /* 0 to sniff */
+    char out_delimiter;     /* 0 for the one of input */
+    int header;
+    int quote_style;
+    int line_break;
+    int error_policy;
+    int count_only;
+    int threads;            /* 0 if not parallel */
+
+    const char *columns[MAX_COLUMNS];
+    int n_columns;          /* all columns are kept if 0 */
+    condition conds[MAX_CONDITIONS];
+    int n_conds;
+} options;
+
+/* state of a run */
+typedef struct {
+    const options *opt;
+    csv_writer_t *writer;
+    int out_fields[MAX_COLUMNS];     /* index of the field of each kept column in rows handled */
+    int cond_fields[MAX_CONDITIONS]; /* index of the field of the column of each condition */
+    const char *fields[MAX_COLUMNS];
+    size_t lens[MAX_COLUMNS];
+    unsigned long long rows;     /* rows kept */
+    int skip_first;              /* the first row is header, see `handle_row` */
+    csv_error_t *error;          /* error of writing */
+} run;
+
+static options parse_options(int argc, char *argv[]);
+
+
+static void fail(const char *what, csv_error_t *err)
+{
+    if (err->column >= 0)
+        fprintf(stderr, "%s failed at row %zu, column %d: code=%d, message=%s\n", what, err->row, err->column,
+                err->error_code, err->message);
+    else
+        fprintf(stderr, "%s failed: code=%d, message=%s\n", what, err->error_code, err->message);
+    csv_error_free(err);
+    exit(EXIT_FAILURE);
+}
+
+/* resolve a column given by number (from 1) or name in header (can be NULL) to its index from 0.
+ * exits if there is no such column */
+static int resolve_column(const char *column, const csv_parser_t *parser, const csv_row_t *header)
+{
+    char *end;
+    long n = strtol(column, &end, 10);
+    if (*column != '\0' && *end == '\0') {
+        if (n < 1 || n > MAX_COLUMNS * 64) {
+            fprintf(stderr, "invalid column number `%s`\n", column);
+            exit(EXIT_FAILURE);
+        }
+        return (int)n - 1;
+    }
+    int idx = header != NULL ? csv_parser_column_index(parser, column) : -1;
+    if (idx < 0) {
+        fprintf(stderr, "no column named `%s`%s\n", column, header != NULL ? "" : ", use -H to read header");
+        exit(EXIT_FAILURE);
+    }
+    return idx;
+}
+
+/* whether cond holds on the field of len bytes at p */
+static int cond_holds(const condition *cond, const char *p, size_t len)
+{
+    switch (cond->op) {
+        case COND_EQ:
+            return len == cond->len && memcmp(p, cond->text, len) == 0;
+        case COND_NE:
+            return len != cond->len || memcmp(p, cond->text, len) != 0;
+        case COND_CONTAINS: {
+            size_t i;
+            if (cond->len == 0)
+                return 1;
+            for (i = 0; i + cond->len <= len; i++) {
+                if (p[i] == cond->text[0] && memcmp(p + i, cond->text, cond->len) == 0)
+                    return 1;
+            }
+            return 0;
+        }
+        default: { /* COND_LT, COND_GT, fields not numbers never match */
+            char tmp[128];
+            char *end;
+            if (len == 0 || len >= sizeof(tmp))
+                return 0;
+            memcpy(tmp, p, len);
+            tmp[len] = '\0';
+            double d = strtod(tmp, &end);
+            if (*end != '\0')
+                return 0;
+            return cond->op == COND_LT ? d < cond->number : d > cond->number;
+        }
+    }
+}
+
+/* get field with index idx of row, a missing one is empty */
+static const char *row_field(const csv_row_t *row, int idx, size_t *len)
+{
+    if (idx >= csv_row_field_count(row)) {
+        *len = 0;
+        return "";
+    }
+    *len = csv_row_field_len(row, idx);
+    return csv_row_field_get(row, idx);
+}
+
+/* filter row and write the kept one, with fields located by out_fields and fields of conditions.
+ * when fields are already in place, all fields of row are written as they are.
+ * returns 0 when succeeds, -1 when fails */
+static int handle_row(run *r, const csv_row_t *row, int in_place)
+{
+    const options *opt = r->opt;
+    int i;
+    size_t len;
+    /* an empty line is still a row with zero field, kept unless there is a condition */
+    for (i = 0; i < opt->n_conds; i++) {
+        const char *p = row_field(row, r->cond_fields[i], &len);
+        if (csv_row_field_count(row) == 0 || !cond_holds(&opt->conds[i], p, len))
+            return 0;
+    }
+    r->rows++;
+    if (opt->count_only)
+        return 0;
+
+    if (in_place || opt->n_columns == 0 || csv_row_field_count(row) == 0)
+        return csv_write_row(r->writer, row, &r->error);
+    for (i = 0; i < opt->n_columns; i++)
+        r->fields[i] = row_field(row, r->out_fields[i], &r->lens[i]);
+    return csv_write_fields(r->writer, r->fields, r->lens, opt->n_columns, &r->error);
+}
+
+/* write header, of the kept columns at indices columns[0..n_columns) */
+static void write_header(run *r, const csv_row_t *header, const int *columns)
+{
+    const options *opt = r->opt;
+    int res;
+    if (opt->count_only)
+        return;
+    if (opt->n_columns == 0) {
+        res = csv_write_row(r->writer, header, &r->error);
+    } else {
+        int i;
+        for (i = 0; i < opt->n_columns; i++)
+            r->fields[i] = row_field(header, columns[i], &r->lens[i]);
+        res = csv_write_fields(r->writer, r->fields, r->lens, opt->n_columns, &r->error);
+    }
+    if (res == -1)
+        fail("write csv", r->error);
+}
+
+/* open parser on input, sniff dialect if asked and read header if any, and get field delimiter.
+ * columns of kept columns and those of conditions are resolved into columns[0..n) */
+static csv_parser_t *open_input(const options *opt, FILE **file, char *field_delimiter, int *columns, int *n)
+{
+    csv_error_t *err = NULL;
+    csv_parser_t *parser;
+    *file = NULL;
+#ifdef CSV_HAVE_MMAP
+    if (opt->input != NULL) {
+        parser = csv_parser_new_mmap(opt->input, opt->field_delimiter ? opt->field_delimiter : ',', &err);
+    } else
+#endif
+    {
+        *file = opt->input != NULL ? fopen(opt->input, "r") : stdin;
+        if (*file == NULL) {
+            perror("fopen");
+            exit(EXIT_FAILURE);
+        }
+        parser = csv_parser_new_with_field_delimiter(*file, opt->field_delimiter ? opt->field_delimiter : ',', &err);
+    }
+    if (parser == NULL)
+        fail("create csv parser", err);
+    if (csv_parser_set_error_policy(parser, opt->error_policy, NULL, NULL, &err) == -1)
+        fail("set error policy", err);
+
+    /* sniffing reads header too if there seems to be one */
+    *field_delimiter = opt->field_delimiter;
+    if (opt->field_delimiter == 0) {
+        csv_dialect_t *dialect = csv_parser_sniff(parser, &err);
+        if (dialect == NULL)
+            fail("sniff csv", err);
+        *field_delimiter = csv_dialect_field_delimiter(dialect);
+        csv_dialect_free(dialect);
+    }
+    if (opt->header && csv_parser_header(parser) == NULL && csv_parser_read_header(parser, &err) == -1)
+        fail("read header", err);
+
+    const csv_row_t *header = csv_parser_header(parser);
+    int i;
+    *n = 0;
+    for (i = 0; i < opt->n_columns; i++)
+        columns[(*n)++] = resolve_column(opt->columns[i], parser, header);
+    for (i = 0; i < opt->n_conds; i++)
+        columns[(*n)++] = resolve_column(opt->conds[i].column, parser, header);
+    return parser;
+}
+
+#ifdef CSV_WITH_THREADS
+static int parallel_callback(const csv_row_t *row, size_t chunk, size_t row_idx, void *ctx)
+{
+    run *r = ctx;
+    if (r->skip_first && chunk == 0 && row_idx == 0)
+        return 0;
+    return handle_row(r, row, 0) == -1;
+}
+
+/* parse input with threads, rows of columns are picked from whole rows */
+static void run_parallel(run *r, char field_delimiter, int has_header, const int *columns)
+{
+    const options *opt = r->opt;
+    csv_error_t *err = NULL;
+    int i;
+    for (i = 0; i < opt->n_columns; i++)
+        r->out_fields[i] = columns[i];
+    for (i = 0; i < opt->n_conds; i++)
+        r->cond_fields[i] = columns[opt->n_columns + i];
+    r->skip_first = has_header;
+    if (csv_parse_file_parallel(opt->input, field_delimiter, opt->threads, CSV_PARALLEL_ORDERED, parallel_callback,
+                                r, &err) == -1)
+        fail("parse csv", err);
+    if (r->error != NULL)
+        fail("write csv", r->error);
+}
+#endif
+
+/* parse input on this thread, with only columns needed */
+static void run_serial(run *r, csv_parser_t *parser, const int *columns, int n)
+{
+    const options *opt = r->opt;
+    csv_error_t *err = NULL;
+    int i;
+    /* kept columns come first, so rows without conditions need no picking */
+    if (opt->n_columns > 0 && csv_parser_set_columns(parser, columns, opt->n_conds > 0 ? n : opt->n_columns,
+                                                     &err) == -1)
+        fail("select columns", err);
+    for (i = 0; i < opt->n_columns; i++)
+        r->out_fields[i] = i;
+    for (i = 0; i < opt->n_conds; i++)
+        r->cond_fields[i] = opt->n_columns > 0 ? opt->n_columns + i : columns[i];
+    int in_place = opt->n_conds == 0;
+
+    const csv_row_t *row;
+    while ((row = csv_parse_next_row_view(parser, &err)) != NULL) {
+        if (handle_row(r, row, in_place) == -1)
+            fail("write csv", r->error);
+    }
+    if (err != NULL)
+        fail("parse csv", err);
+    size_t bad_rows = csv_parser_bad_rows(parser);
+    if (bad_rows > 0)
+        fprintf(stderr, "%zu malformed rows %s\n", bad_rows, opt->error_policy == CSV_ERRORS_SKIP_ROW ? "skipped" : "tolerated");
+}
+
+int main(int argc, char *argv[])
+{
+    options opt = parse_options(argc, argv);
+    csv_error_t *err = NULL;
+
+    FILE *file;
+    char field_delimiter;
+    int columns[MAX_COLUMNS + MAX_CONDITIONS];
+    int n;
+    csv_parser_t *parser = open_input(&opt, &file, &field_delimiter, columns, &n);
+
+    run r;
+    memset(&r, 0, sizeof(run));
+    r.opt = &opt;
+    FILE *out = stdout;
+    if (!opt.count_only) {
+        if (opt.output != NULL && (out = fopen(opt.output, "w")) == NULL) {
+            perror("fopen");
+            exit(EXIT_FAILURE);
+        }
+        r.writer = csv_writer_new(out, opt.out_delimiter ? opt.out_delimiter : field_delimiter, opt.quote_style,
+                                  opt.line_break, &err);
+        if (r.writer == NULL)
+            fail("create csv writer", err);
+    }
+    int has_header = csv_parser_header(parser) != NULL;
+    if (has_header)
+        write_header(&r, csv_parser_header(parser), columns);
+
+#ifdef CSV_WITH_THREADS
+    if (opt.threads > 0) {
+        csv_parser_free(parser);
+        run_parallel(&r, field_delimiter, has_header, columns);
+    } else
+#endif
+    {
+        run_serial(&r, parser, columns, n);
+        csv_parser_free(parser);
+    }
+    if (file != NULL && file != stdin)
+        fclose(file);
+
+    if (opt.count_only) {
+        printf("%llu\n", r.rows);
+    } else {
+        if (csv_writer_close(r.writer, &err) == -1)
+            fail("write csv", err);
+        if (out != stdout && fclose(out) != 0) {
+            perror("fclose");
+            exit(EXIT_FAILURE);
+        }
+    }
+    return 0;
+}
+
+
+/* parse a delimiter given to option, exits if it is invalid */
+static char parse_delimiter(int opt, const char *arg, int allow_auto)
+{
+    if (strcmp(arg, "tab") == 0 || strcmp(arg, "\\t") == 0)
+        return '\t';
+    if (allow_auto && strcmp(arg, "auto") == 0)
+        return 0;
+    if (strlen(arg) != 1 || arg[0] == '"' || arg[0] == '\r' || arg[0] == '\n') {
+        fprintf(stderr, "invalid field delimiter `%s` of -%c\n", arg, opt);
+        exit(EXIT_FAILURE);
+    }
+    return arg[0];
+}
+
+/* parse a condition of -w, exits if it is invalid */
+static void parse_condition(condition *cond, char *arg)
+{
+    static const char *const OPS[] = {"=", "!=", "~", "<", ">"};
+    char *p = arg + strcspn(arg, "=!~<>");
+    if (p == arg || *p == '\0') {
+        fprintf(stderr, "invalid condition `%s`, should be like COL=TEXT\n", arg);
+        exit(EXIT_FAILURE);
+    }
+    int op;
+    cond->op = -1;
+    for (op = 0; op < (int)(sizeof(OPS) / sizeof(OPS[0])); op++) {
+        if (strncmp(p, OPS[op], strlen(OPS[op])) == 0) {
+            cond->op = op;
+            break;
+        }
+    }
+    if (cond->op == -1) {
+        fprintf(stderr, "invalid condition `%s`, unknown operator\n", arg);
+        exit(EXIT_FAILURE);
+    }
+    cond->text = p + strlen(OPS[cond->op]);
+    cond->len = strlen(cond->text);
+    *p = '\0';
+    cond->column = arg;
+    if (cond->op == COND_LT || cond->op == COND_GT) {
+        char *end;
+        cond->number = strtod(cond->text, &end);
+        if (cond->len == 0 || *end != '\0') {
+            fprintf(stderr, "invalid number `%s` in condition\n", cond->text);
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+static options parse_options(int argc, char *argv[])
+{
+    if (argc == 2 && strcmp(argv[1], "--help") == 0)
+        usage(argv[0]);
+
+    options options;
+    memset(&options, 0, sizeof(options));
+    options.field_delimiter = ',';
+    options.quote_style = QUOTE_MINIMAL;
+    options.line_break = LINEBREAK_LF;
+    options.error_policy = CSV_ERRORS_STRICT;
+    int opt;
+    long threads;
+    char *endptr;
+    char *column;
+    const char *optstring = ":d:Hc:w:D:q:l:e:nj:o:";
+    while ((opt = getopt(argc, argv, optstring)) != -1) {
+        switch (opt) {
+            case 'd':
+                options.field_delimiter = parse_delimiter(opt, optarg, 1);
+                break;
+            case 'H':
+                options.header = 1;
+                break;
+            case 'c':
+                for (column = strtok(optarg, ","); column != NULL; column = strtok(NULL, ",")) {
+                    if (options.n_columns == MAX_COLUMNS) {
+                        fprintf(stderr, "too many columns, at most %d\n", MAX_COLUMNS);
+                        exit(EXIT_FAILURE);
+                    }
+                    options.columns[options.n_columns++] = column;
+                }
+                break;
+            case 'w':
+                if (options.n_conds == MAX_CONDITIONS) {
+                    fprintf(stderr, "too many conditions, at most %d\n", MAX_CONDITIONS);
+                    exit(EXIT_FAILURE);
+                }
+                parse_condition(&options.conds[options.n_conds++], optarg);
+                break;
+            case 'D':
+                options.out_delimiter = parse_delimiter(opt, optarg, 0);
+                break;
+            case 'q':
+                if (strcmp(optarg, "minimal") == 0) {
+                    options.quote_style = QUOTE_MINIMAL;
+                } else if (strcmp(optarg, "all") == 0) {
+                    options.quote_style = QUOTE_ALL;
+                } else {
+                    fprintf(stderr, "invalid quote style, should be minimal or all\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'l':
+                if (strcmp(optarg, "lf") == 0) {
+                    options.line_break = LINEBREAK_LF;
+                } else if (strcmp(optarg, "crlf") == 0) {
+                    options.line_break = LINEBREAK_CRLF;
+                } else if (strcmp(optarg, "cr") == 0) {
+                    options.line_break = LINEBREAK_CR;
+                } else {
+                    fprintf(stderr, "invalid line break, should be lf, crlf or cr\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'e':
+                if (strcmp(optarg, "strict") == 0) {
+                    options.error_policy = CSV_ERRORS_STRICT;
+                } else if (strcmp(optarg, "skip") == 0) {
+                    options.error_policy = CSV_ERRORS_SKIP_ROW;
+                } else if (strcmp(optarg, "tolerant") == 0) {
+                    options.error_policy = CSV_ERRORS_TOLERANT;
+                } else {
+                    fprintf(stderr, "invalid error policy, should be strict, skip or tolerant\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'n':
+                options.count_only = 1;
+                break;
+            case 'j':
+#ifdef CSV_WITH_THREADS
+                threads = strtol(optarg, &endptr, 10);
+                if (threads <= 0 || threads > 1024 || *endptr != '\0') {
+                    fprintf(stderr, "invalid number of threads, should be between 1 and 1024\n");
+                    exit(EXIT_FAILURE);
+                }
+                options.threads = (int)threads;
+                break;
+#else
+                (void)threads;
+                (void)endptr;
+                fprintf(stderr, "parallel parsing is not supported, build with CSV_WITH_THREADS\n");
+                exit(EXIT_FAILURE);
+#endif
+            case 'o':
+                options.output = optarg;
+                break;
+            case ':':
+                fprintf(stderr, "option `%c` requires an argument\n", optopt);
+                exit(EXIT_FAILURE);
+            case '?':
+                fprintf(stderr, "unknow option: `%c`\n", optopt);
+                exit(EXIT_FAILURE);
+            default:
+                fprintf(stderr, "unreachable! There must be a bug!\n");
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    if (argc - optind > 1) {
+        fprintf(stderr, "There should be at most 1 argument for FILE\n\n");
+        usage(argv[0]);
+    }
+    if (argc - optind == 1 && strcmp(argv[optind], "-") != 0)
+        options.input = argv[optind];
+    if (options.threads > 0 && (options.input == NULL || options.error_policy != CSV_ERRORS_STRICT)) {
+        fprintf(stderr, "-j needs FILE, and can not be used with -e\n");
+        exit(EXIT_FAILURE);
+    }
+    return options;
+}
@@ -8,6 +8,7 @@
 #include <string.h>
 
 #include <mysql/mysql.h>
+#include <pthread.h>
 #include <pwd.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -17,14 +18,18 @@
 /* build:
  * apt install libmysqlclient-dev
  * gcc -c `pkg-config --cflags mysqlclient` example_dump_mysql_db.c csv.c
- * gcc -o example_dump_mysql_db example_dump_mysql_db.o `pkg-config --libs mysqlclient`
+ * gcc -o example_dump_mysql_db example_dump_mysql_db.o csv.o `pkg-config --libs mysqlclient` -pthread
+ *
+ * to support -z, add `-DCSV_WITH_ZLIB -DCSV_WITH_THREADS` to the first command, and `-lz` to the
+ * second one.
  */
 
 
 /* print usage and exit */
 void usage(const char *progname) {
     const char *TMPL = ""
-    "%s [OPTIONS] DB_NAME TABLE_NAME                                                          \n"
+    "%s [OPTIONS] DB_NAME [TABLE_NAME...]                                                     \n"
+    "dump tables into csv files, all tables of DB_NAME if no TABLE_NAME is given.             \n"
     "OPTIONS:                                                                                 \n"
     "-h     host. optional, defaults to localhost                                             \n"
     "-u     user name. optional, defaults to current user                                     \n"
@@ -32,7 +37,14 @@ void usage(const char *progname) {
     "       when specified, will prompt for secure input, do not specify as option argument.  \n"
     "       when not specified, assumes empty password.                                       \n"
     "-P     port. optional, defaults to 3306                                                  \n"
-    "--help print usage info and exit                                                         \n";
+    "-j     number of workers, each with its own connection. optional, defaults to 1          \n"
+    "-c     chunk size. optional, defaults to 0 (not split).                                  \n"
+    "       when specified, a table with an integer primary key is split by ranges of that    \n"
+    "       many key values, into TABLE_NAME.N.csv for the N-th range, dumped concurrently.   \n"
+    "-N     representation of NULL values, e.g. \\N. optional, defaults to empty string        \n"
+    "-z     gzip compression level, 1 (fastest) to 9 (smallest). optional.                    \n"
+    "       when specified, writes TABLE_NAME.csv.gz instead of TABLE_NAME.csv.               \n"
+    "--help print usage info and exit                                                        \n";
     printf(TMPL, progname);
     exit(EXIT_FAILURE);
 }
@@ -43,12 +55,40 @@ typedef struct {
     char user[1024];
     char password[1024];
     char *db;
-    char *table;
+    char **tables;
+    int n_tables;          /* all tables of db are dumped if 0 */
+    int workers;
+    long long chunk_rows;  /* 0 if tables are not split */
+    int gzip_level;        /* 0 if not compressed */
+    const char *null_string; /* written for NULL values */
 } options;
 
+/* a table, or a range of it, dumped into its own file */
+typedef struct {
+    char *table;
+    char key[256];         /* integer primary key, empty if table is not split */
+    long long lo;          /* range of key, [lo, hi] */
+    long long hi;
+    int part;              /* index of range, -1 if table is not split */
+} task;
+
+/* tasks shared by workers */
+typedef struct {
+    const options *opt;
+    task *tasks;
+    int n_tasks;
+    int next;              /* next task to be taken */
+    int failed;            /* count of failed tasks */
+    pthread_mutex_t lock;
+} task_queue;
+
 options parse_options(int argc, char *argv[]);
 MYSQL *connect_db(const char *host, unsigned int port, const char *user, const char *password, const char *db);
-int dump_table_to_csv(MYSQL *conn, const char *table);
+char **list_tables(MYSQL *conn, int *n_tables);
+int plan_table(MYSQL *conn, char *table, long long chunk_rows, task **tasks, int *n_tasks, int *cap);
+void *dump_worker(void *arg);
+int dump_task(MYSQL *conn, const task *t, const options *opt);
+int dump_query_to_csv(MYSQL *conn, const char *sql, const char *filename, const options *opt);
 
 int main(int argc, char *argv[])
 {
@@ -65,11 +105,54 @@ int main(int argc, char *argv[])
         exit(EXIT_FAILURE);
     }
 
-    /* dump to csv */
-    dump_table_to_csv(conn, opt.table);
-
+    /* tables to dump, and split them into tasks */
+    if (opt.n_tables == 0) {
+        opt.tables = list_tables(conn, &opt.n_tables);
+        if (opt.tables == NULL) {
+            mysql_close(conn);
+            mysql_library_end();
+            exit(EXIT_FAILURE);
+        }
+    }
+    task_queue queue = {};
+    queue.opt = &opt;
+    int cap = 0;
+    int i;
+    for (i = 0; i < opt.n_tables; i++) {
+        if (plan_table(conn, opt.tables[i], opt.chunk_rows, &queue.tasks, &queue.n_tasks, &cap) == -1) {
+            mysql_close(conn);
+            mysql_library_end();
+            exit(EXIT_FAILURE);
+        }
+    }
     mysql_close(conn);
+
+    /* dump to csv, each worker takes tasks one by one on its own connection */
+    int n_workers = opt.workers < queue.n_tasks ? opt.workers : queue.n_tasks;
+    pthread_t *threads = malloc(n_workers * sizeof(pthread_t));
+    pthread_mutex_init(&queue.lock, NULL);
+    int started = 0;
+    for (i = 0; i < n_workers; i++) {
+        if (pthread_create(&threads[i], NULL, dump_worker, &queue) != 0) {
+            fprintf(stderr, "create worker thread failed\n");
+            break;
+        }
+        started++;
+    }
+    for (i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    /* tasks not taken, when no worker is started or connected */
+    if (queue.next < queue.n_tasks)
+        queue.failed += queue.n_tasks - queue.next;
+    pthread_mutex_destroy(&queue.lock);
+    free(threads);
+    free(queue.tasks);
+
     mysql_library_end();
+    if (queue.failed > 0) {
+        fprintf(stderr, "%d of %d dumps failed\n", queue.failed, queue.n_tasks);
+        return EXIT_FAILURE;
+    }
     return 0;
 }
 
@@ -84,8 +167,11 @@ options parse_options(int argc, char *argv[])
     options.password[0] = '\0';
     int opt;
     long port;
+    long level;
+    long workers;
+    long long chunk_rows;
     char *endptr;
-    const char *optstring = ":h:u:pP:";
+    const char *optstring = ":h:u:pP:j:c:N:z:";
     int prompt_password = 0;
     while ((opt = getopt(argc, argv, optstring)) != -1) {
         switch (opt) {
@@ -109,6 +195,39 @@ options parse_options(int argc, char *argv[])
             case 'p':
                 prompt_password = 1;
                 break;
+            case 'j':
+                workers = strtol(optarg, &endptr, 10);
+                if (workers <= 0 || workers > 1024 || *endptr != '\0') {
+                    fprintf(stderr, "invalid number of workers, should be between 1 and 1024\n");
+                    exit(EXIT_FAILURE);
+                }
+                options.workers = (int)workers;
+                break;
+            case 'c':
+                chunk_rows = strtoll(optarg, &endptr, 10);
+                if (chunk_rows < 0 || *endptr != '\0') {
+                    fprintf(stderr, "invalid chunk size, should be a positive number\n");
+                    exit(EXIT_FAILURE);
+                }
+                options.chunk_rows = chunk_rows;
+                break;
+            case 'N':
+                options.null_string = optarg;
+                break;
+            case 'z':
+#ifdef CSV_WITH_ZLIB
+                level = strtol(optarg, &endptr, 10);
+                if (level < 1 || level > 9 || *endptr != '\0') {
+                    fprintf(stderr, "invalid gzip compression level, should be between 1 and 9\n");
+                    exit(EXIT_FAILURE);
+                }
+                options.gzip_level = (int)level;
+                break;
+#else
+                (void)level;
+                fprintf(stderr, "gzip compression is not supported, build with CSV_WITH_ZLIB\n");
+                exit(EXIT_FAILURE);
+#endif
             case ':':
                 fprintf(stderr, "option `%c` requires an argument\n", optopt);
                 exit(EXIT_FAILURE);
@@ -121,17 +240,22 @@ options parse_options(int argc, char *argv[])
         }
     }
 
-    if (argc - optind != 2) {
-        fprintf(stderr, "There should be 2 arguments for DB_NAME and TABLE_NAME\n\n");
+    if (argc - optind < 1) {
+        fprintf(stderr, "There should be at least 1 argument for DB_NAME\n\n");
         usage(argv[0]);
     } else {
         options.db = argv[optind];
-        options.table = argv[optind + 1];
+        options.tables = argv + optind + 1;
+        options.n_tables = argc - optind - 1;
     }
 
     /* defaults for options */
     if (options.host == NULL)
         options.host = "localhost";
+    if (options.workers == 0)
+        options.workers = 1;
+    if (options.null_string == NULL)
+        options.null_string = "";
     if (options.port == 0)
         options.port = 3306;
     if (options.user[0] == '\0') {
@@ -174,24 +298,200 @@ MYSQL *connect_db(const char *host, unsigned int port, const char *user, const c
     return conn;
 }
 
-int dump_table_to_csv(MYSQL *conn, const char *table)
+/* names of all tables in the current database, which are never freed.
+ * returns NULL when fails */
+char **list_tables(MYSQL *conn, int *n_tables)
+{
+    if (mysql_query(conn, "SHOW TABLES") != 0) {
+        fprintf(stderr, "MySQL error: %s\n", mysql_error(conn));
+        return NULL;
+    }
+    MYSQL_RES *result = mysql_store_result(conn);
+    if (result == NULL) {
+        fprintf(stderr, "MySQL error: %s\n", mysql_error(conn));
+        return NULL;
+    }
+
+    char **tables = malloc((mysql_num_rows(result) + 1) * sizeof(char *));
+    MYSQL_ROW row = NULL;
+    *n_tables = 0;
+    while ((row = mysql_fetch_row(result)) != NULL)
+        tables[(*n_tables)++] = strdup(row[0]);
+    mysql_free_result(result);
+    return tables;
+}
+
+/* run a query returning one row, and copy its fields, NULL as empty string.
+ * returns count of fields, 0 if there is no row, -1 when fails */
+static int query_row(MYSQL *conn, const char *sql, char values[][256], int n_values)
+{
+    if (mysql_query(conn, sql) != 0) {
+        fprintf(stderr, "MySQL error: %s\n", mysql_error(conn));
+        return -1;
+    }
+    MYSQL_RES *result = mysql_store_result(conn);
+    if (result == NULL) {
+        fprintf(stderr, "MySQL error: %s\n", mysql_error(conn));
+        return -1;
+    }
+    int n = 0;
+    MYSQL_ROW row = mysql_fetch_row(result);
+    if (row != NULL && mysql_num_rows(result) == 1) {
+        int n_fields = mysql_num_fields(result);
+        for (n = 0; n < n_fields && n < n_values; n++)
+            snprintf(values[n], 256, "%s", row[n] != NULL ? row[n] : "");
+    }
+    mysql_free_result(result);
+    return n;
+}
+
+/* whether DATA_TYPE in information_schema is an integer type */
+static int is_integer_type(const char *type)
+{
+    const char *INTEGER_TYPES[] = {"tinyint", "smallint", "mediumint", "int", "bigint"};
+    size_t i;
+    for (i = 0; i < sizeof(INTEGER_TYPES) / sizeof(INTEGER_TYPES[0]); i++) {
+        if (strcmp(type, INTEGER_TYPES[i]) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+/* append tasks dumping table, one for each range of chunk_rows values of its primary key if it is
+ * a single integer column, or one for the whole table.
+ * returns 0 when succeeds, -1 when fails */
+int plan_table(MYSQL *conn, char *table, long long chunk_rows, task **tasks, int *n_tasks, int *cap)
+{
+    char key[256] = "";
+    long long lo = 0, hi = -1;
+
+    if (chunk_rows > 0) {
+        char escaped[2 * 256 + 1];
+        char sql[2048];
+        char values[2][256];
+        if (strlen(table) >= 256) {
+            fprintf(stderr, "table name too long: %s\n", table);
+            return -1;
+        }
+        mysql_real_escape_string(conn, escaped, table, strlen(table));
+        sprintf(sql,
+                "SELECT c.COLUMN_NAME, c.DATA_TYPE FROM information_schema.KEY_COLUMN_USAGE k "
+                "JOIN information_schema.COLUMNS c ON c.TABLE_SCHEMA = k.TABLE_SCHEMA "
+                "AND c.TABLE_NAME = k.TABLE_NAME AND c.COLUMN_NAME = k.COLUMN_NAME "
+                "WHERE k.TABLE_SCHEMA = DATABASE() AND k.TABLE_NAME = '%s' AND k.CONSTRAINT_NAME = 'PRIMARY'",
+                escaped);
+        int n = query_row(conn, sql, values, 2);
+        if (n == -1)
+            return -1;
+        if (n == 2 && is_integer_type(values[1])) {
+            sprintf(sql, "SELECT MIN(`%s`), MAX(`%s`) FROM `%s`", values[0], values[0], table);
+            char range[2][256];
+            char *end_lo, *end_hi;
+            if (query_row(conn, sql, range, 2) == -1)
+                return -1;
+            errno = 0;
+            lo = strtoll(range[0], &end_lo, 10);
+            hi = strtoll(range[1], &end_hi, 10);
+            /* not split if empty or out of range */
+            if (range[0][0] != '\0' && *end_lo == '\0' && *end_hi == '\0' && errno == 0 && lo <= hi)
+                snprintf(key, sizeof(key), "%s", values[0]);
+        }
+    }
+
+    int split = key[0] != '\0';
+    int part = 0;
+    while (1) {
+        if (*n_tasks == *cap) {
+            *cap = *cap > 0 ? *cap * 2 : 64;
+            *tasks = realloc(*tasks, *cap * sizeof(task));
+        }
+        task *t = &(*tasks)[(*n_tasks)++];
+        t->table = table;
+        snprintf(t->key, sizeof(t->key), "%s", key);
+        t->part = split ? part++ : -1;
+        t->lo = lo;
+        /* in unsigned, so that a range wider than LLONG_MAX does not overflow */
+        if (split && (unsigned long long)hi - (unsigned long long)lo >= (unsigned long long)chunk_rows)
+            t->hi = lo + chunk_rows - 1;
+        else
+            t->hi = hi;
+        if (!split || t->hi == hi)
+            return 0;
+        lo = t->hi + 1;
+    }
+}
+
+/* take tasks from queue and dump them, on a connection of its own.
+ * a worker which can not connect takes no task, leaving them to the others */
+void *dump_worker(void *arg)
+{
+    task_queue *queue = arg;
+    const options *opt = queue->opt;
+    MYSQL *conn = connect_db(opt->host, opt->port, opt->user, opt->password, opt->db);
+    if (conn == NULL) {
+        mysql_thread_end();
+        return NULL;
+    }
+
+    while (1) {
+        pthread_mutex_lock(&queue->lock);
+        int idx = queue->next++;
+        pthread_mutex_unlock(&queue->lock);
+        if (idx >= queue->n_tasks)
+            break;
+        if (dump_task(conn, &queue->tasks[idx], opt) == -1) {
+            pthread_mutex_lock(&queue->lock);
+            queue->failed++;
+            pthread_mutex_unlock(&queue->lock);
+        }
+    }
+
+    mysql_close(conn);
+    mysql_thread_end();
+    return NULL;
+}
+
+/* dump a task to TABLE.csv, or TABLE.N.csv for the N-th range of a split table.
+ * returns 0 when succeeds, -1 when fails */
+int dump_task(MYSQL *conn, const task *t, const options *opt)
+{
+    const char *suffix = opt->gzip_level > 0 ? ".gz" : "";
+    char filename[512];
+    char sql[1024];
+    if (t->part < 0) {
+        snprintf(filename, sizeof(filename), "%s.csv%s", t->table, suffix);
+        snprintf(sql, sizeof(sql), "SELECT * FROM `%s`", t->table);
+    } else {
+        snprintf(filename, sizeof(filename), "%s.%d.csv%s", t->table, t->part, suffix);
+        snprintf(sql, sizeof(sql), "SELECT * FROM `%s` WHERE `%s` BETWEEN %lld AND %lld",
+                 t->table, t->key, t->lo, t->hi);
+    }
+    return dump_query_to_csv(conn, sql, filename, opt);
+}
+
+/* dump result of query to the csv file at filename, with column names as the first row.
+ * it is written compressed if gzip_level > 0.
+ * fields are written from buffers of MySQL client directly, with lengths it has, so there is no
+ * copy or strlen for them.
+ * returns 0 when succeeds, -1 when fails */
+int dump_query_to_csv(MYSQL *conn, const char *sql, const char *filename, const options *opt)
 {
     FILE *file = NULL;
     MYSQL_RES *result = NULL;
     csv_error_t *err = NULL;
     csv_writer_t *csv_writer = NULL;
-    csv_row_t *csv_row = NULL;
-
-    char filename[256];
-    sprintf(filename, "%s.csv", table);
-    file = fopen(filename, "w");
-    if (file == NULL) {
-        fprintf(stderr, "open file %s failed: %s", filename, strerror(errno));
-        goto FAILURE_RETURN;
+    const char **fields = NULL;
+    size_t *lens = NULL;
+    int gzip_level = opt->gzip_level;
+
+    if (gzip_level == 0) {
+        file = fopen(filename, "w");
+        if (file == NULL) {
+            fprintf(stderr, "open file %s failed: %s", filename, strerror(errno));
+            goto FAILURE_RETURN;
+        }
     }
 
-    char sql[1024];
-    sprintf(sql, "SELECT * FROM `%s`", table);
     if (mysql_query(conn, sql) != 0) {
         fprintf(stderr, "MySQL error: %s\n", mysql_error(conn));
         goto FAILURE_RETURN;
@@ -203,62 +503,94 @@ int dump_table_to_csv(MYSQL *conn, const char *table)
         goto FAILURE_RETURN;
     }
 
-    csv_writer = csv_writer_default(file, &err);
+    if (file != NULL) {
+        csv_writer = csv_writer_default(file, &err);
+    } else {
+#ifdef CSV_WITH_ZLIB
+        /* compressed on a helper thread, while rows are fetched and formatted */
+        csv_sink_t sink;
+        if (csv_sink_gzip(&sink, filename, gzip_level, &err) == -1) {
+            fprintf(stderr, "open file %s failed: %s\n", filename, err->message);
+            goto FAILURE_RETURN;
+        }
+#ifdef CSV_WITH_THREADS
+        if (csv_sink_async(&sink, &err) == -1) { /* compress on this thread then */
+            csv_error_free(err);
+            err = NULL;
+        }
+#endif
+        csv_writer = csv_writer_new_sink(&sink, ',', QUOTE_MINIMAL, LINEBREAK_LF, &err);
+#endif
+    }
     if (csv_writer == NULL) {
         fprintf(stderr, "create csv writer failed: %s\n", err->message);
         goto FAILURE_RETURN;
     }
 
-    csv_row = csv_row_new(&err);
-    if (csv_row == NULL) {
-        fprintf(stderr, "create csv row failed: %s\n", err->message);
+    /* fields of a row, and their lengths */
+    int i = 0;
+    int n_fields = mysql_num_fields(result);
+    fields = malloc((n_fields + 1) * sizeof(char *));
+    lens = malloc((n_fields + 1) * sizeof(size_t));
+    if (fields == NULL || lens == NULL) {
+        fprintf(stderr, "out of memory\n");
         goto FAILURE_RETURN;
     }
 
     /* write column names to csv file*/
     MYSQL_FIELD *field = NULL;
-    while ((field = mysql_fetch_field(result)) != NULL) {
-        if (csv_row_append_field(csv_row, field->name, field->name_length, &err) == -1) {
-            fprintf(stderr, "append field to csv row failed: %s\n", err->message);
-            goto FAILURE_RETURN;
-        }
+    for (i = 0; i < n_fields && (field = mysql_fetch_field(result)) != NULL; i++) {
+        fields[i] = field->name;
+        lens[i] = field->name_length;
     }
-    if (csv_write_row(csv_writer, csv_row, &err) == -1) {
+    if (csv_write_fields(csv_writer, fields, lens, n_fields, &err) == -1) {
         fprintf(stderr, "write csv row to file failed: %s\n", err->message);
         goto FAILURE_RETURN;
     }
-    /* for reuse */
-    csv_row_reset(csv_row);
 
     /* write each row to csv */
-    int i = 0;
-    int n_fields = mysql_num_fields(result);
+    size_t null_len = strlen(opt->null_string);
     MYSQL_ROW row = NULL;
     while ((row = mysql_fetch_row(result)) != NULL) {
+        unsigned long *lengths = mysql_fetch_lengths(result);
         for (i = 0; i < n_fields; i++) {
-            if (csv_row_append_field(csv_row, row[i], strlen(row[i]), &err) == -1) {
-                fprintf(stderr, "append field to csv row failed: %s\n", err->message);
-                goto FAILURE_RETURN;
+            if (row[i] == NULL) {
+                fields[i] = opt->null_string;
+                lens[i] = null_len;
+            } else {
+                fields[i] = row[i];
+                lens[i] = lengths[i];
             }
         }
 
-        if (csv_write_row(csv_writer, csv_row, &err) == -1) {
+        if (csv_write_fields(csv_writer, fields, lens, n_fields, &err) == -1) {
             fprintf(stderr, "write csv row to file failed: %s\n", err->message);
             goto FAILURE_RETURN;
         }
-        /* for reuse */
-        csv_row_reset(csv_row);
+    }
+    if (mysql_errno(conn) != 0) {
+        fprintf(stderr, "MySQL error: %s\n", mysql_error(conn));
+        goto FAILURE_RETURN;
     }
 
-    csv_row_free(csv_row);
-    csv_writer_free(csv_writer);
+    /* closing finishes the compressed stream, so its errors should be checked too */
+    int res = csv_writer_close(csv_writer, &err);
+    csv_writer = NULL;
+    if (res == -1) {
+        fprintf(stderr, "write csv row to file failed: %s\n", err->message);
+        goto FAILURE_RETURN;
+    }
+
+    free(fields);
+    free(lens);
     mysql_free_result(result);
-    fclose(file);
+    if (file != NULL)
+        fclose(file);
     return 0; /* succeed */
 
 FAILURE_RETURN:
-    if (csv_row != NULL)
-        csv_row_free(csv_row);
+    free(fields);
+    free(lens);
     if (csv_writer != NULL)
         csv_writer_free(csv_writer);
     if (err != NULL)
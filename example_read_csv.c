@@ -45,7 +45,8 @@ int main(int argc, char *argv[])
     }
 
     if (err != NULL) {
-        fprintf(stderr, "parse csv failed: code=%d, message=%s\n", err->error_code, err->message);
+        fprintf(stderr, "parse csv failed at row %zu, column %d: code=%d, message=%s\n",
+                err->row, err->column, err->error_code, err->message);
         csv_error_free(err);
         csv_parser_free(parser);
         fclose(file);